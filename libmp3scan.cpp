@@ -0,0 +1,3559 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#ifdef __linux__
+	#include <sys/ioctl.h>
+	#include <sys/mman.h>
+	#include <sys/sendfile.h>
+	#include <linux/if_alg.h>
+	#include <linux/fs.h>
+	#include <linux/fiemap.h>
+	#include <sys/syscall.h>
+	#include <sys/sysmacros.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+#endif
+#include <id3/tag.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <deque>
+#include <algorithm>
+
+#include "mp3scan.h"
+
+/*
+ libmp3scan - the scanner of mp3_scan, see mp3scan.h
+
+ Every scan has its own SCANCTX: no global state is used, except by id3lib.
+*/
+
+#define FALSE 0
+#define TRUE  1
+
+#define QUARANTINE_RETRY 4										// deadline multiplier for the quarantine retry pass
+#define ART_PREFIX       1024									// bytes of an APIC frame read to find the image data
+#define FILTER_DEAD      0										// DFA state that can't match anything anymore
+#define TEXT_PREFIX      ( 2 * MP3SCAN_TITLE_LEN + 3 )			// bytes of a text frame that can fill a tag field
+#define JOBS_START       4										// first level of MP3SCAN_JOBS_AUTO
+#define JOBS_WINDOW      100000									// us, shortest measure window of the governor
+#define JOBS_WINDOW_MAX  2000000								// us, longest
+#define JOBS_HOLD        4										// windows kept at a level before probing again
+#define SIZE_DENTS       65536									// bytes of directory entries read at once by mp3scan_sizes()
+
+#define SYNCSAFE( p ) ( (off_t)( ( (p)[0] & 0x7f ) << 21 | ( (p)[1] & 0x7f ) << 14 | ( (p)[2] & 0x7f ) << 7 | ( (p)[3] & 0x7f ) ) )
+
+#ifdef __APPLE__
+#define ST_MTIME_NS( st ) ( (long long)(st).st_mtimespec.tv_sec * 1000000000LL + (st).st_mtimespec.tv_nsec )
+#else
+#define ST_MTIME_NS( st ) ( (long long)(st).st_mtim.tv_sec * 1000000000LL + (st).st_mtim.tv_nsec )
+#endif
+
+#define CHECKBUFFERS( A, B, C, D ) \
+	if( A[0] != '\0' && B[0] != '\0' && strcmp( A, B ) != 0 && choose != NULL && choose( C, A, B, D, user ) ) A[0] = '\0'; \
+	if( A[0] == '\0' && B[0] != '\0' ) strcpy( A, B );
+
+typedef unsigned char byte;
+
+typedef struct {												// where the tag parsers read: a file, or its tags in memory
+	int         fd;													// -1: the buffers
+	off_t       size;
+	const byte *head;												// first headlen bytes of the file
+	size_t      headlen;
+	const byte *tail;												// last taillen bytes
+	size_t      taillen;
+} TAGSOURCE;
+
+typedef struct {												// watchdog reader thread control block
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	char    szFileName[PATH_MAX];
+	off_t   Size;
+	byte    Version;
+	TAGINFO Info;
+	bool    bBusy;
+	bool    bAbandoned;
+} READER;
+
+struct READJOB {												// file handed to the reader pool
+	std::string File;
+	std::string FileName;
+	std::string RelPath;
+	off_t       Size;
+	time_t      MTime;
+	bool        bReplaces;
+	long long   start;												// when a reader took it (us), 0 = still queued
+	long long   usec;												// time of the read
+	bool        bAbandoned;											// past the deadline: its reader frees it and quits
+	TAGINFO     Info;
+};
+
+struct POOL {													// reader threads of MP3SCAN_OPTIONS.jobs
+	pthread_mutex_t lock;
+	pthread_cond_t  work;											// the readers wait for jobs
+	pthread_cond_t  done;											// the scan waits for results
+	std::deque<READJOB*>  queue;									// not taken yet
+	std::vector<READJOB*> running;
+	std::deque<READJOB*>  finished;									// read, not collected yet
+	byte Version;
+	int  threads;													// readers, not counting the ones stuck in an abandoned read
+	int  refs;														// threads + the scan, the last one frees the pool
+	bool bStop;
+};
+
+typedef struct {												// the reads in flight, adapted to the throughput with MP3SCAN_JOBS_AUTO
+	int       limit;
+	int       base;													// level kept, 0 = none yet
+	double    baseRate;												//   and its files/s
+	bool      bSlowStart;											// doubling the level until the rate stops growing
+	bool      bProbeDown;											// next probe from the base level
+	int       hold;													// windows to wait before the next probe
+	long long wstart;												// current window: start (us),
+	int       wdone;												//   reads completed
+	bool      wfull;												//   and the scan had to wait for a reader
+} GOVERNOR;
+
+typedef struct {												// file that did not answer within the deadline
+	std::string File;
+	std::string FileName;
+	std::string RelPath;
+	off_t       Size;
+	time_t      MTime;
+	bool        bReplaces;
+} QUARANTINE;
+
+struct KNOWNFILE {												// file of the previous scan
+	std::string name;
+	long long   size;
+	long long   mtime;
+	bool        bSeen;
+
+	KNOWNFILE() : size( -1 ), mtime( -1 ), bSeen( FALSE ) {}
+};
+
+struct DIRSTATE {												// directory of the previous scan
+	long long   mtime;											// nanoseconds, -1 if unknown
+	int         entries;
+	int         nsubdirs;										// subdirectories found by the last enumeration
+	std::vector<KNOWNFILE>   files;								// sorted by name
+	std::vector<std::string> subdirs;							// names of the known subdirectories
+	bool        bSeen;
+
+	DIRSTATE() : mtime( -1 ), entries( 0 ), nsubdirs( -1 ), bSeen( FALSE ) {}
+};
+
+struct PENDING {												// mp3 file waiting to be read in disk order
+	std::string name;
+	int         dir;											// its directory in SCANCTX.pendingDirs, for the batch of the whole scan
+	off_t       size;											// what scan_file needs of its stat()
+	time_t      mtime;
+	dev_t       dev;
+	ino_t       ino;
+	nlink_t     nlink;
+	KNOWNFILE  *known;
+	unsigned long long key;										// physical offset or inode number
+};
+
+struct DIRWAIT {												// directory whose record waits for the reads of its files
+	int       files;											// queued, in flight or quarantined
+	bool      bDone;											// enumerated, the record below is ready
+	bool      bDirty;											// a file of it failed the quarantine retry
+	long long mtime;
+	int       entries;
+	int       subdirs;
+
+	DIRWAIT() : files( 0 ), bDone( FALSE ), bDirty( FALSE ), mtime( -1 ), entries( 0 ), subdirs( 0 ) {}
+};
+
+typedef struct {												// inodes of one device, open addressing
+	dev_t  dev;
+	int    width;													// words per slot: 1 while every inode fits in 32 bits, then 2
+	size_t mask;													// slots - 1
+	size_t count;
+	std::vector<unsigned int> slots;								// inode + 1, 0 = empty
+	std::vector<unsigned int> values;								// value of every slot, with INOSET.bValues
+} INOTABLE;
+
+typedef struct {												// set of (dev, ino), optionally with a value each
+	std::vector<INOTABLE> tables;									// a few devices at most
+	bool bValues;
+} INOSET;
+
+typedef enum {													// node of a compiled glob
+	GLOB_CHAR,														// c
+	GLOB_ANY,														// ?
+	GLOB_CLASS,														// [...]
+	GLOB_STAR,														// *
+	GLOB_DSTAR,														// ** at the end
+	GLOB_DSLASH,													// **/ (any directories, or none), always followed by
+	GLOB_DSKIP,														//   the name of a directory it skips
+	GLOB_END														// the rule matches
+} GLOBTYPE;
+
+typedef struct {
+	GLOBTYPE type;
+	int      arg;													// GLOB_CHAR: the byte, GLOB_CLASS: its set, GLOB_END: the rule
+} GLOBNODE;
+
+struct MP3SCAN_FILTER {
+	std::vector<GLOBNODE>   nodes;									// the NFA: the nodes of every rule, each one ends with GLOB_END
+	std::vector<int>        starts;									// first node of every rule
+	std::vector<bool>       include;								// of every rule
+	std::vector<bool>       dironly;								// of every rule: pattern with a trailing '/'
+	std::vector<std::vector<bool> > sets;							// GLOB_CLASS byte sets
+	// the DFA, built on demand: a state is a set of NFA nodes
+	std::map<std::vector<int>, int> ids;
+	std::vector<std::vector<int> >  states;
+	std::vector<int>        next;									// 256 transitions per state, -1 = not computed yet
+	std::vector<int>        rulefile;								// first rule matching a file in a state, -1 = none
+	std::vector<int>        ruledir;								//   and a directory
+};
+
+struct MP3SCAN_INDEX {
+	std::string root;
+	bool        relpath;
+	bool        bLinked;										// files sorted and subdirs filled
+	std::unordered_map<std::string, DIRSTATE> dirs;				// key is the path relative to the root
+};
+
+typedef struct {												// state of a scan
+	const MP3SCAN_OPTIONS *opt;
+	MP3SCAN_CALLBACK       callback;
+	void                  *user;
+	MP3SCAN_STATS         *stats;
+	MP3SCAN_INDEX         *index;
+	READER                *reader;
+	POOL                  *pool;								// with opt->jobs, NULL until the first file
+	GOVERNOR               gov;
+	int                    inflight;							// files handed to the pool and not collected
+	std::vector<QUARANTINE> quarantine;
+	std::vector<PENDING>    pending;							// batch of the whole scan (MP3SCAN_ORDER_SCAN)
+	std::vector<std::string> pendingDirs;						//   and the directories of its files
+	std::unordered_map<std::string, DIRWAIT> waiting;			// directories whose files are not all read yet
+	bool  bAbort;
+	int   FilterState;											// DFA state of the filter after "/" + szRelativePath
+	int   nExcluded;											// entries of the current directory excluded
+	dev_t RootDev;
+	INOSET Dirs;												// directories entered, breaks the symlink loops
+	INOSET Files;												// with opt->dedup_files: hard linked files read, value = Originals index
+	std::vector<std::string> Originals;							// their path relative to the root
+	char  szRoot[PATH_MAX];										// absolute path of the root
+	char  szRelativePath[PATH_MAX];								// current directory relative to the root
+	char  szPath[PATH_MAX];
+	char  szFile[PATH_MAX];
+	char  szTitle[MP3SCAN_TITLE_LEN];
+	char  szArtist[MP3SCAN_TITLE_LEN];
+	char  szAlbum[MP3SCAN_TITLE_LEN];
+	char  szYear[MP3SCAN_YEAR_LEN];
+	char  szArt[MP3SCAN_HASH_LEN];
+	char  szAlias[PATH_MAX];
+	TAGINFO Info;
+	byte  ReadFlags;											// tag versions and MP3SCAN_ART for read_tags
+	int   ArtDir;												// opt->art_dir, -1 if not used
+	int   ArtAlg;												// kernel hash socket, -1 not opened yet, -2 not available
+	int   ArtPipe[2];
+} SCANCTX;
+
+struct SIZEDIR {												// directory of mp3scan_sizes()
+	std::string rel;											// relative to the root: "" or "a/b/"
+	int         state;											// filter state of its entries
+	long long   files;
+	long long   bytes;
+};
+
+typedef struct {												// entry of mp3scan_sizes(), as much as statx() was asked
+	mode_t    mode;
+	long long size;
+	dev_t     dev;
+	ino_t     ino;
+	nlink_t   nlink;
+} SIZESTAT;
+
+typedef struct {												// state of mp3scan_sizes()
+	const MP3SCAN_OPTIONS *opt;
+	MP3SCAN_STATS         *stats;
+	int    RootFd;
+	dev_t  RootDev;
+	pthread_mutex_t lock;										// of everything below, of stats and of the DFA of opt->filter
+	pthread_cond_t  cond;
+	std::vector<SIZEDIR> todo;									// directories to enumerate
+	std::vector<SIZEDIR> done;									// enumerated, with mp3 files, to call back
+	int    busy;												// threads enumerating a directory
+	bool   bAbort;
+	INOSET Dirs;												// directories entered, breaks the symlink loops
+	INOSET Files;												// with opt->dedup_files: hard linked files counted
+} SIZECTX;
+
+/*
+ * Prototype specifications
+ */
+
+static MP3SCAN_RESULT scan_loop( SCANCTX* ctx, int dirfd, const struct stat* dinfo );
+static void scan_subdir( SCANCTX* ctx, int dirfd, const char* pName, const struct stat* finfo, int state );
+static int  filter_entry( SCANCTX* ctx, const char* pName, bool bDir );
+static void* size_thread( void *arg );
+static void size_dir( SIZECTX* ctx, SIZEDIR* d, std::vector<SIZEDIR>& subdirs );
+static void size_entry( SIZECTX* ctx, int dirfd, SIZEDIR* d, const char* pName, unsigned char type, std::vector<SIZEDIR>& subdirs );
+static bool size_stat( int dirfd, const char* pName, bool bFull, SIZESTAT* st );
+static int  size_filter( SIZECTX* ctx, int state, const char* pName, bool bDir );
+static int  filter_state( MP3SCAN_FILTER* f, const std::vector<int>& set );
+static int  filter_step( MP3SCAN_FILTER* f, int state, byte c );
+static int  filter_feed( MP3SCAN_FILTER* f, int state, const char* str );
+static void filter_closure( const MP3SCAN_FILTER* f, int node, std::vector<int>& set );
+static bool inoset_insert( INOSET* set, dev_t dev, ino_t ino, unsigned int value, unsigned int* found );
+static void inotable_resize( INOTABLE* t, size_t slots, int width, bool bValues );
+static unsigned long long inotable_key( const INOTABLE* t, size_t i );
+static void scan_file( SCANCTX* ctx, const char* pName, const struct stat* finfo, KNOWNFILE* known );
+static void queue_file( SCANCTX* ctx, std::vector<PENDING>& batch, const char* pName, const struct stat* finfo, KNOWNFILE* known );
+static void read_pending( SCANCTX* ctx, std::vector<PENDING>& batch, int dirfd );
+static bool file_extent( SCANCTX* ctx, int dirfd, const PENDING* p, unsigned long long* offset );
+static bool pending_less( const PENDING& a, const PENDING& b );
+static KNOWNFILE* find_known_file( DIRSTATE* known, const char* pName );
+static void remove_unseen_files( SCANCTX* ctx, DIRSTATE* known );
+static void remove_unseen_subdirs( SCANCTX* ctx, DIRSTATE* known );
+static void remove_subtree( SCANCTX* ctx, const std::string& rel );
+static bool record_path( SCANCTX* ctx, const char* pRel, char* szPath );
+static bool record_to_rel( const MP3SCAN_INDEX* idx, const char* pPath, std::string& rel );
+static void index_link( MP3SCAN_INDEX* idx );
+static void emit( SCANCTX* ctx, MP3SCAN_RECORD* rec );
+static void emit_file( SCANCTX* ctx, MP3SCAN_EVENT event, const char* pRel, const char* pFileName, off_t size, time_t mtime, bool bReplaces );
+static void emit_dir( SCANCTX* ctx, MP3SCAN_EVENT event, const char* pRel, long long mtime, int entries, int subdirs );
+static void dir_record( SCANCTX* ctx, long long mtime, int entries, int subdirs );
+static void dir_hold( SCANCTX* ctx, const char* pRel );
+static void dir_release( SCANCTX* ctx, const char* pRel, bool bDirty );
+static void get_id3_tag( SCANCTX* ctx, const char* pFileName, const struct stat* finfo, bool bReplaces );
+static bool tag_record( SCANCTX* ctx, const char* pFile, const char* pFileName, const char* pRel, off_t size, time_t mtime, bool bReplaces, int deadline );
+static void tag_emit( SCANCTX* ctx, const TAGINFO* Info, const char* pFile, const char* pFileName, const char* pRel, off_t size, time_t mtime, bool bReplaces );
+static bool get_tags( SCANCTX* ctx, const char *filename, off_t size, int deadline );
+static void tag_fields( SCANCTX* ctx, const char *filename, const TAGINFO *Info );
+static bool id3v2_parse( const TAGSOURCE *src, byte Version, TAGINFO *Info, bool *pText );
+static void id3v1_parse( const TAGSOURCE *src, TAGINFO *Info );
+static ssize_t tag_pread( const TAGSOURCE *src, void *buf, size_t n, off_t offset );
+static bool tag_parse( const TAGSOURCE *src, byte Version, TAGINFO *Info );
+static int  text_field( const byte *id, int major, TAGINFO *Info, char **dst, size_t *cap );
+static ssize_t resync( byte *p, ssize_t n );
+static void id3lib_text( ID3_Tag *Tag, ID3_FrameID id, char *dst, size_t cap );
+static bool put_utf8( unsigned int c, char *dst, size_t *o, size_t cap );
+static size_t ascii_scalar( const byte *src, size_t n, int width, bool bBig, char *dst );
+static size_t ascii_kernel( const byte *src, size_t n, int width, bool bBig, char *dst );
+static off_t big_endian( const byte* p, int n );
+static int  art_header( const byte *buf, int len, int major, int *type, char *mime );
+static const char* art_extension( const char* pMime );
+static void art_store( SCANCTX* ctx, const char* pFile, const TAGINFO* Info );
+static bool art_copy( int fd, int out, off_t offset, off_t length );
+static bool art_hash_kernel( SCANCTX* ctx, int fd, off_t offset, off_t length, byte *digest );
+static bool art_hash( int fd, off_t offset, off_t length, byte *digest );
+static void sha256_block( unsigned int *h, const byte *p );
+static void art_release( SCANCTX* ctx );
+static void* cache_map( int fd, off_t size, std::vector<byte>& resident );
+static void cache_drop( int fd, void* map, off_t size, const std::vector<byte>& before, long long* pages, long long* kept );
+static void* reader_thread( void *arg );
+static bool read_tags_deadline( SCANCTX* ctx, const char *filename, off_t size, int deadline, TAGINFO *Info );
+static void reader_release( SCANCTX* ctx );
+static void pool_submit( SCANCTX* ctx, const char* pFile, const char* pFileName, const struct stat* finfo, bool bReplaces );
+static void pool_collect( SCANCTX* ctx );
+static void pool_spawn( SCANCTX* ctx );
+static void* pool_thread( void *arg );
+static void pool_release( SCANCTX* ctx );
+static void governor_tick( SCANCTX* ctx );
+static bool governor_step( GOVERNOR* g, long long now, double* pRate );
+static long long monotonic_usec();
+static void quarantine_retry( SCANCTX* ctx );
+static void latency_count( MP3SCAN_STATS* stats, const char* pFile, long long usec );
+static void slowest_add( MP3SCAN_STATS* stats, const char* pFile, long long usec );
+static void message( SCANCTX* ctx, MP3SCAN_MSGLEVEL level, const char* szFormat, ... );
+
+/*
+ * Procedures
+ */
+
+
+// Default options: non recursive scan of the root, ID3v1 and ID3v2, absolute paths
+void mp3scan_default_options( MP3SCAN_OPTIONS *opt ){
+
+	memset( opt, 0, sizeof(MP3SCAN_OPTIONS) );
+	opt->tagversion = MP3SCAN_ID3V1 | MP3SCAN_ID3V2;
+}
+
+
+// Scan root calling back every record found
+MP3SCAN_RESULT mp3scan_scan( const char *root, const MP3SCAN_OPTIONS *opt, MP3SCAN_CALLBACK callback, void *user, MP3SCAN_STATS *stats ){
+
+	char szDir[PATH_MAX];
+	MP3SCAN_STATS LocalStats;
+	MP3SCAN_RESULT ret;
+	struct stat dinfo, rinfo;
+	int fd;
+
+	if( opt->filename_format != NULL && !check_filename_format( opt->filename_format ) )
+		return MP3SCAN_BAD_FORMAT;
+
+	memset( &LocalStats, 0, sizeof(LocalStats) );
+
+	SCANCTX *ctx = new SCANCTX();
+	ctx->opt       = opt;
+	ctx->callback  = callback;
+	ctx->user      = user;
+	ctx->stats     = stats != NULL ? stats : &LocalStats;
+	ctx->index     = opt->previous;
+	ctx->reader    = NULL;
+	ctx->pool      = NULL;
+	ctx->inflight  = 0;
+	ctx->bAbort    = FALSE;
+	ctx->ReadFlags = opt->tagversion | ( opt->art_dir != NULL ? MP3SCAN_ART : 0 ) | ( opt->no_cache_pollution ? MP3SCAN_NOCACHE : 0 );
+	ctx->ArtDir    = -1;
+	ctx->ArtAlg    = -1;
+
+	if( opt->art_dir != NULL && ( ctx->ArtDir = open( opt->art_dir, O_RDONLY | O_DIRECTORY ) ) < 0 ){
+		delete ctx;
+		return MP3SCAN_ART_DIR_ERROR;
+	}
+
+	if( realpath( root, ctx->szRoot ) == NULL ){
+		art_release( ctx );
+		delete ctx;
+		return MP3SCAN_OPENDIR_ERROR;
+	}
+
+	if( ctx->index != NULL )
+		index_link( ctx->index );
+
+	if( snprintf( ctx->szRelativePath, PATH_MAX, "%s", opt->subdir != NULL ? opt->subdir : "" ) >= PATH_MAX ||
+		snprintf( szDir, PATH_MAX, "%s/%s", ctx->szRoot, ctx->szRelativePath ) >= PATH_MAX ){
+		art_release( ctx );
+		delete ctx;
+		return MP3SCAN_OPENDIR_ERROR;
+	}
+
+	if( opt->filter != NULL )										// paths are matched from the root, as "/a/b/"
+		ctx->FilterState = filter_feed( opt->filter, filter_feed( opt->filter, filter_state( opt->filter, opt->filter->starts ), "/" ), ctx->szRelativePath );
+
+	if( ( fd = open( szDir, O_RDONLY | O_DIRECTORY ) ) < 0 || fstat( fd, &dinfo ) != 0 ){
+		if( fd >= 0 )
+			close( fd );
+		art_release( ctx );
+		delete ctx;
+		return MP3SCAN_OPENDIR_ERROR;
+	}
+
+	ctx->RootDev = dinfo.st_dev;
+	ctx->Files.bValues = TRUE;
+	inoset_insert( &ctx->Dirs, dinfo.st_dev, dinfo.st_ino, 0, NULL );
+	if( ctx->szRelativePath[0] != '\0' && stat( ctx->szRoot, &rinfo ) == 0 ){	// a link back to the root is a loop too
+		ctx->RootDev = rinfo.st_dev;
+		inoset_insert( &ctx->Dirs, rinfo.st_dev, rinfo.st_ino, 0, NULL );
+	}
+
+	ret = scan_loop( ctx, fd, &dinfo );
+
+	if( ret == MP3SCAN_OK && !ctx->pending.empty() )				// the files of the whole scan, in disk order
+		read_pending( ctx, ctx->pending, -1 );
+
+	while( ctx->inflight > 0 )										// the reads still in the pool
+		pool_collect( ctx );
+
+	if( ret == MP3SCAN_OK && !ctx->quarantine.empty() ){
+		message( ctx, MP3SCAN_MSG_VERBOSE, "Starting quarantine retry pass" );
+		quarantine_retry( ctx );
+	}
+
+	if( ctx->bAbort )
+		ret = MP3SCAN_ABORTED;
+
+	reader_release( ctx );
+	pool_release( ctx );
+	art_release( ctx );
+	delete ctx;
+
+	return ret;
+}
+
+
+// main scan loop, dirfd is the directory ctx->szRelativePath and it is closed on return
+// With a previous scan, a directory whose mtime did not change is not enumerated again:
+// only its known files are checked and its known subdirectories visited
+static MP3SCAN_RESULT scan_loop( SCANCTX* ctx, int dirfd, const struct stat* dinfo ){
+
+	DIR	*dir;
+	struct dirent *file;
+	struct stat finfo;
+	DIRSTATE *known = NULL;
+	std::vector<PENDING> local;
+	std::vector<PENDING>& batch = ( ctx->opt->read_order == MP3SCAN_ORDER_SCAN ) ? ctx->pending : local;
+	size_t i, len = strlen( ctx->szRelativePath );
+	int entries = 0, subdirs = 0, state, saved = ctx->nExcluded;
+	bool bRecursive = ctx->opt->recursive;
+
+	if( ctx->index != NULL ){
+		std::unordered_map<std::string, DIRSTATE>::iterator it = ctx->index->dirs.find( ctx->szRelativePath );
+		if( it != ctx->index->dirs.end() )
+			known = &it->second;
+	}
+
+	ctx->nExcluded = 0;
+
+	if( known != NULL && known->mtime == ST_MTIME_NS( *dinfo ) &&		// unchanged directory, skip readdir
+		( !bRecursive || (int)known->subdirs.size() == known->nsubdirs ) ){
+
+		ctx->stats->dirs_skipped++;
+		known->bSeen = TRUE;
+
+		for( i = 0; i < known->files.size() && !ctx->bAbort; i++ ){
+
+			KNOWNFILE *f = &known->files[i];
+
+			if( ctx->opt->trust_dir_mtime ){						// not even a stat
+				f->bSeen = TRUE;
+				ctx->stats->files_unchanged++;
+				emit_file( ctx, MP3SCAN_FILE_UNCHANGED, ctx->szRelativePath, f->name.c_str(), f->size, f->mtime, FALSE );
+
+			} else if( filter_entry( ctx, f->name.c_str(), FALSE ) >= 0 &&
+					   fstatat( dirfd, f->name.c_str(), &finfo, 0 ) == 0 && S_ISREG( finfo.st_mode ) ){
+				queue_file( ctx, batch, f->name.c_str(), &finfo, f );
+			}
+		}
+		if( !local.empty() )
+			read_pending( ctx, local, dirfd );
+		remove_unseen_files( ctx, known );
+
+		for( i = 0; bRecursive && i < known->subdirs.size() && !ctx->bAbort; i++ ){
+			if( ( state = filter_entry( ctx, known->subdirs[i].c_str(), TRUE ) ) >= 0 &&
+				fstatat( dirfd, known->subdirs[i].c_str(), &finfo, 0 ) == 0 && S_ISDIR( finfo.st_mode ) )
+				scan_subdir( ctx, dirfd, known->subdirs[i].c_str(), &finfo, state );
+		}
+		remove_unseen_subdirs( ctx, known );
+
+		if( ( ctx->nExcluded > 0 ||									// see below, and stored again after a file
+			  ctx->waiting.count( ctx->szRelativePath ) > 0 ) && !ctx->bAbort )	// still read, it may fail the quarantine
+			dir_record( ctx, ctx->nExcluded > 0 ? -1 : ST_MTIME_NS( *dinfo ), known->entries, known->nsubdirs );
+
+		ctx->nExcluded = saved;
+		close( dirfd );
+		return MP3SCAN_OK;
+	}
+
+	if( ( dir = fdopendir( dirfd ) ) == NULL ){
+		ctx->nExcluded = saved;
+		close( dirfd );
+		return MP3SCAN_OPENDIR_ERROR;
+	}
+
+	ctx->stats->dirs_enumerated++;
+	if( known != NULL )
+		known->bSeen = TRUE;
+
+	while( !ctx->bAbort && ( file = readdir( dir ) ) != NULL ){
+
+		if( strcmp( ".", file->d_name ) != 0 && strcmp( "..", file->d_name ) != 0 ){
+
+			entries++;
+
+			if( fstatat( dirfd, file->d_name, &finfo, 0 ) != 0 )	// get file info and check the type
+				continue;
+
+			if( S_ISREG( finfo.st_mode ) ){							// is a file
+
+				if( is_mp3_file( file->d_name ) && filter_entry( ctx, file->d_name, FALSE ) >= 0 )	// if it's a MP3 file
+					queue_file( ctx, batch, file->d_name, &finfo, known != NULL ? find_known_file( known, file->d_name ) : NULL );
+
+			} else if( S_ISDIR( finfo.st_mode ) ){					// is a directory
+
+				subdirs++;
+				if( bRecursive && ( state = filter_entry( ctx, file->d_name, TRUE ) ) >= 0 )
+					scan_subdir( ctx, dirfd, file->d_name, &finfo, state );
+			}
+		} 															// .. and . check
+	} 																// while loop end
+
+	if( !local.empty() )											// the files of this directory, in disk order
+		read_pending( ctx, local, dirfd );
+
+	if( known != NULL && !ctx->bAbort ){							// entries gone since the previous scan
+		remove_unseen_files( ctx, known );
+		remove_unseen_subdirs( ctx, known );
+	}
+
+	if( !ctx->bAbort )												// with excluded entries, enumerated again by the next scan:
+		dir_record( ctx, ctx->nExcluded > 0 ? -1 : ST_MTIME_NS( *dinfo ), entries, subdirs );	// its rules may have changed
+	ctx->nExcluded = saved;
+
+	ctx->szRelativePath[len] = '\0';
+	closedir( dir );												// close the dir handle
+
+	return MP3SCAN_OK;
+}
+
+
+// Descend into the subdirectory pName of dirfd, state is its filter state
+static void scan_subdir( SCANCTX* ctx, int dirfd, const char* pName, const struct stat* finfo, int state ){
+
+	char szMarker[PATH_MAX];
+	size_t len = strlen( ctx->szRelativePath );
+	int fd, saved = ctx->FilterState;
+
+	if( len + strlen( pName ) + 2 > PATH_MAX ){
+		message( ctx, MP3SCAN_MSG_WARNING, "%s%s: path too long, skipped", ctx->szRelativePath, pName );
+		return;
+	}
+
+	if( ctx->opt->one_file_system && finfo->st_dev != ctx->RootDev ){
+		message( ctx, MP3SCAN_MSG_VERBOSE, "%s%s: other file system, skipped", ctx->szRelativePath, pName );
+		ctx->stats->dirs_other_fs++;
+		ctx->nExcluded++;
+		return;
+	}
+
+	if( ctx->opt->ignore_marker != NULL ){							// checked before the directory is opened
+		snprintf( szMarker, PATH_MAX, "%s/%s", pName, ctx->opt->ignore_marker );
+		if( faccessat( dirfd, szMarker, F_OK, 0 ) == 0 ){
+			message( ctx, MP3SCAN_MSG_VERBOSE, "%s%s: %s found, skipped", ctx->szRelativePath, pName, ctx->opt->ignore_marker );
+			ctx->stats->dirs_excluded++;
+			ctx->nExcluded++;
+			return;
+		}
+	}
+
+	if( !inoset_insert( &ctx->Dirs, finfo->st_dev, finfo->st_ino, 0, NULL ) ){	// stat() follows the symlinks
+		message( ctx, MP3SCAN_MSG_VERBOSE, "%s%s: already scanned (symlink loop or bind mount), skipped", ctx->szRelativePath, pName );
+		ctx->stats->dirs_revisited++;
+		return;
+	}
+
+	if( ( fd = openat( dirfd, pName, O_RDONLY | O_DIRECTORY ) ) < 0 ){
+		message( ctx, MP3SCAN_MSG_VERBOSE, "%s%s: unable to open directory", ctx->szRelativePath, pName );
+		return;
+	}
+
+	strcat( ctx->szRelativePath, pName );							// append directory name
+	strcat( ctx->szRelativePath, "/" );								// and a '/'
+	ctx->FilterState = state;
+
+	scan_loop( ctx, fd, finfo );
+
+	ctx->szRelativePath[len] = '\0';								// remove directory name
+	ctx->FilterState = saved;
+}
+
+
+// Match an entry of the current directory against the filter of the scan
+// Return the filter state of the entry, -1 if it is excluded
+static int filter_entry( SCANCTX* ctx, const char* pName, bool bDir ){
+
+	MP3SCAN_FILTER *f = ctx->opt->filter;
+	int state, r;
+
+	if( f == NULL || ctx->FilterState == FILTER_DEAD )				// no rule can match below
+		return FILTER_DEAD;
+
+	state = filter_feed( f, ctx->FilterState, pName );
+
+	if( ( r = bDir ? f->ruledir[state] : f->rulefile[state] ) >= 0 && !f->include[r] ){
+		if( bDir )
+			ctx->stats->dirs_excluded++;
+		else
+			ctx->stats->files_excluded++;
+		ctx->nExcluded++;
+		return -1;
+	}
+	return bDir ? filter_step( f, state, '/' ) : state;				// the state of its entries
+}
+
+
+// Sizes of the mp3 files of root, per directory, without reading them
+MP3SCAN_RESULT mp3scan_sizes( const char *root, const MP3SCAN_OPTIONS *opt, MP3SCAN_SIZE_CALLBACK callback, void *user, MP3SCAN_STATS *stats ){
+
+	MP3SCAN_STATS LocalStats;
+	MP3SCAN_DIRSIZE dir;
+	std::vector<pthread_t> threads;
+	std::vector<SIZEDIR> batch;
+	struct stat rinfo;
+	pthread_t tid;
+	SIZEDIR d;
+	size_t i;
+	long n;
+	bool bStop = FALSE;
+
+	memset( &LocalStats, 0, sizeof(LocalStats) );
+
+	SIZECTX *ctx = new SIZECTX();
+	ctx->opt    = opt;
+	ctx->stats  = stats != NULL ? stats : &LocalStats;
+	ctx->busy   = 0;
+	ctx->bAbort = FALSE;
+
+	if( ( ctx->RootFd = open( root, O_RDONLY | O_DIRECTORY ) ) < 0 || fstat( ctx->RootFd, &rinfo ) != 0 ){
+		if( ctx->RootFd >= 0 )
+			close( ctx->RootFd );
+		delete ctx;
+		return MP3SCAN_OPENDIR_ERROR;
+	}
+
+	d.rel   = opt->subdir != NULL ? opt->subdir : "";
+	d.state = FILTER_DEAD;
+	d.files = d.bytes = 0;
+	if( opt->filter != NULL )										// paths are matched from the root, as "/a/b/"
+		d.state = filter_feed( opt->filter, filter_feed( opt->filter, filter_state( opt->filter, opt->filter->starts ), "/" ), d.rel.c_str() );
+
+	ctx->RootDev = rinfo.st_dev;
+	if( !d.rel.empty() )											// a link back to the root is a loop too
+		inoset_insert( &ctx->Dirs, rinfo.st_dev, rinfo.st_ino, 0, NULL );
+	ctx->todo.push_back( d );
+
+	n = ( opt->jobs == MP3SCAN_JOBS_AUTO ) ? 4 * sysconf( _SC_NPROCESSORS_ONLN ) : opt->jobs;
+	n = std::max( 1L, std::min( n, (long)MP3SCAN_JOBS_MAX ) );
+
+	pthread_mutex_init( &ctx->lock, NULL );
+	pthread_cond_init( &ctx->cond, NULL );
+
+	while( (long)threads.size() < n && pthread_create( &tid, NULL, size_thread, ctx ) == 0 )
+		threads.push_back( tid );
+
+	if( threads.empty() )											// no thread available, enumerate here
+		size_thread( ctx );
+
+	pthread_mutex_lock( &ctx->lock );
+
+	for( ;; ){														// call back the directories as they are done
+
+		while( ctx->done.empty() && ( ctx->busy > 0 || !ctx->todo.empty() ) && !ctx->bAbort )
+			pthread_cond_wait( &ctx->cond, &ctx->lock );
+
+		if( ctx->done.empty() || ctx->bAbort )
+			break;
+
+		batch.swap( ctx->done );
+		pthread_mutex_unlock( &ctx->lock );
+
+		for( i = 0; i < batch.size() && !bStop; i++ ){
+			dir.relpath = batch[i].rel.c_str();
+			dir.files   = batch[i].files;
+			dir.bytes   = batch[i].bytes;
+			bStop = ( callback( &dir, user ) != 0 );
+		}
+		batch.clear();
+
+		pthread_mutex_lock( &ctx->lock );
+		if( bStop ){
+			ctx->bAbort = TRUE;
+			pthread_cond_broadcast( &ctx->cond );
+		}
+	}
+
+	pthread_mutex_unlock( &ctx->lock );
+
+	for( i = 0; i < threads.size(); i++ )
+		pthread_join( threads[i], NULL );
+
+	pthread_mutex_destroy( &ctx->lock );
+	pthread_cond_destroy( &ctx->cond );
+	close( ctx->RootFd );
+	delete ctx;
+
+	return bStop ? MP3SCAN_ABORTED : MP3SCAN_OK;
+}
+
+
+// Enumerator of mp3scan_sizes(): take the queued directories until none is left
+// and no other enumerator can queue more
+static void* size_thread( void *arg ){
+
+	SIZECTX *ctx = (SIZECTX*)arg;
+	std::vector<SIZEDIR> subdirs;
+	SIZEDIR d;
+
+	pthread_mutex_lock( &ctx->lock );
+
+	for( ;; ){
+
+		while( ctx->todo.empty() && ctx->busy > 0 && !ctx->bAbort )
+			pthread_cond_wait( &ctx->cond, &ctx->lock );
+
+		if( ctx->todo.empty() || ctx->bAbort )
+			break;
+
+		d = ctx->todo.back();										// depth first, keeps the queue short
+		ctx->todo.pop_back();
+		ctx->busy++;
+		pthread_mutex_unlock( &ctx->lock );
+
+		size_dir( ctx, &d, subdirs );
+
+		pthread_mutex_lock( &ctx->lock );
+		ctx->busy--;
+		ctx->todo.insert( ctx->todo.end(), subdirs.begin(), subdirs.end() );
+		if( d.files > 0 )
+			ctx->done.push_back( d );
+		if( !subdirs.empty() || d.files > 0 || ctx->busy == 0 )	// work for the others, or the end
+			pthread_cond_broadcast( &ctx->cond );
+		subdirs.clear();
+	}
+
+	pthread_mutex_unlock( &ctx->lock );
+
+	return NULL;
+}
+
+
+// Enumerate the directory d: add up its mp3 files, return its subdirectories to scan
+static void size_dir( SIZECTX* ctx, SIZEDIR* d, std::vector<SIZEDIR>& subdirs ){
+
+	struct stat dinfo;
+	bool bNew = FALSE;
+	int fd;
+
+	if( ( fd = openat( ctx->RootFd, d->rel.empty() ? "." : d->rel.c_str(), O_RDONLY | O_DIRECTORY ) ) < 0 )
+		return;
+
+	if( fstat( fd, &dinfo ) == 0 ){									// the directory itself, symlinks followed
+		pthread_mutex_lock( &ctx->lock );
+		if( ctx->opt->one_file_system && dinfo.st_dev != ctx->RootDev )
+			ctx->stats->dirs_other_fs++;
+		else if( !inoset_insert( &ctx->Dirs, dinfo.st_dev, dinfo.st_ino, 0, NULL ) )
+			ctx->stats->dirs_revisited++;
+		else {
+			ctx->stats->dirs_enumerated++;
+			bNew = TRUE;
+		}
+		pthread_mutex_unlock( &ctx->lock );
+	}
+
+	if( !bNew ){
+		close( fd );
+		return;
+	}
+
+#ifdef __linux__
+	unsigned long long buf[SIZE_DENTS / sizeof(unsigned long long)];	// aligned for struct dirent64
+	struct dirent64 *ent;
+	long n, off;
+
+	while( ( n = syscall( SYS_getdents64, fd, buf, sizeof(buf) ) ) > 0 ){
+		for( off = 0; off < n; off += ent->d_reclen ){
+			ent = (struct dirent64*)( (char*)buf + off );
+			size_entry( ctx, fd, d, ent->d_name, ent->d_type, subdirs );
+		}
+	}
+	close( fd );
+#else
+	DIR *dir;
+	struct dirent *file;
+
+	if( ( dir = fdopendir( fd ) ) == NULL ){
+		close( fd );
+		return;
+	}
+	while( ( file = readdir( dir ) ) != NULL )
+		size_entry( ctx, fd, d, file->d_name, file->d_type, subdirs );
+	closedir( dir );
+#endif
+}
+
+
+// Add the entry pName of the directory d if it is a mp3 file, keep it in subdirs if it
+// is a directory to scan. type is its d_type, the entry is only stat'ed when needed.
+static void size_entry( SIZECTX* ctx, int dirfd, SIZEDIR* d, const char* pName, unsigned char type, std::vector<SIZEDIR>& subdirs ){
+
+	const MP3SCAN_OPTIONS *opt = ctx->opt;
+	char szMarker[PATH_MAX];
+	SIZESTAT st;
+	SIZEDIR sub;
+	bool bStat = FALSE, bNew;
+	int state;
+
+	if( pName[0] == '.' && ( pName[1] == '\0' || ( pName[1] == '.' && pName[2] == '\0' ) ) )
+		return;
+
+	if( type == DT_UNKNOWN || type == DT_LNK ){						// the type of the target, as stat() does
+		if( !size_stat( dirfd, pName, TRUE, &st ) )
+			return;
+		type = S_ISREG( st.mode ) ? DT_REG : S_ISDIR( st.mode ) ? DT_DIR : DT_UNKNOWN;
+		bStat = TRUE;
+	}
+
+	if( type == DT_REG ){
+
+		if( !is_mp3_file( pName ) || size_filter( ctx, d->state, pName, FALSE ) < 0 )
+			return;
+
+		if( !bStat && !size_stat( dirfd, pName, opt->dedup_files, &st ) )
+			return;
+
+		if( opt->dedup_files && st.nlink > 1 ){						// another name of a file already counted?
+			pthread_mutex_lock( &ctx->lock );
+			if( !( bNew = inoset_insert( &ctx->Files, st.dev, st.ino, 0, NULL ) ) )
+				ctx->stats->files_aliased++;
+			pthread_mutex_unlock( &ctx->lock );
+			if( !bNew )
+				return;
+		}
+
+		d->files++;
+		d->bytes += st.size;
+
+	} else if( type == DT_DIR && opt->recursive ){
+
+		if( ( state = size_filter( ctx, d->state, pName, TRUE ) ) < 0 ||
+			d->rel.size() + strlen( pName ) + 2 > PATH_MAX )
+			return;
+
+		if( opt->ignore_marker != NULL ){							// checked before the directory is opened
+			snprintf( szMarker, PATH_MAX, "%s/%s", pName, opt->ignore_marker );
+			if( faccessat( dirfd, szMarker, F_OK, 0 ) == 0 ){
+				pthread_mutex_lock( &ctx->lock );
+				ctx->stats->dirs_excluded++;
+				pthread_mutex_unlock( &ctx->lock );
+				return;
+			}
+		}
+
+		sub.rel   = d->rel + pName + "/";
+		sub.state = state;
+		sub.files = sub.bytes = 0;
+		subdirs.push_back( sub );
+	}
+}
+
+
+// stat() of the entry pName of dirfd, following the symlinks. Only the size is wanted,
+// and with bFull the type, the inode and the links: statx() asks no more (Linux)
+static bool size_stat( int dirfd, const char* pName, bool bFull, SIZESTAT* st ){
+
+#ifdef STATX_SIZE
+	struct statx sx;
+
+	if( statx( dirfd, pName, 0, STATX_SIZE | ( bFull ? STATX_TYPE | STATX_INO | STATX_NLINK : 0 ), &sx ) != 0 )
+		return FALSE;
+
+	st->mode  = sx.stx_mode;
+	st->size  = (long long)sx.stx_size;
+	st->dev   = makedev( sx.stx_dev_major, sx.stx_dev_minor );
+	st->ino   = sx.stx_ino;
+	st->nlink = sx.stx_nlink;
+#else
+	struct stat finfo;
+
+	if( fstatat( dirfd, pName, &finfo, 0 ) != 0 )
+		return FALSE;
+
+	st->mode  = finfo.st_mode;
+	st->size  = finfo.st_size;
+	st->dev   = finfo.st_dev;
+	st->ino   = finfo.st_ino;
+	st->nlink = finfo.st_nlink;
+#endif
+	return TRUE;
+}
+
+
+// Match the entry pName of a directory whose entries are in the filter state state
+// Return the filter state of the entry, -1 if it is excluded
+static int size_filter( SIZECTX* ctx, int state, const char* pName, bool bDir ){
+
+	MP3SCAN_FILTER *f = ctx->opt->filter;
+	int r;
+
+	if( f == NULL || state == FILTER_DEAD )							// no rule can match below
+		return FILTER_DEAD;
+
+	pthread_mutex_lock( &ctx->lock );								// the DFA grows as it matches
+
+	state = filter_feed( f, state, pName );
+
+	if( ( r = bDir ? f->ruledir[state] : f->rulefile[state] ) >= 0 && !f->include[r] ){
+		if( bDir )
+			ctx->stats->dirs_excluded++;
+		else
+			ctx->stats->files_excluded++;
+		state = -1;
+	} else if( bDir )
+		state = filter_step( f, state, '/' );						// the state of its entries
+
+	pthread_mutex_unlock( &ctx->lock );
+
+	return state;
+}
+
+
+// Handle a MP3 file of the current directory, known is its entry in the previous scan if any
+static void scan_file( SCANCTX* ctx, const char* pName, const struct stat* finfo, KNOWNFILE* known ){
+
+	unsigned int first = 0;
+	bool bAlias = FALSE;
+	int n;
+
+	if( ctx->opt->dedup_files && finfo->st_nlink > 1 ){			// another name of a file already read?
+		if( inoset_insert( &ctx->Files, finfo->st_dev, finfo->st_ino, (unsigned int)ctx->Originals.size(), &first ) )
+			ctx->Originals.push_back( std::string( ctx->szRelativePath ) + pName );
+		else
+			bAlias = TRUE;
+	}
+
+	if( known != NULL ){
+
+		known->bSeen = TRUE;
+
+		if( known->size == (long long)finfo->st_size && known->mtime == (long long)finfo->st_mtime ){
+			ctx->stats->files_unchanged++;
+			emit_file( ctx, MP3SCAN_FILE_UNCHANGED, ctx->szRelativePath, pName, finfo->st_size, finfo->st_mtime, FALSE );
+			return;
+		}
+
+		ctx->stats->files_changed++;								// read it again
+
+	} else if( ctx->index != NULL ){
+
+		ctx->stats->files_added++;
+	}
+
+	if( bAlias ){													// the path of the first name, as a record would have it
+		ctx->stats->files_aliased++;
+		if( ctx->opt->relpath )
+			n = snprintf( ctx->szAlias, PATH_MAX, "%s", ctx->Originals[first].c_str() );
+		else
+			n = snprintf( ctx->szAlias, PATH_MAX, "%s/%s", ctx->szRoot, ctx->Originals[first].c_str() );
+		if( n >= PATH_MAX ){										// the first name was skipped too
+			message( ctx, MP3SCAN_MSG_WARNING, "%s%s: path too long, skipped", ctx->szRelativePath, pName );
+			return;
+		}
+		emit_file( ctx, MP3SCAN_FILE_ALIAS, ctx->szRelativePath, pName, finfo->st_size, finfo->st_mtime, known != NULL );
+		return;
+	}
+
+	get_id3_tag( ctx, pName, finfo, known != NULL );
+}
+
+
+// Handle a MP3 file of the current directory now or, with a read order, add it to batch
+static void queue_file( SCANCTX* ctx, std::vector<PENDING>& batch, const char* pName, const struct stat* finfo, KNOWNFILE* known ){
+
+	PENDING p;
+
+	if( ctx->opt->read_order == MP3SCAN_ORDER_READDIR ||			// nothing to read for an unchanged file
+		( known != NULL && known->size == (long long)finfo->st_size && known->mtime == (long long)finfo->st_mtime ) ){
+		scan_file( ctx, pName, finfo, known );
+		return;
+	}
+
+	if( known != NULL )												// not removed, even if read later
+		known->bSeen = TRUE;
+
+	p.dir = -1;
+	if( ctx->opt->read_order == MP3SCAN_ORDER_SCAN ){				// its directory is stored once it is read
+		if( ctx->pendingDirs.empty() || ctx->pendingDirs.back() != ctx->szRelativePath )
+			ctx->pendingDirs.push_back( ctx->szRelativePath );
+		p.dir = (int)ctx->pendingDirs.size() - 1;
+		dir_hold( ctx, ctx->szRelativePath );
+	}
+	p.name  = pName;
+	p.size  = finfo->st_size;
+	p.mtime = finfo->st_mtime;
+	p.dev   = finfo->st_dev;
+	p.ino   = finfo->st_ino;
+	p.nlink = finfo->st_nlink;
+	p.known = known;
+	p.key   = 0;
+	batch.push_back( p );
+}
+
+
+// Read a batch of files in ascending disk offset, by inode number if the file system
+// can't tell the offsets; dirfd is the directory of the batch, -1 for the whole scan
+static void read_pending( SCANCTX* ctx, std::vector<PENDING>& batch, int dirfd ){
+
+	struct timespec start, stop;
+	struct stat finfo;
+	char szSaved[PATH_MAX];
+	bool bExtents = TRUE;
+	size_t i;
+
+	clock_gettime( CLOCK_MONOTONIC, &start );
+
+	for( i = 0; i < batch.size() && bExtents; i++ )
+		bExtents = file_extent( ctx, dirfd, &batch[i], &batch[i].key );
+
+	for( i = 0; !bExtents && i < batch.size(); i++ )				// one key for the whole batch
+		batch[i].key = batch[i].ino;
+
+	std::stable_sort( batch.begin(), batch.end(), pending_less );
+
+	clock_gettime( CLOCK_MONOTONIC, &stop );
+	ctx->stats->order_usec += ( stop.tv_sec - start.tv_sec ) * 1000000LL + ( stop.tv_nsec - start.tv_nsec ) / 1000;
+	if( bExtents )
+		ctx->stats->order_offset += batch.size();
+	else
+		ctx->stats->order_inode += batch.size();
+
+	strcpy( szSaved, ctx->szRelativePath );
+
+	memset( &finfo, 0, sizeof(finfo) );
+
+	for( i = 0; i < batch.size() && !ctx->bAbort; i++ ){
+		if( dirfd < 0 )
+			snprintf( ctx->szRelativePath, PATH_MAX, "%s", ctx->pendingDirs[batch[i].dir].c_str() );
+		finfo.st_size  = batch[i].size;
+		finfo.st_mtime = batch[i].mtime;
+		finfo.st_dev   = batch[i].dev;
+		finfo.st_ino   = batch[i].ino;
+		finfo.st_nlink = batch[i].nlink;
+		scan_file( ctx, batch[i].name.c_str(), &finfo, batch[i].known );
+		if( dirfd < 0 )
+			dir_release( ctx, ctx->szRelativePath, FALSE );
+	}
+
+	strcpy( ctx->szRelativePath, szSaved );
+	batch.clear();
+	if( dirfd < 0 )
+		ctx->pendingDirs.clear();
+}
+
+
+// Physical offset of the beginning of a file (FIEMAP), where its ID3v2 tag is
+// Return FALSE if the file system doesn't support it
+static bool file_extent( SCANCTX* ctx, int dirfd, const PENDING* p, unsigned long long* offset ){
+
+#ifdef __linux__
+	unsigned long long buf[( sizeof(struct fiemap) + sizeof(struct fiemap_extent) ) / sizeof(unsigned long long) + 1];
+	struct fiemap *fm = (struct fiemap*)buf;
+	char szFile[PATH_MAX];
+	int fd, rc;
+
+	if( dirfd >= 0 )
+		fd = openat( dirfd, p->name.c_str(), O_RDONLY );
+	else {
+		if( snprintf( szFile, PATH_MAX, "%s/%s%s", ctx->szRoot, ctx->pendingDirs[p->dir].c_str(), p->name.c_str() ) >= PATH_MAX )
+			return FALSE;
+		fd = open( szFile, O_RDONLY );
+	}
+	if( fd < 0 )
+		return FALSE;
+
+	memset( buf, 0, sizeof(buf) );
+	fm->fm_start        = 0;
+	fm->fm_length       = FIEMAP_MAX_OFFSET;
+	fm->fm_extent_count = 1;										// only the first one
+
+	rc = ioctl( fd, FS_IOC_FIEMAP, fm );
+	close( fd );
+
+	if( rc != 0 )
+		return FALSE;
+
+	*offset = ( fm->fm_mapped_extents > 0 ) ? fm->fm_extents[0].fe_physical : 0;	// 0: empty file
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+
+static bool pending_less( const PENDING& a, const PENDING& b ){
+
+	return a.key < b.key;
+}
+
+
+// Binary search of a file in the (sorted) known files of a directory
+static KNOWNFILE* find_known_file( DIRSTATE* known, const char* pName ){
+
+	size_t lo = 0, hi = known->files.size();
+
+	while( lo < hi ){
+		size_t mid = ( lo + hi ) / 2;
+		int cmp = strcmp( known->files[mid].name.c_str(), pName );
+		if( cmp == 0 )
+			return &known->files[mid];
+		if( cmp < 0 )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+
+// Report the known files of the current directory not found by this scan
+static void remove_unseen_files( SCANCTX* ctx, DIRSTATE* known ){
+
+	size_t i;
+
+	for( i = 0; i < known->files.size(); i++ ){
+		if( !known->files[i].bSeen ){
+			ctx->stats->files_removed++;
+			emit_file( ctx, MP3SCAN_FILE_REMOVED, ctx->szRelativePath, known->files[i].name.c_str(), known->files[i].size, known->files[i].mtime, FALSE );
+		}
+	}
+}
+
+
+// Report the known subdirectories of the current directory not found by this scan
+static void remove_unseen_subdirs( SCANCTX* ctx, DIRSTATE* known ){
+
+	std::string rel;
+	size_t i;
+
+	for( i = 0; i < known->subdirs.size(); i++ ){
+		rel = ctx->szRelativePath + known->subdirs[i] + "/";
+		std::unordered_map<std::string, DIRSTATE>::iterator it = ctx->index->dirs.find( rel );
+		if( it != ctx->index->dirs.end() && !it->second.bSeen )
+			remove_subtree( ctx, rel );
+	}
+}
+
+
+// Report a directory of the previous scan, and all its subdirectories, as removed
+static void remove_subtree( SCANCTX* ctx, const std::string& rel ){
+
+	std::unordered_map<std::string, DIRSTATE>::iterator it = ctx->index->dirs.find( rel );
+	size_t i;
+
+	if( it == ctx->index->dirs.end() || it->second.bSeen )
+		return;
+
+	it->second.bSeen = TRUE;
+	ctx->stats->files_removed += it->second.files.size();
+
+	emit_dir( ctx, MP3SCAN_DIR_REMOVED, rel.c_str(), it->second.mtime, it->second.entries, it->second.nsubdirs );
+
+	for( i = 0; i < it->second.subdirs.size(); i++ )
+		remove_subtree( ctx, rel + it->second.subdirs[i] + "/" );
+}
+
+
+// Build the path of a record for a directory relative to the root:
+// the relative path itself with relpath, otherwise the absolute path without trailing '/'
+// Return FALSE if it doesn't fit in PATH_MAX
+static bool record_path( SCANCTX* ctx, const char* pRel, char* szPath ){
+
+	int n;
+
+	if( ctx->opt->relpath )
+		n = snprintf( szPath, PATH_MAX, "%s", pRel );
+	else if( pRel[0] == '\0' )
+		n = snprintf( szPath, PATH_MAX, "%s", ctx->szRoot );
+	else
+		n = snprintf( szPath, PATH_MAX, "%s/%.*s", ctx->szRoot, (int)strlen( pRel ) - 1, pRel );
+
+	return n < PATH_MAX;
+}
+
+
+// Inverse of record_path, return FALSE if the path is not below the root
+static bool record_to_rel( const MP3SCAN_INDEX* idx, const char* pPath, std::string& rel ){
+
+	size_t len = idx->root.size();
+
+	if( idx->relpath ){
+		rel = pPath;
+	} else if( idx->root == pPath ){
+		rel = "";
+	} else if( strncmp( pPath, idx->root.c_str(), len ) == 0 && pPath[len] == '/' ){
+		rel = std::string( pPath + len + 1 ) + "/";
+	} else {
+		return FALSE;
+	}
+	return TRUE;
+}
+
+
+// Create an empty catalog of a previous scan of root
+MP3SCAN_INDEX* mp3scan_index_new( const char *root, bool relpath ){
+
+	char szRoot[PATH_MAX];
+	MP3SCAN_INDEX *idx = new MP3SCAN_INDEX();
+
+	idx->root    = realpath( root, szRoot ) != NULL ? szRoot : root;
+	idx->relpath = relpath;
+	idx->bLinked = FALSE;
+
+	return idx;
+}
+
+
+// Add a directory record (MP3SCAN_DIR) to the catalog
+void mp3scan_index_add_dir( MP3SCAN_INDEX *idx, const char *path, long long mtime, int entries, int subdirs ){
+
+	std::string rel;
+
+	if( path != NULL && record_to_rel( idx, path, rel ) ){
+		DIRSTATE &d = idx->dirs[rel];
+		d.mtime    = mtime;
+		d.entries  = entries;
+		d.nsubdirs = subdirs;
+		idx->bLinked = FALSE;
+	}
+}
+
+
+// Add a file record (MP3SCAN_FILE) to the catalog
+void mp3scan_index_add_file( MP3SCAN_INDEX *idx, const char *path, const char *filename, long long size, long long mtime ){
+
+	std::string rel;
+	KNOWNFILE f;
+
+	if( path != NULL && filename != NULL && record_to_rel( idx, path, rel ) ){
+
+		// a file without its directory record is still known, the directory will be enumerated
+		DIRSTATE &d = idx->dirs[rel];
+
+		f.name  = filename;
+		f.size  = size;
+		f.mtime = mtime;
+		d.files.push_back( f );
+		idx->bLinked = FALSE;
+	}
+}
+
+
+// Number of directories in the catalog
+size_t mp3scan_index_dirs( const MP3SCAN_INDEX *idx ){
+
+	return idx->dirs.size();
+}
+
+
+void mp3scan_index_free( MP3SCAN_INDEX *idx ){
+
+	delete idx;
+}
+
+
+static bool known_file_less( const KNOWNFILE& a, const KNOWNFILE& b ){
+
+	return strcmp( a.name.c_str(), b.name.c_str() ) < 0;
+}
+
+
+// Create a filter with no rule
+MP3SCAN_FILTER* mp3scan_filter_new(){
+
+	MP3SCAN_FILTER *f = new MP3SCAN_FILTER();
+
+	filter_state( f, std::vector<int>() );							// FILTER_DEAD, the empty set
+	return f;
+}
+
+
+// Compile a glob and append it to the rules of the filter
+// Return FALSE if the pattern is not valid
+bool mp3scan_filter_add( MP3SCAN_FILTER *f, const char *pattern, bool include ){
+
+	std::vector<GLOBNODE> nodes;
+	std::vector<bool> set;
+	GLOBNODE n;
+	const char *p = pattern;
+	size_t len = strlen( pattern );
+	bool bDirOnly = FALSE, bNegate;
+	int c;
+
+	if( len > 1 && pattern[len - 1] == '/' ){						// only directories, matched before their '/' is appended
+		bDirOnly = TRUE;
+		len--;
+	}
+	if( len == 0 || ( len == 1 && pattern[0] == '/' ) )
+		return FALSE;
+
+	n.type = GLOB_CHAR;												// paths are matched as "/a/b/name"
+	n.arg  = '/';
+	nodes.push_back( n );
+
+	if( memchr( pattern, '/', len ) == NULL ){						// a name at any depth
+		n.type = GLOB_DSLASH;
+		nodes.push_back( n );
+		n.type = GLOB_DSKIP;
+		nodes.push_back( n );
+	} else if( *p == '/' )											// anchored to the root
+		p++;
+
+	while( p < pattern + len ){
+
+		if( p[0] == '*' && p[1] == '*' && ( p == pattern || p[-1] == '/' ) && ( p + 2 == pattern + len || p[2] == '/' ) ){
+			if( p + 2 == pattern + len ){							// "a/**": everything below a
+				n.type = GLOB_DSTAR;
+				p += 2;
+			} else {												// "**/b", "a/**/b"
+				n.type = GLOB_DSLASH;
+				nodes.push_back( n );
+				n.type = GLOB_DSKIP;
+				p += 3;
+			}
+		} else if( *p == '*' ){
+			n.type = GLOB_STAR;
+			p++;
+		} else if( *p == '?' ){
+			n.type = GLOB_ANY;
+			p++;
+		} else if( *p == '[' ){										// [abc] [a-z] [!a-z] [^a-z], never '/'
+
+			set.assign( 256, FALSE );
+			bNegate = ( p[1] == '!' || p[1] == '^' );
+			p += bNegate ? 2 : 1;
+			if( *p == ']' ){										// a leading ']' is a member
+				set[']'] = TRUE;
+				p++;
+			}
+			for( ; p < pattern + len && *p != ']'; p++ ){
+				if( p[1] == '-' && p + 2 < pattern + len && p[2] != ']' ){
+					for( c = (byte)p[0]; c <= (byte)p[2]; c++ )
+						set[c] = TRUE;
+					p += 2;
+				} else
+					set[(byte)*p] = TRUE;
+			}
+			if( p >= pattern + len )								// no closing ']'
+				return FALSE;
+			p++;
+			if( bNegate )
+				set.flip();
+			set['/'] = FALSE;
+
+			n.type = GLOB_CLASS;
+			n.arg  = (int)f->sets.size();
+			f->sets.push_back( set );
+
+		} else {
+			if( *p == '\\' && p + 1 < pattern + len )				// quoted character
+				p++;
+			n.type = GLOB_CHAR;
+			n.arg  = (byte)*p++;
+		}
+		nodes.push_back( n );
+	}
+
+	n.type = GLOB_END;
+	n.arg  = (int)f->include.size();
+	nodes.push_back( n );
+
+	f->starts.push_back( (int)f->nodes.size() );
+	f->include.push_back( include );
+	f->dironly.push_back( bDirOnly );
+	f->nodes.insert( f->nodes.end(), nodes.begin(), nodes.end() );
+
+	f->ids.clear();													// the DFA is built again, for all the rules
+	f->states.clear();
+	f->next.clear();
+	f->rulefile.clear();
+	f->ruledir.clear();
+	filter_state( f, std::vector<int>() );
+
+	return TRUE;
+}
+
+
+// Match a path relative to the root, with or without a trailing '/' for a directory
+// Return FALSE if the filter excludes it
+bool mp3scan_filter_match( MP3SCAN_FILTER *f, const char *path, bool dir ){
+
+	std::string p = path;
+	int state, r;
+
+	if( !p.empty() && p[p.size() - 1] == '/' )
+		p.erase( p.size() - 1 );
+
+	state = filter_feed( f, filter_feed( f, filter_state( f, f->starts ), "/" ), p.c_str() );
+	r = dir ? f->ruledir[state] : f->rulefile[state];
+
+	return r < 0 || f->include[r];
+}
+
+
+void mp3scan_filter_free( MP3SCAN_FILTER *f ){
+
+	delete f;
+}
+
+
+// DFA state of a set of NFA nodes (before their closure), created if new
+static int filter_state( MP3SCAN_FILTER* f, const std::vector<int>& set ){
+
+	std::vector<int> closed;
+	std::map<std::vector<int>, int>::iterator it;
+	size_t i;
+	int id, rfile = -1, rdir = -1;
+
+	for( i = 0; i < set.size(); i++ )
+		filter_closure( f, set[i], closed );
+	std::sort( closed.begin(), closed.end() );
+	closed.erase( std::unique( closed.begin(), closed.end() ), closed.end() );
+
+	if( ( it = f->ids.find( closed ) ) != f->ids.end() )
+		return it->second;
+
+	for( i = 0; i < closed.size(); i++ ){							// rules are in node order: the first END is the first rule
+		if( f->nodes[closed[i]].type == GLOB_END ){
+			if( rdir < 0 )
+				rdir = f->nodes[closed[i]].arg;
+			if( rfile < 0 && !f->dironly[f->nodes[closed[i]].arg] )
+				rfile = f->nodes[closed[i]].arg;
+		}
+	}
+
+	id = (int)f->states.size();
+	f->ids[closed] = id;
+	f->states.push_back( closed );
+	f->rulefile.push_back( rfile );
+	f->ruledir.push_back( rdir );
+	f->next.resize( f->next.size() + 256, -1 );
+	return id;
+}
+
+
+// Add node, and the nodes it reaches without a character, to set
+// GLOB_DSLASH reaches the rest of the pattern only at the start of a name, past its GLOB_DSKIP
+static void filter_closure( const MP3SCAN_FILTER* f, int node, std::vector<int>& set ){
+
+	set.push_back( node );
+
+	switch( f->nodes[node].type ){
+		case GLOB_STAR:
+		case GLOB_DSTAR:
+			filter_closure( f, node + 1, set );
+			break;
+		case GLOB_DSLASH:
+			filter_closure( f, node + 2, set );
+			break;
+		default:
+			break;
+	}
+}
+
+
+// Transition of the DFA on c, computed the first time it is taken
+static int filter_step( MP3SCAN_FILTER* f, int state, byte c ){
+
+	std::vector<int> set;
+	size_t i;
+	int id;
+
+	if( ( id = f->next[state * 256 + c] ) >= 0 )
+		return id;
+
+	for( i = 0; i < f->states[state].size(); i++ ){
+
+		int node = f->states[state][i];
+		const GLOBNODE *n = &f->nodes[node];
+
+		switch( n->type ){
+			case GLOB_CHAR:   if( c == n->arg )        set.push_back( node + 1 ); break;
+			case GLOB_ANY:    if( c != '/' )           set.push_back( node + 1 ); break;
+			case GLOB_CLASS:  if( f->sets[n->arg][c] ) set.push_back( node + 1 ); break;
+			case GLOB_STAR:   if( c != '/' )           set.push_back( node );     break;
+			case GLOB_DSTAR:                           set.push_back( node );     break;
+			case GLOB_DSLASH: set.push_back( c == '/' ? node : node + 1 );     break;	// a name is skipped up to its '/'
+			case GLOB_DSKIP:  set.push_back( c == '/' ? node - 1 : node );     break;
+			default: break;
+		}
+	}
+
+	id = filter_state( f, set );									// may grow f->next
+	f->next[state * 256 + c] = id;
+	return id;
+}
+
+
+// Run the DFA over a string
+static int filter_feed( MP3SCAN_FILTER* f, int state, const char* str ){
+
+	for( ; *str && state != FILTER_DEAD; str++ )
+		state = filter_step( f, state, (byte)*str );
+	return state;
+}
+
+
+// Add (dev, ino) to the set with its value
+// Return FALSE, and the value stored in *found if not NULL, if it was already there
+static bool inoset_insert( INOSET* set, dev_t dev, ino_t ino, unsigned int value, unsigned int* found ){
+
+	unsigned long long key = (unsigned long long)ino + 1, k;
+	INOTABLE *t = NULL;
+	size_t i;
+
+	for( i = 0; i < set->tables.size() && t == NULL; i++ ){
+		if( set->tables[i].dev == dev )
+			t = &set->tables[i];
+	}
+	if( t == NULL ){
+		set->tables.push_back( INOTABLE() );
+		t = &set->tables.back();
+		t->dev   = dev;
+		t->count = 0;
+		inotable_resize( t, 1024, 1, set->bValues );
+	}
+
+	if( key > 0xFFFFFFFFULL && t->width == 1 )						// a 64-bit inode, widen the slots
+		inotable_resize( t, t->mask + 1, 2, set->bValues );
+	if( ( t->count + 1 ) * 4 > ( t->mask + 1 ) * 3 )				// at most 3/4 full
+		inotable_resize( t, ( t->mask + 1 ) * 2, t->width, set->bValues );
+
+	for( i = (size_t)( ( key * 0x9E3779B97F4A7C15ULL ) >> 32 ) & t->mask; ( k = inotable_key( t, i ) ) != 0; i = ( i + 1 ) & t->mask ){
+		if( k == key ){
+			if( found != NULL )
+				*found = set->bValues ? t->values[i] : 0;
+			return FALSE;
+		}
+	}
+
+	t->slots[i * t->width] = (unsigned int)key;
+	if( t->width == 2 )
+		t->slots[i * 2 + 1] = (unsigned int)( key >> 32 );
+	if( set->bValues )
+		t->values[i] = value;
+	t->count++;
+	return TRUE;
+}
+
+
+// Rehash a table into slots slots of width words
+static void inotable_resize( INOTABLE* t, size_t slots, int width, bool bValues ){
+
+	INOTABLE old = *t;
+	unsigned long long key;
+	size_t i, j;
+
+	t->width = width;
+	t->mask  = slots - 1;
+	t->slots.assign( slots * width, 0 );
+	t->values.assign( bValues ? slots : 0, 0 );
+
+	for( i = 0; old.count > 0 && i <= old.mask; i++ ){
+		if( ( key = inotable_key( &old, i ) ) == 0 )
+			continue;
+		for( j = (size_t)( ( key * 0x9E3779B97F4A7C15ULL ) >> 32 ) & t->mask; inotable_key( t, j ) != 0; j = ( j + 1 ) & t->mask );
+		t->slots[j * width] = (unsigned int)key;
+		if( width == 2 )
+			t->slots[j * 2 + 1] = (unsigned int)( key >> 32 );
+		if( bValues )
+			t->values[j] = old.values[i];
+	}
+}
+
+
+static unsigned long long inotable_key( const INOTABLE* t, size_t i ){
+
+	return ( t->width == 1 ) ? t->slots[i] : ( (unsigned long long)t->slots[i * 2 + 1] << 32 | t->slots[i * 2] );
+}
+
+
+// Prepare the catalog for a scan: sort the files, link every directory to its parent, clear the seen flags
+static void index_link( MP3SCAN_INDEX* idx ){
+
+	std::unordered_map<std::string, DIRSTATE>::iterator it, parent;
+	size_t i, slash;
+
+	for( it = idx->dirs.begin(); it != idx->dirs.end(); it++ ){
+
+		it->second.bSeen = FALSE;
+		for( i = 0; i < it->second.files.size(); i++ )
+			it->second.files[i].bSeen = FALSE;
+
+		if( idx->bLinked )
+			continue;
+
+		std::sort( it->second.files.begin(), it->second.files.end(), known_file_less );
+		it->second.subdirs.clear();
+	}
+
+	for( it = idx->dirs.begin(); !idx->bLinked && it != idx->dirs.end(); it++ ){
+
+		if( it->first.empty() )										// the root has no parent
+			continue;
+
+		slash = it->first.rfind( '/', it->first.size() - 2 );		// "a/b/" -> parent "a/", name "b"
+		std::string name = it->first.substr( slash == std::string::npos ? 0 : slash + 1 );
+		name.erase( name.size() - 1 );
+
+		if( ( parent = idx->dirs.find( it->first.substr( 0, slash == std::string::npos ? 0 : slash + 1 ) ) ) != idx->dirs.end() )
+			parent->second.subdirs.push_back( name );
+	}
+
+	idx->bLinked = TRUE;
+}
+
+
+// Pass a record to the callback of the scan
+static void emit( SCANCTX* ctx, MP3SCAN_RECORD* rec ){
+
+	if( ctx->callback != NULL && ctx->callback( rec, ctx->user ) != 0 )
+		ctx->bAbort = TRUE;
+}
+
+
+// Build and pass a file record, the tags are the ones of the context for MP3SCAN_FILE
+static void emit_file( SCANCTX* ctx, MP3SCAN_EVENT event, const char* pRel, const char* pFileName, off_t size, time_t mtime, bool bReplaces ){
+
+	MP3SCAN_RECORD rec;
+	bool bTags = ( event == MP3SCAN_FILE );
+
+	memset( &rec, 0, sizeof(rec) );
+	if( !record_path( ctx, pRel, ctx->szPath ) ||
+		snprintf( ctx->szFile, PATH_MAX, "%s/%s%s", ctx->szRoot, pRel, pFileName ) >= PATH_MAX ){
+		message( ctx, MP3SCAN_MSG_WARNING, "%s%s: path too long, skipped", pRel, pFileName );
+		return;
+	}
+
+	rec.event    = event;
+	rec.title    = bTags ? ctx->szTitle  : "";
+	rec.artist   = bTags ? ctx->szArtist : "";
+	rec.album    = bTags ? ctx->szAlbum  : "";
+	rec.year     = bTags ? ctx->szYear   : "";
+	rec.filename = pFileName;
+	rec.relpath  = pRel;
+	rec.path     = ctx->szPath;
+	rec.file     = ctx->szFile;
+	rec.size     = size;
+	rec.mtime    = mtime;
+	rec.replaces = bReplaces;
+	rec.art      = bTags ? ctx->szArt : "";
+	rec.alias    = ( event == MP3SCAN_FILE_ALIAS ) ? ctx->szAlias : "";
+
+	emit( ctx, &rec );
+}
+
+
+// Build and pass a directory record
+static void emit_dir( SCANCTX* ctx, MP3SCAN_EVENT event, const char* pRel, long long mtime, int entries, int subdirs ){
+
+	MP3SCAN_RECORD rec;
+
+	memset( &rec, 0, sizeof(rec) );
+	if( !record_path( ctx, pRel, ctx->szPath ) ||
+		snprintf( ctx->szFile, PATH_MAX, "%s/%s", ctx->szRoot, pRel ) >= PATH_MAX ){
+		message( ctx, MP3SCAN_MSG_WARNING, "%s: path too long, skipped", pRel );
+		return;
+	}
+
+	rec.event       = event;
+	rec.title       = rec.artist = rec.album = rec.year = "";
+	rec.relpath     = pRel;
+	rec.path        = ctx->szPath;
+	rec.file        = ctx->szFile;
+	rec.dir_mtime   = mtime;
+	rec.dir_entries = entries;
+	rec.dir_subdirs = subdirs;
+
+	emit( ctx, &rec );
+}
+
+
+// Pass the record of the current directory, or keep it until the files of the directory
+// still queued or in flight are read: a directory is stored with its mtime only after
+// its files, or an interrupted scan would leave it up to date for the next one
+static void dir_record( SCANCTX* ctx, long long mtime, int entries, int subdirs ){
+
+	std::unordered_map<std::string, DIRWAIT>::iterator it = ctx->waiting.find( ctx->szRelativePath );
+
+	if( it == ctx->waiting.end() ){
+		emit_dir( ctx, MP3SCAN_DIR, ctx->szRelativePath, mtime, entries, subdirs );
+		return;
+	}
+
+	it->second.bDone   = TRUE;
+	it->second.mtime   = mtime;
+	it->second.entries = entries;
+	it->second.subdirs = subdirs;
+}
+
+
+// A file of the directory pRel is read later, its record waits for it
+static void dir_hold( SCANCTX* ctx, const char* pRel ){
+
+	ctx->waiting[pRel].files++;
+}
+
+
+// A file held by dir_hold is done, pass the record of its directory if it was the last one;
+// bDirty: the file has no row, the directory is stored without mtime (like a filtered one)
+static void dir_release( SCANCTX* ctx, const char* pRel, bool bDirty ){
+
+	std::unordered_map<std::string, DIRWAIT>::iterator it = ctx->waiting.find( pRel );
+
+	if( it == ctx->waiting.end() )
+		return;
+
+	it->second.bDirty |= bDirty;
+	if( --it->second.files > 0 )
+		return;
+
+	if( it->second.bDone && !ctx->bAbort )
+		emit_dir( ctx, MP3SCAN_DIR, it->first.c_str(), it->second.bDirty ? -1 : it->second.mtime,
+				  it->second.entries, it->second.subdirs );
+	ctx->waiting.erase( it );
+}
+
+
+// Check if the file is an MP3 file - based on file extension
+bool is_mp3_file( const char* pFileName ){
+
+	const char *ptr = rindex( pFileName, '.' );
+
+	if(  ptr != NULL &&
+		(strcmp( ptr, ".MP3" ) == 0 || strcmp( ptr, ".mp3" ) == 0 ||
+		 strcmp( ptr, ".Mp3" ) == 0 || strcmp( ptr, ".mP3" ) == 0 ) )
+		return TRUE;
+
+	return FALSE;
+}
+
+
+// get the ID3tag from a MP3 file of the directory ctx->szRelativePath
+static void get_id3_tag( SCANCTX* ctx, const char* pFileName, const struct stat* finfo, bool bReplaces ){
+
+	char szFile[PATH_MAX];
+
+	if( snprintf( szFile, PATH_MAX, "%s/%s%s", ctx->szRoot, ctx->szRelativePath, pFileName ) >= PATH_MAX ){
+		message( ctx, MP3SCAN_MSG_WARNING, "%s%s: path too long, skipped", ctx->szRelativePath, pFileName );
+		return;
+	}
+
+	if( ctx->opt->jobs > 1 || ctx->opt->jobs == MP3SCAN_JOBS_AUTO ){	// read by the pool, passed by pool_collect
+		pool_submit( ctx, szFile, pFileName, finfo, bReplaces );
+		return;
+	}
+
+	if( !tag_record( ctx, szFile, pFileName, ctx->szRelativePath, finfo->st_size, finfo->st_mtime, bReplaces, ctx->opt->deadline ) ){
+
+		QUARANTINE q;
+
+		message( ctx, MP3SCAN_MSG_WARNING, "%s did not answer within %d ms, quarantined", szFile, ctx->opt->deadline );
+
+		q.File      = szFile;
+		q.FileName  = pFileName;
+		q.RelPath   = ctx->szRelativePath;
+		q.Size      = finfo->st_size;
+		q.MTime     = finfo->st_mtime;
+		q.bReplaces = bReplaces;
+		ctx->quarantine.push_back( q );
+		ctx->stats->quarantined++;
+		dir_hold( ctx, ctx->szRelativePath );						// its directory is stored after the retry
+	}
+}
+
+
+// Read the tags of a file and pass its record
+// Return FALSE if the file did not answer within the deadline
+static bool tag_record( SCANCTX* ctx, const char* pFile, const char* pFileName, const char* pRel, off_t size, time_t mtime, bool bReplaces, int deadline ){
+
+	if( !get_tags( ctx, pFile, size, deadline ) )					// Try to get all tags
+		return FALSE;
+
+	tag_emit( ctx, &ctx->Info, pFile, pFileName, pRel, size, mtime, bReplaces );
+	return TRUE;
+}
+
+
+// Pass the record of a file whose tags have been read into Info
+static void tag_emit( SCANCTX* ctx, const TAGINFO* Info, const char* pFile, const char* pFileName, const char* pRel, off_t size, time_t mtime, bool bReplaces ){
+
+	tag_fields( ctx, pFile, Info );
+
+	ctx->stats->cache_pages += Info->CachePages;
+	ctx->stats->cache_kept  += Info->CacheKept;
+
+	if( ctx->szTitle[0] == '\0' && ctx->szArtist[0] == '\0' && ctx->szAlbum[0] == '\0' && ctx->szYear[0] == '\0' ){
+
+		if( ctx->opt->filename_format != NULL ){					// Use file name to get song infos
+			filename_to_field( pFileName, ctx->opt->filename_format, ctx->opt->spacechar, ctx->szTitle, ctx->szArtist, ctx->szAlbum, ctx->szYear );
+
+		} else {													// print a warning message and return
+			message( ctx, MP3SCAN_MSG_VERBOSE, "%s has no id3 Tag", pFileName );
+		}
+	}
+
+	if( ctx->ArtDir >= 0 )											// the cover art, out of the deadline: the file answered
+		art_store( ctx, pFile, Info );
+
+	emit_file( ctx, MP3SCAN_FILE, pRel, pFileName, size, mtime, bReplaces );
+}
+
+
+// Read the tags of the mp3 file into ctx->Info, within deadline milliseconds if not 0
+// Return FALSE if the deadline expired
+static bool get_tags( SCANCTX* ctx, const char *filename, off_t size, int deadline ){
+
+	struct timespec start, stop;
+
+	clock_gettime( CLOCK_MONOTONIC, &start );
+
+	if( !read_tags_deadline( ctx, filename, size, deadline, &ctx->Info ) )
+		return FALSE;
+
+	clock_gettime( CLOCK_MONOTONIC, &stop );
+	latency_count( ctx->stats, filename, ( stop.tv_sec - start.tv_sec ) * 1000000LL + ( stop.tv_nsec - start.tv_nsec ) / 1000 );
+
+	return TRUE;
+}
+
+
+// Gets all necessary field from the tags read into the context
+static void tag_fields( SCANCTX* ctx, const char *filename, const TAGINFO *Info ){
+
+	ctx->szArt[0] = '\0';											// set by art_store
+
+	if( Info->bBadSize )
+		message( ctx, MP3SCAN_MSG_WARNING, "%s has a corrupt ID3v2 tag size, tag ignored", filename );
+
+	merge_tags( Info, filename, ctx->opt->choose, ctx->user, ctx->szTitle, ctx->szArtist, ctx->szAlbum, ctx->szYear );
+}
+
+
+// Merge the ID3v1 and ID3v2 fields of a file
+void merge_tags( const TAGINFO *Info, const char *filename, int (*choose)( const char*, const char*, const char*, int, void* ), void *user,
+				 char *szTitle, char *szArtist, char *szAlbum, char *szYear ){
+
+	strcpy( szTitle,  Info->Title[0] );
+	strcpy( szArtist, Info->Artist[0] );
+	strcpy( szAlbum,  Info->Album[0] );
+	strcpy( szYear,   Info->Year[0] );
+
+	CHECKBUFFERS( szTitle,  Info->Title[1],  filename, 0 );		// Check the title
+	CHECKBUFFERS( szArtist, Info->Artist[1], filename, 1 );		// Check the artist
+	CHECKBUFFERS( szAlbum,  Info->Album[1],  filename, 2 );		// Check the album
+	CHECKBUFFERS( szYear,   Info->Year[1],   filename, 3 );		// Check the year
+}
+
+
+// Check the declared size of the ID3v2 tag against the file size, decode the text frames
+// into UTF-8 and, with MP3SCAN_ART, locate the image data of the cover art (the front
+// cover or else the first APIC frame)
+// *pText is FALSE if some text frames are left to id3lib (unsynchronised or compressed)
+// Return FALSE if the tag can't fit in the file
+static bool id3v2_parse( const TAGSOURCE *src, byte Version, TAGINFO *Info, bool *pText ){
+
+	byte hdr[10], buf[TEXT_PREFIX > ART_PREFIX ? TEXT_PREFIX : ART_PREFIX];
+	off_t TagSize, pos, end, FrameSize, data;
+	ssize_t n;
+	int major, type, ext, field, found = 0;
+	bool bUnsync, bFront = FALSE;
+	char *dst;
+	size_t cap;
+
+	*pText = TRUE;
+
+	if( tag_pread( src, hdr, 10, 0 ) != 10 || memcmp( hdr, "ID3", 3 ) != 0 )
+		return TRUE;												// no ID3v2 tag
+
+	if( ( hdr[6] | hdr[7] | hdr[8] | hdr[9] ) & 0x80 )				// not a syncsafe integer
+		return FALSE;
+
+	TagSize = 10 + SYNCSAFE( &hdr[6] );
+	if( hdr[5] & 0x10 )												// footer present
+		TagSize += 10;
+
+	if( TagSize > src->size )
+		return FALSE;
+
+	major = hdr[3];
+	if( major < 2 || major > 4 )
+		return TRUE;
+
+	if( ( major < 4 && ( hdr[5] & 0x80 ) ) || ( major == 2 && ( hdr[5] & 0x40 ) ) ){	// unsynchronised (or v2.2 compressed) tag
+		*pText = FALSE;
+		return TRUE;
+	}
+	bUnsync = ( hdr[5] & 0x80 ) != 0;								// ID3v2.4: every frame is unsynchronised
+
+	if( !( Version & MP3SCAN_ID3V2 ) )
+		found = 0x0F;												// no text wanted
+
+	pos = 10;
+	end = 10 + SYNCSAFE( &hdr[6] );
+
+	if( major > 2 && ( hdr[5] & 0x40 ) ){							// skip the extended header
+		if( tag_pread( src, buf, 4, pos ) != 4 )
+			return TRUE;
+		pos += ( major == 4 ) ? SYNCSAFE( buf ) : 4 + big_endian( buf, 4 );
+	}
+
+	while( pos + ( major == 2 ? 6 : 10 ) <= end && !( found == 0x0F && ( bFront || !( Version & MP3SCAN_ART ) ) ) ){
+
+		if( tag_pread( src, hdr, 10, pos ) < ( major == 2 ? 6 : 10 ) || hdr[0] == 0 )	// padding
+			break;
+
+		if( major == 2 ){											// ID[3] SIZE[3]
+			FrameSize = big_endian( &hdr[3], 3 );
+			data = pos + 6;
+		} else {													// ID[4] SIZE[4] FLAGS[2]
+			FrameSize = ( major == 4 ) ? SYNCSAFE( &hdr[4] ) : big_endian( &hdr[4], 4 );
+			data = pos + 10;
+		}
+
+		if( FrameSize <= 0 || data + FrameSize > end )
+			break;
+		pos = data + FrameSize;
+
+		if( ( field = text_field( hdr, major, Info, &dst, &cap ) ) >= 0 ){
+
+			if( found & ( 1 << field ) )							// only the first frame of a field
+				continue;
+
+			if( major == 3 ){										// compressed, encrypted, grouped
+				if( hdr[9] & 0xC0 ){
+					*pText = FALSE;
+					continue;
+				}
+				if( hdr[9] & 0x20 )
+					data++;
+			} else if( major == 4 ){								// grouped, compressed, encrypted, length
+				if( hdr[9] & 0x0C ){
+					*pText = FALSE;
+					continue;
+				}
+				data += ( ( hdr[9] & 0x40 ) ? 1 : 0 ) + ( ( hdr[9] & 0x01 ) ? 4 : 0 );
+			}
+
+			n = ( pos - data < TEXT_PREFIX ) ? pos - data : TEXT_PREFIX;
+			if( n < 1 || tag_pread( src, buf, n, data ) != n )
+				continue;
+			if( bUnsync || ( major == 4 && ( hdr[9] & 0x02 ) ) )
+				n = resync( buf, n );
+
+			id3_text_to_utf8( &buf[1], n - 1, buf[0], dst, cap );	// encoding byte, then the text
+			found |= 1 << field;
+			continue;
+		}
+
+		if( !( Version & MP3SCAN_ART ) || bUnsync || bFront ||		// an unsynchronised picture can't be copied as is
+			( major == 2 ? memcmp( hdr, "PIC", 3 ) != 0 : memcmp( hdr, "APIC", 4 ) != 0 ) )
+			continue;
+
+		if( major == 3 ){											// compressed, encrypted, grouped
+			if( hdr[9] & 0xC0 )
+				continue;
+			if( hdr[9] & 0x20 )
+				data++;
+		} else if( major == 4 ){									// grouped, compressed, encrypted, unsynchronised, length
+			if( hdr[9] & 0x0E )
+				continue;
+			data += ( ( hdr[9] & 0x40 ) ? 1 : 0 ) + ( ( hdr[9] & 0x01 ) ? 4 : 0 );
+		}
+
+		n = ( pos - data < ART_PREFIX ) ? pos - data : ART_PREFIX;
+		if( n < 4 || tag_pread( src, buf, n, data ) != n )
+			continue;
+
+		if( ( ext = art_header( buf, n, major, &type, Info->ArtMime ) ) <= 0 || data + ext >= pos )
+			continue;
+
+		if( Info->ArtLength == 0 || type == 3 ){					// first picture or front cover
+			Info->ArtOffset = data + ext;
+			Info->ArtLength = pos - Info->ArtOffset;
+			bFront = ( type == 3 );
+		}
+	}
+
+	return TRUE;
+}
+
+
+// Decode the ID3v1 tag at the end of the file, ISO-8859-1 padded with spaces or nulls
+static void id3v1_parse( const TAGSOURCE *src, TAGINFO *Info ){
+
+	byte buf[128];
+	const int offset[] = { 3, 33, 63, 93 }, length[] = { 30, 30, 30, 4 };
+	char *field[] = { Info->Title[0], Info->Artist[0], Info->Album[0], Info->Year[0] };
+	size_t cap[] = { MP3SCAN_TITLE_LEN, MP3SCAN_TITLE_LEN, MP3SCAN_TITLE_LEN, MP3SCAN_YEAR_LEN };
+	int i, len;
+
+	if( src->size < 128 || tag_pread( src, buf, 128, src->size - 128 ) != 128 || memcmp( buf, "TAG", 3 ) != 0 )
+		return;
+
+	for( i = 0; i < 4; i++ ){
+		for( len = length[i]; len > 0 && ( buf[offset[i] + len - 1] == ' ' || buf[offset[i] + len - 1] == 0 ); len-- );
+		id3_text_to_utf8( &buf[offset[i]], len, 0, field[i], cap[i] );
+	}
+}
+
+
+// Tag field of a text frame: 0 title, 1 artist, 2 album, 3 year, -1 none of them
+static int text_field( const byte *id, int major, TAGINFO *Info, char **dst, size_t *cap ){
+
+	static const char *v22[] = { "TT2", "TP1", "TAL", "TYE" };
+	static const char *v23[] = { "TIT2", "TPE1", "TALB", "TYER" };
+	int i;
+
+	for( i = 0; i < 4; i++ ){
+		if( major == 2 ? memcmp( id, v22[i], 3 ) == 0 : memcmp( id, v23[i], 4 ) == 0 )
+			break;
+	}
+	if( i == 4 && major == 4 && memcmp( id, "TDRC", 4 ) == 0 )		// recording time, yyyy-MM-ddTHH:mm:ss
+		i = 3;
+
+	switch( i ){
+		case 0:  *dst = Info->Title[1];  *cap = MP3SCAN_TITLE_LEN; break;
+		case 1:  *dst = Info->Artist[1]; *cap = MP3SCAN_TITLE_LEN; break;
+		case 2:  *dst = Info->Album[1];  *cap = MP3SCAN_TITLE_LEN; break;
+		case 3:  *dst = Info->Year[1];   *cap = MP3SCAN_YEAR_LEN;  break;
+		default: return -1;
+	}
+	return i;
+}
+
+
+// Undo the unsynchronisation of a frame: remove the 00 inserted after every FF
+static ssize_t resync( byte *p, ssize_t n ){
+
+	ssize_t i, o = 0;
+
+	for( i = 0; i < n; i++ ){
+		p[o++] = p[i];
+		if( p[i] == 0xFF && i + 1 < n && p[i + 1] == 0x00 )
+			i++;
+	}
+	return o;
+}
+
+
+// Integer of n bytes, most significant first
+static off_t big_endian( const byte* p, int n ){
+
+	off_t v = 0;
+
+	while( n-- > 0 )
+		v = ( v << 8 ) | *p++;
+	return v;
+}
+
+
+// Parse the fields of an APIC frame before the image data: encoding, MIME type
+// (format in ID3v2.2), picture type and description
+// Return the length of these fields, 0 if they don't fit in buf
+static int art_header( const byte *buf, int len, int major, int *type, char *mime ){
+
+	int i, enc = buf[0];
+	char szMime[32];
+
+	if( major == 2 ){												// image format, "JPG" or "PNG"
+		snprintf( szMime, sizeof(szMime), "image/%.3s", (const char*)&buf[1] );
+		for( i = 6; szMime[i]; i++ )
+			szMime[i] = tolower( szMime[i] );
+		if( !strcmp( szMime, "image/jpg" ) )
+			strcpy( szMime, "image/jpeg" );
+		i = 4;
+	} else {
+		for( i = 1; i < len && buf[i] != 0; i++ );
+		if( i >= len )
+			return 0;
+		snprintf( szMime, sizeof(szMime), "%.*s", i - 1, (const char*)&buf[1] );
+		i++;
+	}
+
+	if( !strcmp( szMime, "-->" ) || i >= len )						// a link to the image, nothing to copy
+		return 0;
+
+	*type = buf[i++];
+
+	if( enc == 1 || enc == 2 ){										// UTF-16 description, ends with 00 00
+		for( ; i + 1 < len && ( buf[i] != 0 || buf[i + 1] != 0 ); i += 2 );
+		i += 2;
+	} else {
+		for( ; i < len && buf[i] != 0; i++ );
+		i++;
+	}
+
+	if( i > len )
+		return 0;
+
+	strcpy( mime, szMime );
+	return i;
+}
+
+
+// File name extension of a MIME type
+static const char* art_extension( const char* pMime ){
+
+	if( !strcasecmp( pMime, "image/jpeg" ) || !strcasecmp( pMime, "image/jpg" ) )
+		return "jpg";
+	if( !strcasecmp( pMime, "image/png" ) )
+		return "png";
+	if( !strcasecmp( pMime, "image/gif" ) )
+		return "gif";
+	return "bin";
+}
+
+
+// Store the cover art located by read_tags into opt->art_dir, named after the SHA-256 of
+// its content so that a picture shared by several files is stored once
+// The image data never goes through the scan: the kernel hashes it (AF_ALG) and copies it
+// (copy_file_range) straight from the mp3 file; pread is the fallback of both
+static void art_store( SCANCTX* ctx, const char* pFile, const TAGINFO* Info ){
+
+	byte digest[32];
+	char szName[MP3SCAN_HASH_LEN + 8], szTemp[MP3SCAN_HASH_LEN + 32];
+	std::vector<byte> resident;
+	void *map = NULL;
+	off_t size = 0;
+	int i, fd, out;
+
+	ctx->szArt[0] = '\0';
+
+	if( ctx->ArtDir < 0 || Info->ArtLength <= 0 )
+		return;
+
+	if( ( fd = open( pFile, O_RDONLY ) ) < 0 )
+		return;
+
+	if( ctx->ReadFlags & MP3SCAN_NOCACHE ){							// the picture is read once, by the kernel
+		size = lseek( fd, 0, SEEK_END );
+		map  = cache_map( fd, size, resident );
+	}
+
+	if( !art_hash_kernel( ctx, fd, Info->ArtOffset, Info->ArtLength, digest ) &&
+		!art_hash( fd, Info->ArtOffset, Info->ArtLength, digest ) ){
+		if( map != NULL )
+			cache_drop( fd, map, size, resident, &ctx->stats->cache_pages, &ctx->stats->cache_kept );
+		close( fd );
+		return;
+	}
+
+	for( i = 0; i < 32; i++ )
+		sprintf( &ctx->szArt[i * 2], "%02x", digest[i] );
+	snprintf( szName, sizeof(szName), "%s.%s", ctx->szArt, art_extension( Info->ArtMime ) );
+
+	if( faccessat( ctx->ArtDir, szName, F_OK, 0 ) == 0 ){			// same picture of another file
+		ctx->stats->art_shared++;
+		if( map != NULL )
+			cache_drop( fd, map, size, resident, &ctx->stats->cache_pages, &ctx->stats->cache_kept );
+		close( fd );
+		return;
+	}
+
+	// write a temporary file and rename it: a scan running at the same time never sees a partial picture
+	snprintf( szTemp, sizeof(szTemp), ".%s.%d.%lx", ctx->szArt, (int)getpid(), (unsigned long)pthread_self() );
+
+	if( ( out = openat( ctx->ArtDir, szTemp, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) ) < 0 ){
+		message( ctx, MP3SCAN_MSG_WARNING, "%s: unable to store the cover art", pFile );
+		ctx->szArt[0] = '\0';
+		if( map != NULL )
+			cache_drop( fd, map, size, resident, &ctx->stats->cache_pages, &ctx->stats->cache_kept );
+		close( fd );
+		return;
+	}
+
+	if( !art_copy( fd, out, Info->ArtOffset, Info->ArtLength ) ||
+		close( out ) != 0 || renameat( ctx->ArtDir, szTemp, ctx->ArtDir, szName ) != 0 ){
+		message( ctx, MP3SCAN_MSG_WARNING, "%s: unable to store the cover art", pFile );
+		unlinkat( ctx->ArtDir, szTemp, 0 );
+		ctx->szArt[0] = '\0';
+	} else {
+		ctx->stats->art_stored++;
+	}
+
+	if( map != NULL )
+		cache_drop( fd, map, size, resident, &ctx->stats->cache_pages, &ctx->stats->cache_kept );
+	close( fd );
+}
+
+
+// Copy length bytes at offset of fd into out, in the kernel when possible
+static bool art_copy( int fd, int out, off_t offset, off_t length ){
+
+	static const size_t chunk = 1 << 16;
+	char buf[1 << 12];
+	ssize_t n = 0;
+
+#ifdef __linux__
+	loff_t off = offset;
+
+	while( length > 0 && ( n = copy_file_range( fd, &off, out, NULL, length, 0 ) ) > 0 )
+		length -= n;
+
+	if( length == 0 )
+		return TRUE;
+	if( n < 0 && errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP )
+		return FALSE;
+
+	n = 0;															// not supported here, the file system or the kernel is too old
+	while( length > 0 && ( n = sendfile( out, fd, &off, length < (off_t)chunk ? length : chunk ) ) > 0 )
+		length -= n;
+
+	if( length == 0 )
+		return TRUE;
+	offset = off;
+#else
+	(void)chunk;
+#endif
+
+	while( length > 0 ){
+		if( ( n = pread( fd, buf, length < (off_t)sizeof(buf) ? length : sizeof(buf), offset ) ) <= 0 ||
+			write( out, buf, n ) != n )
+			return FALSE;
+		offset += n;
+		length -= n;
+	}
+
+	return TRUE;
+}
+
+
+// SHA-256 of length bytes at offset of fd computed by the kernel: the data is spliced
+// from the file to an AF_ALG socket through a pipe
+// Return FALSE if the kernel crypto API is not available
+static bool art_hash_kernel( SCANCTX* ctx, int fd, off_t offset, off_t length, byte *digest ){
+
+#ifdef __linux__
+	struct sockaddr_alg sa;
+	loff_t off = offset;
+	ssize_t n, m;
+	int op;
+
+	if( ctx->ArtAlg == -1 ){										// first picture of the scan
+		memset( &sa, 0, sizeof(sa) );
+		sa.salg_family = AF_ALG;
+		strcpy( (char*)sa.salg_type, "hash" );
+		strcpy( (char*)sa.salg_name, "sha256" );
+
+		if( ( ctx->ArtAlg = socket( AF_ALG, SOCK_SEQPACKET, 0 ) ) < 0 ||
+			bind( ctx->ArtAlg, (struct sockaddr*)&sa, sizeof(sa) ) != 0 || pipe( ctx->ArtPipe ) != 0 ){
+			if( ctx->ArtAlg >= 0 )
+				close( ctx->ArtAlg );
+			ctx->ArtAlg = -2;
+		}
+	}
+	if( ctx->ArtAlg < 0 || ( op = accept( ctx->ArtAlg, NULL, 0 ) ) < 0 )
+		return FALSE;
+
+	while( length > 0 ){
+		if( ( n = splice( fd, &off, ctx->ArtPipe[1], NULL, length, SPLICE_F_MORE ) ) <= 0 )
+			break;
+		length -= n;
+		for( ; n > 0; n -= m )
+			if( ( m = splice( ctx->ArtPipe[0], NULL, op, NULL, n, SPLICE_F_MORE ) ) <= 0 )
+				break;
+		if( n > 0 )
+			break;
+	}
+
+	if( length > 0 ){												// the pipe may hold some data, let the software hash do
+		close( op );
+		close( ctx->ArtPipe[0] );
+		close( ctx->ArtPipe[1] );
+		close( ctx->ArtAlg );
+		ctx->ArtAlg = -2;
+		return FALSE;
+	}
+
+	n = read( op, digest, 32 );
+	close( op );
+	return n == 32;
+#else
+	return FALSE;
+#endif
+}
+
+
+// Release the kernel hash socket of a scan
+static void art_release( SCANCTX* ctx ){
+
+	if( ctx->ArtAlg >= 0 ){
+		close( ctx->ArtAlg );
+		close( ctx->ArtPipe[0] );
+		close( ctx->ArtPipe[1] );
+	}
+	if( ctx->ArtDir >= 0 )
+		close( ctx->ArtDir );
+}
+
+
+/*
+ * SHA-256 (FIPS 180-4), used when the kernel can't hash the cover art
+ */
+
+static const unsigned int SHA256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR( x, n ) ( ( (x) >> (n) ) | ( (x) << ( 32 - (n) ) ) )
+
+static void sha256_block( unsigned int *h, const byte *p ){
+
+	unsigned int w[64], a, b, c, d, e, f, g, k, t1, t2;
+	int i;
+
+	for( i = 0; i < 16; i++ )
+		w[i] = ( p[i * 4] << 24 ) | ( p[i * 4 + 1] << 16 ) | ( p[i * 4 + 2] << 8 ) | p[i * 4 + 3];
+	for( ; i < 64; i++ )
+		w[i] = w[i - 16] + ( ROTR( w[i - 15], 7 ) ^ ROTR( w[i - 15], 18 ) ^ ( w[i - 15] >> 3 ) ) +
+			   w[i - 7]  + ( ROTR( w[i - 2], 17 ) ^ ROTR( w[i - 2], 19 )  ^ ( w[i - 2] >> 10 ) );
+
+	a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4]; f = h[5]; g = h[6]; k = h[7];
+
+	for( i = 0; i < 64; i++ ){
+		t1 = k + ( ROTR( e, 6 ) ^ ROTR( e, 11 ) ^ ROTR( e, 25 ) ) + ( ( e & f ) ^ ( ~e & g ) ) + SHA256_K[i] + w[i];
+		t2 = ( ROTR( a, 2 ) ^ ROTR( a, 13 ) ^ ROTR( a, 22 ) ) + ( ( a & b ) ^ ( a & c ) ^ ( b & c ) );
+		k = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+
+// SHA-256 of length bytes at offset of fd
+static bool art_hash( int fd, off_t offset, off_t length, byte *digest ){
+
+	unsigned int h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	byte buf[1 << 16];
+	unsigned long long bits = (unsigned long long)length * 8;
+	size_t fill = 0, i;
+	ssize_t n;
+
+	while( length > 0 ){
+
+		if( ( n = pread( fd, buf + fill, length < (off_t)( sizeof(buf) - fill ) ? length : sizeof(buf) - fill, offset ) ) <= 0 )
+			return FALSE;
+		offset += n;
+		length -= n;
+		fill   += n;
+
+		for( i = 0; i + 64 <= fill; i += 64 )
+			sha256_block( h, buf + i );
+		memmove( buf, buf + i, fill - i );
+		fill -= i;
+	}
+
+	buf[fill++] = 0x80;												// padding and length
+	if( fill > 56 ){
+		memset( buf + fill, 0, 64 - fill );
+		sha256_block( h, buf );
+		fill = 0;
+	}
+	memset( buf + fill, 0, 56 - fill );
+	for( i = 0; i < 8; i++ )
+		buf[56 + i] = (byte)( bits >> ( 56 - i * 8 ) );
+	sha256_block( h, buf );
+
+	for( i = 0; i < 8; i++ ){
+		digest[i * 4]     = (byte)( h[i] >> 24 );
+		digest[i * 4 + 1] = (byte)( h[i] >> 16 );
+		digest[i * 4 + 2] = (byte)( h[i] >> 8 );
+		digest[i * 4 + 3] = (byte)h[i];
+	}
+
+	return TRUE;
+}
+
+
+// Read the ID3v1 and ID3v2 fields of a file, no global state is used
+void read_tags( const char *filename, off_t size, byte Version, TAGINFO *Info ){
+
+	ID3_Tag Version2;
+	TAGSOURCE src;
+	std::vector<byte> resident;
+	void *map = NULL;
+	int fd;
+
+	memset( Info, 0, sizeof(TAGINFO) );
+
+	if( ( fd = open( filename, O_RDONLY ) ) < 0 )
+		return;
+
+	if( Version & MP3SCAN_NOCACHE ){								// only the pages of the tags (id3lib's too), then put the cache back
+		map = cache_map( fd, size, resident );
+#ifdef __linux__
+		posix_fadvise( fd, 0, 0, POSIX_FADV_RANDOM );
+#endif
+	}
+
+	memset( &src, 0, sizeof(src) );
+	src.fd   = fd;
+	src.size = size;
+
+	if( !tag_parse( &src, Version, Info ) ){							// what only id3lib can decode
+
+		Version2.Link( filename, ID3TT_ID3V2 );
+
+		if( Info->Title[1][0] == '\0' )
+			id3lib_text( &Version2, ID3FID_TITLE, Info->Title[1], MP3SCAN_TITLE_LEN );
+		if( Info->Artist[1][0] == '\0' )
+			id3lib_text( &Version2, ID3FID_LEADARTIST, Info->Artist[1], MP3SCAN_TITLE_LEN );
+		if( Info->Album[1][0] == '\0' )
+			id3lib_text( &Version2, ID3FID_ALBUM, Info->Album[1], MP3SCAN_TITLE_LEN );
+		if( Info->Year[1][0] == '\0' )
+			id3lib_text( &Version2, ID3FID_YEAR, Info->Year[1], MP3SCAN_YEAR_LEN );
+	}
+
+	if( map != NULL )
+		cache_drop( fd, map, size, resident, &Info->CachePages, &Info->CacheKept );
+	close( fd );
+}
+
+
+// Read the ID3v1 and ID3v2 fields of a file from its tags in memory
+void parse_tags( const byte *head, size_t headlen, const byte *tail, size_t taillen, off_t size, byte Version, TAGINFO *Info ){
+
+	TAGSOURCE src;
+
+	memset( Info, 0, sizeof(TAGINFO) );
+
+	src.fd      = -1;
+	src.size    = size;
+	src.head    = head;
+	src.headlen = headlen;
+	src.tail    = tail;
+	src.taillen = taillen;
+
+	tag_parse( &src, Version, Info );
+}
+
+
+// Decode the tags of a source into Info
+// Return FALSE if some ID3v2 text frames are left to id3lib
+static bool tag_parse( const TAGSOURCE *src, byte Version, TAGINFO *Info ){
+
+	bool bText = TRUE;
+
+	if( Version & MP3SCAN_ID3V1 )
+		id3v1_parse( src, Info );
+
+	if( ( Version & ( MP3SCAN_ID3V2 | MP3SCAN_ART ) ) && !id3v2_parse( src, Version, Info, &bText ) )	// never follow a corrupt size
+		Info->bBadSize = TRUE;
+
+	return !( Version & MP3SCAN_ID3V2 ) || bText;
+}
+
+
+// pread of a tag source: the bytes out of the buffers of a source in memory are a short read
+static ssize_t tag_pread( const TAGSOURCE *src, void *buf, size_t n, off_t offset ){
+
+	if( src->fd >= 0 )
+		return pread( src->fd, buf, n, offset );
+
+	if( offset < 0 || offset >= src->size )
+		return 0;
+	if( (off_t)n > src->size - offset )
+		n = src->size - offset;
+
+	if( offset >= src->size - (off_t)src->taillen ){
+		memcpy( buf, src->tail + ( offset - ( src->size - src->taillen ) ), n );
+		return n;
+	}
+	if( offset < (off_t)src->headlen ){
+		if( (off_t)n > (off_t)src->headlen - offset )
+			n = src->headlen - offset;
+		memcpy( buf, src->head + offset, n );
+		return n;
+	}
+	return 0;
+}
+
+
+// Map a file to query which of its pages are in the page cache, one byte per page
+// (bit 0 set: resident). Return the mapping, NULL if the file can't be mapped
+static void* cache_map( int fd, off_t size, std::vector<byte>& resident ){
+
+#ifdef __linux__
+	long page = sysconf( _SC_PAGESIZE );
+	void *map;
+
+	if( size <= 0 || ( map = mmap( NULL, size, PROT_READ, MAP_SHARED, fd, 0 ) ) == MAP_FAILED )
+		return NULL;												// mapped, never touched: no page is read
+
+	resident.resize( ( size + page - 1 ) / page );
+	if( mincore( map, size, resident.data() ) != 0 ){
+		munmap( map, size );
+		return NULL;
+	}
+	return map;
+#else
+	return NULL;
+#endif
+}
+
+
+// Drop from the page cache the pages of a file that were not resident in before, unmap it
+// and count the pages dropped and the ones the kernel kept
+static void cache_drop( int fd, void* map, off_t size, const std::vector<byte>& before, long long* pages, long long* kept ){
+
+#ifdef __linux__
+	long page = sysconf( _SC_PAGESIZE );
+	std::vector<byte> now( before.size() ), after( before.size() );
+	size_t i, j, n = before.size(), added = 0;
+
+	if( mincore( map, size, now.data() ) == 0 ){
+
+		for( i = 0; i < n; i = j + 1 ){								// one fadvise per run of pages brought in
+			for( ; i < n && !( ( now[i] & 1 ) && !( before[i] & 1 ) ); i++ );
+			for( j = i; j < n && ( now[j] & 1 ) && !( before[j] & 1 ); j++ );
+			if( j > i ){
+				posix_fadvise( fd, (off_t)i * page, (off_t)( j - i ) * page, POSIX_FADV_DONTNEED );
+				added += j - i;
+			}
+		}
+		*pages += added;
+
+		if( added > 0 && mincore( map, size, after.data() ) == 0 )
+			for( i = 0; i < n; i++ )
+				if( ( now[i] & 1 ) && !( before[i] & 1 ) && ( after[i] & 1 ) )
+					(*kept)++;
+	}
+
+	munmap( map, size );
+#endif
+}
+
+
+// Text of an id3lib frame, ISO-8859-1, into UTF-8
+static void id3lib_text( ID3_Tag *Tag, ID3_FrameID id, char *dst, size_t cap ){
+
+	ID3_Frame *Frame;
+	char szText[MP3SCAN_TITLE_LEN];
+
+	if( ( Frame = Tag->Find( id ) ) != NULL ){
+		szText[0] = '\0';
+		Frame->Field( ID3FN_TEXT ).Get( szText, sizeof(szText) - 1 );
+		szText[sizeof(szText) - 1] = '\0';
+		id3_text_to_utf8( (const byte*)szText, strlen( szText ), 0, dst, cap );
+	}
+}
+
+
+// Decode the text of an ID3 frame into UTF-8
+// The runs of ASCII characters, most of a tag, go through ascii_kernel (SSE2 or AVX2);
+// the other characters, surrogate pairs and invalid UTF-8 are handled one by one
+size_t id3_text_to_utf8( const byte *src, size_t len, int encoding, char *dst, size_t cap ){
+
+	size_t i = 0, o = 0, k, room;
+	unsigned int c, c2;
+	bool bBig = ( encoding == 2 );
+	int width = ( encoding == 1 || encoding == 2 ) ? 2 : 1, n;
+
+	if( cap == 0 )
+		return 0;
+
+	if( width == 2 && len >= 2 ){									// byte order mark
+		if( src[0] == 0xFF && src[1] == 0xFE ){
+			bBig = FALSE;
+			i = 2;
+		} else if( src[0] == 0xFE && src[1] == 0xFF ){
+			bBig = TRUE;
+			i = 2;
+		}
+	}
+
+	while( i + width <= len ){
+
+		room = cap - 1 - o;											// ASCII run: one byte per unit
+		k = ascii_kernel( &src[i], ( len - i ) / width < room ? ( len - i ) / width : room, width, bBig, &dst[o] );
+		i += k * width;
+		o += k;
+
+		if( i + width > len )
+			break;
+
+		if( width == 2 ){
+			c = bBig ? ( src[i] << 8 | src[i + 1] ) : ( src[i + 1] << 8 | src[i] );
+			i += 2;
+			if( c >= 0xD800 && c <= 0xDBFF && i + 2 <= len ){		// surrogate pair
+				c2 = bBig ? ( src[i] << 8 | src[i + 1] ) : ( src[i + 1] << 8 | src[i] );
+				if( c2 >= 0xDC00 && c2 <= 0xDFFF ){
+					c = 0x10000 + ( ( c - 0xD800 ) << 10 ) + ( c2 - 0xDC00 );
+					i += 2;
+				}
+			}
+			if( c >= 0xD800 && c <= 0xDFFF )						// lone surrogate
+				c = 0xFFFD;
+
+		} else if( encoding == 3 && src[i] >= 0xC2 && src[i] <= 0xF4 ){	// UTF-8 sequence, copied if valid
+
+			n = ( src[i] >= 0xF0 ) ? 4 : ( src[i] >= 0xE0 ) ? 3 : 2;
+			for( k = 1; k < (size_t)n && i + k < len && ( src[i + k] & 0xC0 ) == 0x80; k++ );
+
+			if( k == (size_t)n ){
+				c = ( n == 2 ) ? src[i] & 0x1F : ( n == 3 ) ? src[i] & 0x0F : src[i] & 0x07;
+				for( k = 1; k < (size_t)n; k++ )
+					c = ( c << 6 ) | ( src[i + k] & 0x3F );
+				if( ( n == 3 && c >= 0x800 && ( c < 0xD800 || c > 0xDFFF ) ) || ( n == 4 && c >= 0x10000 && c <= 0x10FFFF ) || n == 2 ){
+					i += n;
+					if( !put_utf8( c, dst, &o, cap ) )
+						break;
+					continue;
+				}
+			}
+			c = src[i++];											// not UTF-8: ISO-8859-1
+
+		} else {
+
+			c = src[i++];											// ISO-8859-1, or a byte of bad UTF-8
+		}
+
+		if( c == 0 || !put_utf8( c, dst, &o, cap ) )				// end of the (first) string, or no room
+			break;
+	}
+
+	dst[o] = '\0';
+	return o;
+}
+
+
+// Append the UTF-8 encoding of c to dst
+// Return FALSE if it doesn't fit before the '\0'
+static bool put_utf8( unsigned int c, char *dst, size_t *o, size_t cap ){
+
+	size_t n = ( c < 0x80 ) ? 1 : ( c < 0x800 ) ? 2 : ( c < 0x10000 ) ? 3 : 4;
+	char *p = &dst[*o];
+
+	if( *o + n > cap - 1 )
+		return FALSE;
+
+	switch( n ){
+		case 1: p[0] = (char)c; break;
+		case 2: p[0] = (char)( 0xC0 | c >> 6 );  p[1] = (char)( 0x80 | ( c & 0x3F ) ); break;
+		case 3: p[0] = (char)( 0xE0 | c >> 12 ); p[1] = (char)( 0x80 | ( ( c >> 6 ) & 0x3F ) ); p[2] = (char)( 0x80 | ( c & 0x3F ) ); break;
+		default:
+			p[0] = (char)( 0xF0 | c >> 18 ); p[1] = (char)( 0x80 | ( ( c >> 12 ) & 0x3F ) );
+			p[2] = (char)( 0x80 | ( ( c >> 6 ) & 0x3F ) ); p[3] = (char)( 0x80 | ( c & 0x3F ) ); break;
+	}
+	*o += n;
+	return TRUE;
+}
+
+
+// Copy the run of ASCII characters (not null) at the start of n units of width bytes
+// Return the number of units copied, one byte each into dst
+static size_t ascii_scalar( const byte *src, size_t n, int width, bool bBig, char *dst ){
+
+	size_t i;
+	unsigned int c;
+
+	for( i = 0; i < n; i++ ){
+		c = ( width == 1 ) ? src[i] : bBig ? ( src[2 * i] << 8 | src[2 * i + 1] ) : ( src[2 * i + 1] << 8 | src[2 * i] );
+		if( c == 0 || c >= 0x80 )
+			break;
+		dst[i] = (char)c;
+	}
+	return i;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// ascii_scalar 16 (or 8 UTF-16) units at a time, SSE2
+__attribute__(( target( "sse2" ) ))
+static size_t ascii_sse2( const byte *src, size_t n, int width, bool bBig, char *dst ){
+
+	const __m128i zero = _mm_setzero_si128(), high = _mm_set1_epi16( (short)0xFF80 );
+	size_t i = 0, step = 16 / width;
+	__m128i v;
+
+	for( ; i + step <= n; i += step ){
+
+		v = _mm_loadu_si128( (const __m128i*)&src[i * width] );
+
+		if( width == 1 ){											// no bit 7, no null
+			if( _mm_movemask_epi8( v ) != 0 || _mm_movemask_epi8( _mm_cmpeq_epi8( v, zero ) ) != 0 )
+				break;
+			_mm_storeu_si128( (__m128i*)&dst[i], v );
+		} else {
+			if( bBig )
+				v = _mm_or_si128( _mm_slli_epi16( v, 8 ), _mm_srli_epi16( v, 8 ) );
+			if( _mm_movemask_epi8( _mm_cmpeq_epi16( _mm_and_si128( v, high ), zero ) ) != 0xFFFF ||
+				_mm_movemask_epi8( _mm_cmpeq_epi16( v, zero ) ) != 0 )
+				break;
+			_mm_storel_epi64( (__m128i*)&dst[i], _mm_packus_epi16( v, v ) );
+		}
+	}
+	return i + ascii_scalar( &src[i * width], n - i < step ? n - i : step, width, bBig, &dst[i] );
+}
+
+
+// ascii_scalar 32 (or 16 UTF-16) units at a time, AVX2
+__attribute__(( target( "avx2" ) ))
+static size_t ascii_avx2( const byte *src, size_t n, int width, bool bBig, char *dst ){
+
+	const __m256i zero = _mm256_setzero_si256(), high = _mm256_set1_epi16( (short)0xFF80 );
+	size_t i = 0, step = 32 / width;
+	__m256i v;
+
+	for( ; i + step <= n; i += step ){
+
+		v = _mm256_loadu_si256( (const __m256i*)&src[i * width] );
+
+		if( width == 1 ){
+			if( _mm256_movemask_epi8( v ) != 0 || _mm256_movemask_epi8( _mm256_cmpeq_epi8( v, zero ) ) != 0 )
+				break;
+			_mm256_storeu_si256( (__m256i*)&dst[i], v );
+		} else {
+			if( bBig )
+				v = _mm256_or_si256( _mm256_slli_epi16( v, 8 ), _mm256_srli_epi16( v, 8 ) );
+			if( _mm256_movemask_epi8( _mm256_cmpeq_epi16( _mm256_and_si256( v, high ), zero ) ) != -1 ||
+				_mm256_movemask_epi8( _mm256_cmpeq_epi16( v, zero ) ) != 0 )
+				break;
+			v = _mm256_permute4x64_epi64( _mm256_packus_epi16( v, v ), 0x08 );	// packus works per 128-bit lane
+			_mm_storeu_si128( (__m128i*)&dst[i], _mm256_castsi256_si128( v ) );
+		}
+	}
+	return i + ascii_sse2( &src[i * width], n - i, width, bBig, &dst[i] );
+}
+
+#endif
+
+
+// ASCII run with the widest vectors of the CPU
+static size_t ascii_kernel( const byte *src, size_t n, int width, bool bBig, char *dst ){
+
+#if defined(__x86_64__) || defined(__i386__)
+	static const bool bAvx2 = __builtin_cpu_supports( "avx2" );
+	static const bool bSse2 = __builtin_cpu_supports( "sse2" );
+
+	if( n >= 32 && bAvx2 )
+		return ascii_avx2( src, n, width, bBig, dst );
+	if( n >= 8 && bSse2 )
+		return ascii_sse2( src, n, width, bBig, dst );
+#endif
+	return ascii_scalar( src, n, width, bBig, dst );
+}
+
+
+// Watchdog reader thread: read the tags of the files handed by read_tags_deadline
+// An abandoned reader frees its control block when its read finally returns
+static void* reader_thread( void *arg ){
+
+	READER *r = (READER*)arg;
+
+	pthread_mutex_lock( &r->lock );
+
+	while( !r->bAbandoned ){
+
+		while( !r->bBusy && !r->bAbandoned )
+			pthread_cond_wait( &r->cond, &r->lock );
+
+		if( r->bBusy ){
+			pthread_mutex_unlock( &r->lock );
+			read_tags( r->szFileName, r->Size, r->Version, &r->Info );
+			pthread_mutex_lock( &r->lock );
+
+			r->bBusy = FALSE;
+			pthread_cond_broadcast( &r->cond );
+		}
+	}
+
+	pthread_mutex_unlock( &r->lock );
+	pthread_mutex_destroy( &r->lock );
+	pthread_cond_destroy( &r->cond );
+	free( r );
+
+	return NULL;
+}
+
+
+// Read the tags of a file giving up after deadline milliseconds (0 = wait forever)
+// Return FALSE if the read has been abandoned
+static bool read_tags_deadline( SCANCTX* ctx, const char *filename, off_t size, int deadline, TAGINFO *Info ){
+
+	READER *r;
+	struct timespec ts;
+	pthread_t tid;
+	int rc = 0;
+
+	if( deadline <= 0 ){											// no watchdog needed
+		read_tags( filename, size, ctx->ReadFlags, Info );
+		return TRUE;
+	}
+
+	if( ctx->reader == NULL ){										// start a new reader
+
+		r = (READER*)calloc( 1, sizeof(READER) );
+		pthread_mutex_init( &r->lock, NULL );
+		pthread_cond_init( &r->cond, NULL );
+
+		if( pthread_create( &tid, NULL, reader_thread, r ) != 0 ){
+			free( r );
+			read_tags( filename, size, ctx->ReadFlags, Info );
+			return TRUE;
+		}
+		pthread_detach( tid );
+		ctx->reader = r;
+	}
+	r = ctx->reader;
+
+	clock_gettime( CLOCK_REALTIME, &ts );
+	ts.tv_sec  += deadline / 1000;
+	ts.tv_nsec += ( deadline % 1000 ) * 1000000L;
+	if( ts.tv_nsec >= 1000000000L ){
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock( &r->lock );
+
+	strncpy( r->szFileName, filename, PATH_MAX - 1 );
+	r->Size    = size;
+	r->Version = ctx->ReadFlags;
+	r->bBusy   = TRUE;
+	pthread_cond_broadcast( &r->cond );
+
+	while( r->bBusy && rc != ETIMEDOUT )
+		rc = pthread_cond_timedwait( &r->cond, &r->lock, &ts );
+
+	if( r->bBusy ){													// stuck, leave it behind
+		r->bAbandoned = TRUE;
+		pthread_mutex_unlock( &r->lock );
+		ctx->reader = NULL;
+		return FALSE;
+	}
+
+	memcpy( Info, &r->Info, sizeof(TAGINFO) );
+	pthread_mutex_unlock( &r->lock );
+
+	return TRUE;
+}
+
+
+// Stop the reader thread of a scan
+static void reader_release( SCANCTX* ctx ){
+
+	if( ctx->reader != NULL ){
+		pthread_mutex_lock( &ctx->reader->lock );
+		ctx->reader->bAbandoned = TRUE;
+		pthread_cond_broadcast( &ctx->reader->cond );
+		pthread_mutex_unlock( &ctx->reader->lock );
+		ctx->reader = NULL;
+	}
+}
+
+
+// Hand a file to the reader pool, waiting for a free slot under the level of the governor
+static void pool_submit( SCANCTX* ctx, const char* pFile, const char* pFileName, const struct stat* finfo, bool bReplaces ){
+
+	GOVERNOR *g = &ctx->gov;
+	READJOB *job;
+
+	if( ctx->pool == NULL ){
+
+		ctx->pool = new POOL();
+		pthread_mutex_init( &ctx->pool->lock, NULL );
+		pthread_cond_init( &ctx->pool->work, NULL );
+		pthread_cond_init( &ctx->pool->done, NULL );
+		ctx->pool->Version = ctx->ReadFlags;
+		ctx->pool->threads = 0;
+		ctx->pool->refs    = 1;
+		ctx->pool->bStop   = FALSE;
+
+		memset( g, 0, sizeof(GOVERNOR) );
+		if( ctx->opt->jobs != MP3SCAN_JOBS_AUTO )
+			g->limit = ctx->opt->jobs;
+		else if( ctx->stats->jobs_level > 0 )					// the level of the previous scan, still probed
+			g->limit = ctx->stats->jobs_level;
+		else {
+			g->limit      = JOBS_START;
+			g->bSlowStart = TRUE;
+		}
+		if( g->limit > MP3SCAN_JOBS_MAX )
+			g->limit = MP3SCAN_JOBS_MAX;
+		g->wstart = monotonic_usec();
+		ctx->stats->jobs_level = g->limit;
+		if( g->limit > ctx->stats->jobs_peak )
+			ctx->stats->jobs_peak = g->limit;
+	}
+
+	while( ctx->inflight >= g->limit && ctx->inflight > 0 ){		// every reader busy
+		g->wfull = TRUE;
+		pool_collect( ctx );
+	}
+
+	job = new READJOB();
+	job->File       = pFile;
+	job->FileName   = pFileName;
+	job->RelPath    = ctx->szRelativePath;
+	job->Size       = finfo->st_size;
+	job->MTime      = finfo->st_mtime;
+	job->bReplaces  = bReplaces;
+	job->start      = 0;
+	job->usec       = 0;
+	job->bAbandoned = FALSE;
+
+	dir_hold( ctx, ctx->szRelativePath );							// its directory is stored once it is read
+
+	pthread_mutex_lock( &ctx->pool->lock );
+	ctx->pool->queue.push_back( job );
+	ctx->inflight++;
+	pool_spawn( ctx );
+	pthread_cond_signal( &ctx->pool->work );
+	pthread_mutex_unlock( &ctx->pool->lock );
+}
+
+
+// Wait for the reads of the pool to complete and pass their records; with a deadline the
+// reads past it are abandoned and quarantined, their readers replaced
+static void pool_collect( SCANCTX* ctx ){
+
+	POOL *pool = ctx->pool;
+	std::vector<READJOB*> done;
+	std::vector<QUARANTINE> stuck;
+	long long now, first;
+	struct timespec ts;
+	size_t i;
+
+	pthread_mutex_lock( &pool->lock );
+
+	while( pool->finished.empty() && stuck.empty() ){
+
+		if( ctx->opt->deadline <= 0 ){
+			pthread_cond_wait( &pool->done, &pool->lock );
+			continue;
+		}
+
+		now = monotonic_usec();
+		first = 0;
+		for( i = 0; i < pool->running.size(); ){
+
+			READJOB *job = pool->running[i];
+
+			if( now - job->start < ctx->opt->deadline * 1000LL ){
+				if( first == 0 || job->start < first )
+					first = job->start;
+				i++;
+				continue;
+			}
+
+			QUARANTINE q;											// stuck, leave it behind
+			q.File      = job->File;
+			q.FileName  = job->FileName;
+			q.RelPath   = job->RelPath;
+			q.Size      = job->Size;
+			q.MTime     = job->MTime;
+			q.bReplaces = job->bReplaces;
+			stuck.push_back( q );
+
+			job->bAbandoned = TRUE;
+			pool->running.erase( pool->running.begin() + i );
+			pool->threads--;
+			ctx->inflight--;
+		}
+
+		if( !stuck.empty() ){
+			pool_spawn( ctx );										// for the files still queued
+			break;
+		}
+
+		clock_gettime( CLOCK_REALTIME, &ts );						// until the oldest read expires
+		now = ( first != 0 ? first + ctx->opt->deadline * 1000LL - now : ctx->opt->deadline * 1000LL ) + 1000;
+		ts.tv_sec  += now / 1000000;
+		ts.tv_nsec += ( now % 1000000 ) * 1000;
+		if( ts.tv_nsec >= 1000000000L ){
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait( &pool->done, &pool->lock, &ts );
+	}
+
+	done.assign( pool->finished.begin(), pool->finished.end() );
+	pool->finished.clear();
+
+	pthread_mutex_unlock( &pool->lock );
+
+	for( i = 0; i < stuck.size(); i++ ){
+		message( ctx, MP3SCAN_MSG_WARNING, "%s did not answer within %d ms, quarantined", stuck[i].File.c_str(), ctx->opt->deadline );
+		ctx->quarantine.push_back( stuck[i] );
+		ctx->stats->quarantined++;									// its hold on the directory goes to the retry
+	}
+
+	for( i = 0; i < done.size(); i++ ){
+
+		READJOB *job = done[i];
+
+		ctx->inflight--;
+		ctx->gov.wdone++;
+		latency_count( ctx->stats, job->File.c_str(), job->usec );
+
+		if( !ctx->bAbort )
+			tag_emit( ctx, &job->Info, job->File.c_str(), job->FileName.c_str(), job->RelPath.c_str(), job->Size, job->MTime, job->bReplaces );
+		dir_release( ctx, job->RelPath.c_str(), FALSE );
+		delete job;
+	}
+
+	if( ctx->opt->jobs == MP3SCAN_JOBS_AUTO )
+		governor_tick( ctx );
+}
+
+
+// Start readers up to the jobs to read, within the level of the governor (pool locked)
+// Without any reader the scan reads the queued files itself
+static void pool_spawn( SCANCTX* ctx ){
+
+	POOL *pool = ctx->pool;
+	pthread_t tid;
+
+	while( pool->threads < ctx->gov.limit && pool->threads < ctx->inflight ){
+
+		if( pthread_create( &tid, NULL, pool_thread, pool ) != 0 )
+			break;
+		pthread_detach( tid );
+		pool->threads++;
+		pool->refs++;
+	}
+
+	while( pool->threads == 0 && !pool->queue.empty() ){			// no thread available
+
+		READJOB *job = pool->queue.front();
+		pool->queue.pop_front();
+
+		job->start = monotonic_usec();
+		read_tags( job->File.c_str(), job->Size, pool->Version, &job->Info );
+		job->usec = monotonic_usec() - job->start;
+		pool->finished.push_back( job );
+	}
+}
+
+
+// Reader of the pool: read the tags of the queued files until the pool is released
+// A reader whose read has been abandoned frees the job when it returns and quits
+static void* pool_thread( void *arg ){
+
+	POOL *pool = (POOL*)arg;
+	READJOB *job;
+	bool bLast;
+
+	pthread_mutex_lock( &pool->lock );
+
+	for( ;; ){
+
+		while( pool->queue.empty() && !pool->bStop )
+			pthread_cond_wait( &pool->work, &pool->lock );
+
+		if( pool->queue.empty() ){
+			pool->threads--;
+			break;
+		}
+
+		job = pool->queue.front();
+		pool->queue.pop_front();
+		job->start = monotonic_usec();
+		pool->running.push_back( job );
+
+		pthread_mutex_unlock( &pool->lock );
+		read_tags( job->File.c_str(), job->Size, pool->Version, &job->Info );
+		pthread_mutex_lock( &pool->lock );
+
+		if( job->bAbandoned ){										// already replaced
+			delete job;
+			break;
+		}
+
+		job->usec = monotonic_usec() - job->start;
+		pool->running.erase( std::find( pool->running.begin(), pool->running.end(), job ) );
+		pool->finished.push_back( job );
+		pthread_cond_signal( &pool->done );
+	}
+
+	bLast = ( --pool->refs == 0 );
+	pthread_mutex_unlock( &pool->lock );
+
+	if( bLast ){
+		pthread_mutex_destroy( &pool->lock );
+		pthread_cond_destroy( &pool->work );
+		pthread_cond_destroy( &pool->done );
+		delete pool;
+	}
+
+	return NULL;
+}
+
+
+// Stop the readers of a scan, the pool is freed by the last one
+static void pool_release( SCANCTX* ctx ){
+
+	POOL *pool = ctx->pool;
+	bool bLast;
+
+	if( pool == NULL )
+		return;
+
+	pthread_mutex_lock( &pool->lock );
+	pool->bStop = TRUE;
+	pthread_cond_broadcast( &pool->work );
+	bLast = ( --pool->refs == 0 );
+	pthread_mutex_unlock( &pool->lock );
+
+	if( bLast ){
+		pthread_mutex_destroy( &pool->lock );
+		pthread_cond_destroy( &pool->work );
+		pthread_cond_destroy( &pool->done );
+		delete pool;
+	}
+	ctx->pool = NULL;
+}
+
+
+// Adapt the level of the pool to the throughput measured over the last window
+static void governor_tick( SCANCTX* ctx ){
+
+	GOVERNOR *g = &ctx->gov;
+	int old = g->limit;
+	double rate;
+
+	if( !governor_step( g, monotonic_usec(), &rate ) )
+		return;
+
+	if( g->limit != old ){
+		message( ctx, MP3SCAN_MSG_VERBOSE, "Parallel reads: %d -> %d (%.0f files/s)", old, g->limit, rate );
+		ctx->stats->jobs_changes++;
+		if( g->limit > ctx->stats->jobs_peak )
+			ctx->stats->jobs_peak = g->limit;
+	}
+	ctx->stats->jobs_level = g->base > 0 ? g->base : g->limit;
+}
+
+
+// Close the window at now if it is long enough, and choose the level of the next one: double
+// it while the rate grows (slow start), then keep the level and probe one step above and
+// below it from time to time, keeping the probe if it is faster, or as fast with fewer
+// reads in flight. A window where the scan never waited for a reader doesn't count: the
+// reads were not the bottleneck. Measured by mp3scan_bench governor on simulated devices
+// (knee of 2 to 128 reads, +-5% noise): the base level reaches the knee within 0.1 to 2.6 s,
+// the probes then take a window in 6, and the noise sometimes lets a probe below the knee
+// look as fast, leaving the base a few steps under it for a while.
+// Return FALSE if the window goes on, else its rate goes into *pRate
+static bool governor_step( GOVERNOR* g, long long now, double* pRate ){
+
+	long long elapsed = now - g->wstart;
+	int level = g->limit, step = g->limit / 8 > 1 ? g->limit / 8 : 1;
+	double rate;
+
+	if( elapsed < JOBS_WINDOW || ( g->wdone < 2 * g->limit && elapsed < JOBS_WINDOW_MAX ) )
+		return FALSE;
+
+	rate = g->wdone * 1000000.0 / elapsed;
+
+	if( !g->wfull ){												// not saturated, nothing learnt
+
+	} else if( g->base == 0 ){
+		g->base     = g->limit;
+		g->baseRate = rate;
+		level = g->bSlowStart ? g->limit * 2 : g->limit + step;
+
+	} else if( g->limit > g->base ){								// probed up
+		if( rate > g->baseRate * 1.10 ){
+			g->base     = g->limit;
+			g->baseRate = rate;
+			level = g->bSlowStart ? g->limit * 2 : g->limit + step;
+		} else {
+			g->bSlowStart = FALSE;
+			g->hold = JOBS_HOLD;
+			level = g->base;
+		}
+
+	} else if( g->limit < g->base ){								// probed down
+		if( rate >= g->baseRate * 0.95 ){
+			g->base     = g->limit;
+			g->baseRate = rate;
+		} else
+			level = g->base;
+		g->hold = JOBS_HOLD;
+
+	} else {														// at the base level, follow its rate
+		g->baseRate = ( g->baseRate + rate ) / 2;
+		if( g->hold > 0 )
+			g->hold--;
+		else {
+			level = g->bProbeDown ? g->limit - step : g->limit + step;
+			g->bProbeDown = !g->bProbeDown;
+		}
+	}
+
+	if( level < 1 )
+		level = 1;
+	if( level > MP3SCAN_JOBS_MAX )
+		level = MP3SCAN_JOBS_MAX;
+
+	g->limit  = level;
+	g->wstart = now;
+	g->wdone  = 0;
+	g->wfull  = FALSE;
+	*pRate = rate;
+	return TRUE;
+}
+
+
+// Drive a governor with the device of rate, in steps of a millisecond of simulated time
+int mp3scan_governor_sim( MP3SCAN_RATE_CALLBACK rate, void *user, double seconds, MP3SCAN_GOVWINDOW *windows, int max ){
+
+	GOVERNOR g;
+	long long now = 0;
+	double r, measured;
+	int n = 0, limit;
+
+	memset( &g, 0, sizeof(GOVERNOR) );
+	g.limit      = JOBS_START;										// as the first scan
+	g.bSlowStart = TRUE;
+	r = rate( g.limit, user );
+
+	while( n < max && now < seconds * 1000000 ){
+
+		now += 1000;
+		g.wdone = (int)( r * ( now - g.wstart ) / 1000000 );
+		g.wfull = TRUE;
+		limit   = g.limit;
+
+		if( governor_step( &g, now, &measured ) ){
+			windows[n].time  = now / 1000000.0;
+			windows[n].rate  = measured;
+			windows[n].limit = limit;
+			windows[n].base  = g.base;
+			n++;
+			r = rate( g.limit, user );
+		}
+	}
+
+	return n;
+}
+
+
+static long long monotonic_usec(){
+
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+// Retry pass on the quarantined files with a longer deadline
+// Files still not answering are reported as MP3SCAN_FILE_QUARANTINED
+static void quarantine_retry( SCANCTX* ctx ){
+
+	size_t i;
+
+	for( i = 0; i < ctx->quarantine.size() && !ctx->bAbort; i++ ){
+
+		QUARANTINE *q = &ctx->quarantine[i];
+
+		message( ctx, MP3SCAN_MSG_VERBOSE, "Retrying quarantined file %s", q->File.c_str() );
+
+		if( tag_record( ctx, q->File.c_str(), q->FileName.c_str(), q->RelPath.c_str(), q->Size, q->MTime, q->bReplaces,
+						ctx->opt->deadline * QUARANTINE_RETRY ) ){
+			ctx->stats->recovered++;
+			dir_release( ctx, q->RelPath.c_str(), FALSE );
+		} else {													// no row: the next scan enumerates its directory again
+			emit_file( ctx, MP3SCAN_FILE_QUARANTINED, q->RelPath.c_str(), q->FileName.c_str(), q->Size, q->MTime, q->bReplaces );
+			dir_release( ctx, q->RelPath.c_str(), TRUE );
+		}
+	}
+
+	ctx->quarantine.clear();
+}
+
+
+// Add up the stats of a scan to the ones of other scans
+void mp3scan_stats_add( MP3SCAN_STATS *stats, const MP3SCAN_STATS *add ){
+
+	int i;
+
+	stats->files_read      += add->files_read;
+	stats->quarantined     += add->quarantined;
+	stats->recovered       += add->recovered;
+	stats->dirs_enumerated += add->dirs_enumerated;
+	stats->dirs_skipped    += add->dirs_skipped;
+	stats->files_unchanged += add->files_unchanged;
+	stats->files_changed   += add->files_changed;
+	stats->files_added     += add->files_added;
+	stats->files_removed   += add->files_removed;
+	stats->art_stored      += add->art_stored;
+	stats->art_shared      += add->art_shared;
+	stats->files_excluded  += add->files_excluded;
+	stats->dirs_excluded   += add->dirs_excluded;
+	stats->dirs_revisited  += add->dirs_revisited;
+	stats->dirs_other_fs   += add->dirs_other_fs;
+	stats->files_aliased   += add->files_aliased;
+	stats->read_usec       += add->read_usec;
+	stats->order_usec      += add->order_usec;
+	stats->order_offset    += add->order_offset;
+	stats->order_inode     += add->order_inode;
+	stats->jobs_changes    += add->jobs_changes;
+	stats->cache_pages     += add->cache_pages;
+	stats->cache_kept      += add->cache_kept;
+
+	if( add->jobs_level > stats->jobs_level )
+		stats->jobs_level = add->jobs_level;
+	if( add->jobs_peak > stats->jobs_peak )
+		stats->jobs_peak = add->jobs_peak;
+
+	for( i = 0; i < MP3SCAN_LATENCY_BUCKETS; i++ )
+		stats->latency[i] += add->latency[i];
+	for( i = 0; i < add->nslowest; i++ )
+		slowest_add( stats, add->slowest[i].file, add->slowest[i].usec );
+}
+
+
+// Account the time spent reading the tags of a file
+static void latency_count( MP3SCAN_STATS* stats, const char* pFile, long long usec ){
+
+	int bucket = 0;
+
+	while( bucket < MP3SCAN_LATENCY_BUCKETS - 1 && ( 1LL << bucket ) < usec )
+		bucket++;
+	stats->latency[bucket]++;
+	stats->files_read++;
+	stats->read_usec += usec;
+
+	slowest_add( stats, pFile, usec );
+}
+
+
+// Keep the slowest files, sorted
+static void slowest_add( MP3SCAN_STATS* stats, const char* pFile, long long usec ){
+
+	int i;
+
+	if( stats->nslowest < MP3SCAN_SLOWEST_FILES || usec > stats->slowest[stats->nslowest - 1].usec ){
+
+		if( stats->nslowest < MP3SCAN_SLOWEST_FILES )
+			stats->nslowest++;
+		for( i = stats->nslowest - 1; i > 0 && stats->slowest[i - 1].usec < usec; i-- )
+			stats->slowest[i] = stats->slowest[i - 1];
+
+		stats->slowest[i].usec = usec;
+		snprintf( stats->slowest[i].file, PATH_MAX, "%s", pFile );
+	}
+}
+
+
+// Pass a message to the caller
+static void message( SCANCTX* ctx, MP3SCAN_MSGLEVEL level, const char* szFormat, ... ){
+
+	char szBuff[PATH_MAX + 256];
+	va_list ap;
+
+	if( ctx->opt->message == NULL )
+		return;
+
+	va_start( ap, szFormat );
+	vsnprintf( szBuff, sizeof(szBuff), szFormat, ap );
+	va_end( ap );
+
+	ctx->opt->message( level, szBuff, ctx->user );
+}
+
+
+// Check a file name schema: fields A, T, Y, M followed by the separator
+bool check_filename_format( const char *pFormat ){
+
+	size_t i, last = strlen( pFormat );
+
+	if( last < 2 )
+		return FALSE;
+
+	for( i = 0; i < last - 1; i++ )
+		if( strchr( "ATMY", pFormat[i] ) == NULL )
+			return FALSE;
+
+	return TRUE;
+}
+
+
+// Read from filename all information available, pFormat has been checked by check_filename_format
+void filename_to_field( const char *pFileName, const char *pFormat, const char *pSpaceChar, char *szTitle, char *szArtist, char *szAlbum, char *szYear ){
+
+	int i, len, max, last = strlen(pFormat) - 1;
+	char Buffer[256];
+	bool stop = FALSE;
+	char *field;
+	char *lastC;										// end field pointer, point to the last char of the string to copy
+	char *firstC = Buffer;								// start field pointer, point to the first char of the string to copy
+
+	snprintf( Buffer, sizeof(Buffer), "%s", pFileName );	// copy the filename into an internal buffer
+	replace_char( Buffer, pSpaceChar );					// replace all provided characters with space
+
+	for( i = 0; i < last && !stop; i++ ){
+
+		// pFormat[last] is the field separator
+		if( (lastC = index( firstC, pFormat[last] )) == NULL ) {
+
+			lastC = &firstC[strlen(firstC)-4];			// get the end field pointer
+			stop = TRUE;									// force to be the last loop
+		}
+
+		len = (lastC - firstC) / sizeof(char);			// get the length of the field found
+		while( len > 0 && firstC[0] == 0x20 ){			// delete all spaces at the beginning of the string
+
+			firstC ++;
+			len--;
+		}
+
+		switch( pFormat[i] ){
+			case 'A': field = szArtist; max = MP3SCAN_TITLE_LEN - 1; break;
+			case 'M': field = szAlbum;  max = MP3SCAN_TITLE_LEN - 1; break;
+			case 'T': field = szTitle;  max = MP3SCAN_TITLE_LEN - 1; break;
+			default:  field = szYear;   max = MP3SCAN_YEAR_LEN - 1;  break;
+		}
+
+		if( len > max )
+			len = max;
+		if( len < 0 )
+			len = 0;
+
+		memcpy( field, firstC, len );
+		if( len > 0 && field[len-1] == 0x20 )			// remove, if present, a space at the end of the string
+			len--;
+		field[len] = '\0';
+
+		// set the pointer to first position to actual last + 1
+		firstC = lastC + 1;
+	}
+}
+
+
+// Replace all SpaceChar in str with the space character
+void replace_char( char *str, const char *pSpaceChar ){
+
+	if( pSpaceChar != NULL ){
+
+		for( ; *str; str++ ){
+			if( strchr( pSpaceChar, *str ) != NULL )
+				*str = 0x20;								// replace the SpaceChar with space ( " " )
+		}
+	}
+}
+
+
+// Escape str for a SQL literal between single quotes into dst of cap bytes: quotes are
+// doubled, and backslashes too with bBackslash (MySQL). Return dst
+const char* sql_escape( const char *str, bool bBackslash, char *dst, size_t cap ){
+
+	char *p = dst, *end = dst + cap - 2;							// room for a doubled character and the '\0'
+
+	for( ; *str && p < end; str++ ){
+		if( *str == '\'' || ( *str == '\\' && bBackslash ) )
+			*p++ = *str;
+		*p++ = *str;
+	}
+	*p = '\0';
+
+	return dst;
+}
+
+
+// INSERT statement of a file into pTable
+void sql_row( char *szQuery, size_t len, const char *pTable, bool bBackslash, const char *Title, const char *Artist, const char *Album, const char *Year,
+			  const char *FileName, const char *Path, off_t Size, time_t MTime, const char *Art, const char *Alias ){
+
+	char szField[7][2 * PATH_MAX];
+
+	snprintf( szQuery, len, "INSERT INTO %s( artist, title, album, year, filename, path, size, mtime, art, alias ) VALUES ( '%s', '%s', '%s', '%s', '%s', '%s', '%lld', %lld, %s%s%s, %s%s%s )",
+			  pTable, sql_escape( Artist, bBackslash, szField[0], sizeof(szField[0]) ), sql_escape( Title, bBackslash, szField[1], sizeof(szField[1]) ),
+			  sql_escape( Album, bBackslash, szField[2], sizeof(szField[2]) ), sql_escape( Year, bBackslash, szField[3], sizeof(szField[3]) ),
+			  sql_escape( FileName, bBackslash, szField[4], sizeof(szField[4]) ), sql_escape( Path, bBackslash, szField[5], sizeof(szField[5]) ),
+			  (long long)Size, (long long)MTime,
+			  Art[0] ? "'" : "", Art[0] ? Art : "NULL", Art[0] ? "'" : "",	// the hash is hexadecimal, nothing to escape
+			  Alias[0] ? "'" : "", Alias[0] ? sql_escape( Alias, bBackslash, szField[6], sizeof(szField[6]) ) : "NULL", Alias[0] ? "'" : "" );
+}
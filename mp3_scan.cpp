@@ -6,7 +6,23 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdarg.h>
-#include <id3/tag.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#ifdef __linux__
+	#include <sys/epoll.h>
+	#include <sys/signalfd.h>
+	#include <sys/sysmacros.h>
+#endif
+#include "mp3scan.h"
 
 #ifdef __MYSQL
 	#include <mysql.h>
@@ -40,10 +56,12 @@
 
 
 /*
-Usage: mp3_scan [OPTIONS] PATH
+Usage: mp3_scan [OPTIONS] PATH [PATH...]
 Scan a directory to find mp3 files and insert the infos into a database
 
-  PATH					directory to scan for mp3 files
+  PATH					directory to scan for mp3 files, several ones go into the same table:
+						the roots on different disks are scanned in parallel, the ones on
+						a disk one after the other (--jobs applies to each disk)
 
 Options:
   -v, --version			display program version and exit
@@ -57,6 +75,24 @@ Options:
   -i, --interactive		ask user when found an inconsistency
   -1, --ID3V1			use only informations from ID3v1 tag (default is use v1 and v2)
   -2, --ID3V2			use only informations from ID3v2 tag (default is use v1 and v2)
+  -S, --stats			print a summary of the scan (tag read latency, slowest files)
+  -t, --deadline MS		give up reading a file after MS milliseconds, quarantine it
+						and retry it at the end of the scan
+  -j, --jobs N|auto		read N files in parallel (default 1), auto: find the number of
+						parallel reads of the best throughput while scanning (see --stats)
+  -U, --update			update the table of a previous scan: only new and changed files
+						are read, directories with unchanged mtime are not read again
+      --trust-dir-mtime	with --update, don't check the files of unchanged directories
+      --extract-art DIR	store the cover art of the files into DIR, one file per picture
+						named after its SHA-256, the hash goes into the art column
+  -x, --one-file-system	don't descend into directories on other file systems (mount points)
+      --dedup-files		store the hard links of a file read once as aliases: no tags, the
+						alias column holds the path of the file read
+      --hdd				read the tags of each directory in disk order (spinning disks)
+      --hdd-scan		enumerate the whole tree first, then read all tags in disk order
+      --no-cache-pollution
+						read only the pages of the tags, without read-ahead, and drop from
+						the page cache the pages the scan brought in (growth in --stats)
   
 Filename:
 Use file name information if no ID3 TAG found
@@ -70,6 +106,33 @@ Use file name information if no ID3 TAG found
   Examples: --usefilename AT- --spacechar _ with filenames like: Ludwig_van_Beethoven_-_Fur_Elise.mp3
             --usefilename TAY- with filenames like: Fur Elise - Ludwig van Beethoven - 1810.mp3
 
+Filters:
+Skip files and directories of PATH, an excluded directory is not even opened
+
+  --exclude GLOB
+  --include GLOB
+
+  GLOB					* and ? don't match /, ** matches any directories, [a-z] [!a-z] are classes,
+						a trailing / matches only directories; a GLOB without / matches the name at
+						any depth, else the path from PATH. The first matching rule wins.
+  .mp3scanignore		a directory holding a file of this name is skipped, with its subdirectories
+
+  Examples: --exclude .Trash/ --exclude @eaDir/ --exclude '*.part.mp3'
+            --include Podcasts/Favorites/ --exclude 'Podcasts/?*'
+
+Sizes:
+Sum the sizes of the mp3 files like du, without reading them nor using a database
+
+  --size-only [--top N]
+
+  --size-only			total size of the mp3 files of PATH, exact to the byte; the
+						directories are enumerated in parallel (--jobs, default 4 per CPU)
+  N						also list the N directories holding the most bytes of mp3 files,
+						counting only their own files (not the ones of their subdirectories)
+
+  Examples: mp3_scan -r --size-only /mnt/music
+            mp3_scan -r -x --size-only --top 20 --exclude Podcasts/ /mnt/music
+
 MySQL:
 Use mysql as default database to store mp3 files' info
 
@@ -78,22 +141,81 @@ Use mysql as default database to store mp3 files' info
   HOST					IP address od the MySQL database
   USER					username used for login
   PASSWORD				password used for login -optional-
-  DATABASE				name of database to use
+  DATABASE				name of database to use, put another option between DATABASE and
+						the PATHs if there are more than one, or it is taken as PASSWORD
 
 SQLite:
 Use sqlite as default database to store mp3 files' info
 
   -l, --sqlite FILENAME
+      --bulk
   
   FILENAME				filename for the database
+  --bulk				first load of a table: the rows are staged in memory, then written in
+						a single transaction without sync, and without journal into an empty
+						table (a crash during it can corrupt FILENAME); the indexes are built
+						after the rows
+
+Output file:
+Write the mp3 files' info to a file for a bulk loader instead of a database
+
+  -o, --output FORMAT[:FILE]
+      --rotate SIZE
+
+  FORMAT				ndjson (one JSON object per line) or csv (with a header line)
+  FILE					output file, - or none for the standard output
+  SIZE					start a new FILE.0001.EXT, FILE.0002.EXT, ... every SIZE bytes (K, M, G)
+
+  Examples: mp3_scan -r --output ndjson /mnt/music | clickhouse-client -q "INSERT INTO mp3 FORMAT JSONEachRow"
+            mp3_scan -r --output csv:music.csv --rotate 512M /mnt/music
+
+Distributed scan:
+Split the top-level subdirectories of PATH among worker processes
+
+  -w, --workers N
+      --listen [HOST:]PORT
+      --worker HOST:PORT [PATH]
+
+  N						number of local worker processes to spawn
+  HOST:PORT				address where the coordinator accepts remote workers, only on the
+						loopback without HOST (0.0.0.0 for every interface); the workers
+						are not authenticated, open it to trusted networks only
+  --worker				run as a worker of the coordinator at HOST:PORT, PATH is
+						the local mount of the library root -optional-
+
+  Examples: mp3_scan -r -l music.db --workers 4 /mnt/music
+            mp3_scan -r -l music.db --listen 0.0.0.0:7100 /mnt/music   (coordinator on host A)
+            mp3_scan --worker hostA:7100 /mnt/music                     (worker on host B)
+
+Catalog server:
+Answer artist, album and year lookups from memory on a Unix socket
+
+  mp3_scan serve --socket PATH -l FILENAME [-c TAB]
+  mp3_scan serve --socket PATH -m HOST USER [PASSWORD] DATABASE [-c TAB]
+
+  request				4-byte big-endian length, then P FIELD PREFIX [LIMIT], E FIELD VALUE [LIMIT]
+						or R FIELD FROM TO [LIMIT] separated by tabs, FIELD: artist, album or year
+  response				4-byte big-endian length, then OK ROWS GENERATION and one line per row,
+						or ERR MESSAGE; the catalog is reloaded when a scan commits or on SIGHUP
+
+Catalog diff:
+Write the tracks added, removed and changed between two scans, by path and filename
+
+  mp3_scan diff OLD NEW [-c TAB] [--output ndjson|sql[:FILE]] [--memory MB]
+
+  OLD, NEW				SQLite files of the two scans
+  ndjson				one object per change, op: add, delete or modify, and the fields of
+						the row in NEW (default, to the standard output)
+  sql					the statements that bring the table of OLD to NEW, in a transaction
+  MB					memory of the sort (default 256), the rest is spilled to TMPDIR
 */
 
 #define FALSE 0
 #define TRUE  1
-#define ID3v1 0x01
-#define ID3v2 0x02
+#define ID3v1 MP3SCAN_ID3V1
+#define ID3v2 MP3SCAN_ID3V2
 
-#define USAGE "Usage: mp3_scan [OPTIONS] PATH\nScan a directory to find mp3 files and insert the infos into a database\n\n  PATH\t\t\t\tdirectory to scan for mp3 files\n\nOptions:\n  -v, --version\t\t\tdisplay program version and exit\n  -h, --help\t\t\tdisplay this help and exit\n  -V, --verbose\t\t\tverbose output\n  -f, --fsize\t\t\tprint the sum of the size of all mp3 files found\n  -r, --recursive\t\trecursively search mp3 files in subdirectories\n  -c, --createtab TAB\t\tcreate a new or use an existent table in database named TAB\n  -p, --relativepath\t\tinsert into database relative paths instead of absolute\n  -u, --usecolor\t\tuse color for command line output\n  -i, --interactive\t\task user when found an inconsistency\n  -1, --ID3V1\t\t\tuse only informations from ID3v1 tag (default is use v1 and v2)\n  -2, --ID3V2\t\t\tuse only informations from ID3v2 tag (default is use v1 and v2)\n\nFilename:\nUse file name information if no ID3 TAG found\n\n  -n, --usefilename SEQTAG\n  -s, --spacechar   SEPLIST\n\n  SEQTAG\t\t\tfile name schema: A = Artist, T = Title, Y = Year, M = Album, * = Separator\n  SEPLIST\t\t\tlist of characters to replace with space\n\n  Examples: --usefilename AT- --spacechar _ with filenames like: Ludwig_van_Beethoven_-_Fur_Elise.mp3\n            --usefilename TAY- with filenames like: Fur Elise - Ludwig van Beethoven - 1810.mp3\n\nMySQL:\nUse mysql as default database to store mp3 files' info\n\n  -m, --mysql HOST USER [PASSWORD] DATABASE\n\n  HOST\t\t\t\tIP address od the MySQL database\n  USER\t\t\t\tusername used for login\n  PASSWORD\t\t\tpassword used for login -optional-\n  DATABASE\t\t\tname of database to use\n\nSQLite:\nUse sqlite as default database to store mp3 files' info\n\n  -l, --sqlite FILENAME\n\n  FILENAME\t\t\tfilename for the database\n"
+#define USAGE "Usage: mp3_scan [OPTIONS] PATH [PATH...]\nScan a directory to find mp3 files and insert the infos into a database\n\n  PATH\t\t\t\tdirectory to scan for mp3 files, several ones go into the same table:\n\t\t\t\tthe roots on different disks are scanned in parallel, the ones on\n\t\t\t\ta disk one after the other (--jobs applies to each disk)\n\nOptions:\n  -v, --version\t\t\tdisplay program version and exit\n  -h, --help\t\t\tdisplay this help and exit\n  -V, --verbose\t\t\tverbose output\n  -f, --fsize\t\t\tprint the sum of the size of all mp3 files found\n  -r, --recursive\t\trecursively search mp3 files in subdirectories\n  -c, --createtab TAB\t\tcreate a new or use an existent table in database named TAB\n  -p, --relativepath\t\tinsert into database relative paths instead of absolute\n  -u, --usecolor\t\tuse color for command line output\n  -i, --interactive\t\task user when found an inconsistency\n  -1, --ID3V1\t\t\tuse only informations from ID3v1 tag (default is use v1 and v2)\n  -2, --ID3V2\t\t\tuse only informations from ID3v2 tag (default is use v1 and v2)\n  -S, --stats\t\t\tprint a summary of the scan (tag read latency, slowest files)\n  -t, --deadline MS\t\tgive up reading a file after MS milliseconds, quarantine it\n\t\t\t\tand retry it at the end of the scan\n  -j, --jobs N|auto\t\tread N files in parallel (default 1), auto: find the number of\n\t\t\t\tparallel reads of the best throughput while scanning (see --stats)\n  -U, --update\t\t\tupdate the table of a previous scan: only new and changed files\n\t\t\t\tare read, directories with unchanged mtime are not read again\n      --trust-dir-mtime\twith --update, don't check the files of unchanged directories\n      --extract-art DIR\tstore the cover art of the files into DIR, one file per picture\n\t\t\t\tnamed after its SHA-256, the hash goes into the art column\n  -x, --one-file-system\tdon't descend into directories on other file systems (mount points)\n      --dedup-files\t\tstore the hard links of a file read once as aliases: no tags, the\n\t\t\t\talias column holds the path of the file read\n      --hdd\t\t\tread the tags of each directory in disk order (spinning disks)\n      --hdd-scan\t\tenumerate the whole tree first, then read all tags in disk order\n      --no-cache-pollution\n\t\t\t\tread only the pages of the tags, without read-ahead, and drop from\n\t\t\t\tthe page cache the pages the scan brought in (growth in --stats)\n\nFilename:\nUse file name information if no ID3 TAG found\n\n  -n, --usefilename SEQTAG\n  -s, --spacechar   SEPLIST\n\n  SEQTAG\t\t\tfile name schema: A = Artist, T = Title, Y = Year, M = Album, * = Separator\n  SEPLIST\t\t\tlist of characters to replace with space\n\n  Examples: --usefilename AT- --spacechar _ with filenames like: Ludwig_van_Beethoven_-_Fur_Elise.mp3\n            --usefilename TAY- with filenames like: Fur Elise - Ludwig van Beethoven - 1810.mp3\n\nFilters:\nSkip files and directories of PATH, an excluded directory is not even opened\n\n  --exclude GLOB\n  --include GLOB\n\n  GLOB\t\t\t\t* and ? don't match /, ** matches any directories, [a-z] [!a-z] are classes,\n\t\t\t\ta trailing / matches only directories; a GLOB without / matches the name at\n\t\t\t\tany depth, else the path from PATH. The first matching rule wins.\n  .mp3scanignore\t\ta directory holding a file of this name is skipped, with its subdirectories\n\n  Examples: --exclude .Trash/ --exclude @eaDir/ --exclude '*.part.mp3'\n            --include Podcasts/Favorites/ --exclude 'Podcasts/?*'\n\nSizes:\nSum the sizes of the mp3 files like du, without reading them nor using a database\n\n  --size-only [--top N]\n\n  --size-only\t\t\ttotal size of the mp3 files of PATH, exact to the byte; the\n\t\t\t\tdirectories are enumerated in parallel (--jobs, default 4 per CPU)\n  N\t\t\t\talso list the N directories holding the most bytes of mp3 files,\n\t\t\t\tcounting only their own files (not the ones of their subdirectories)\n\n  Examples: mp3_scan -r --size-only /mnt/music\n            mp3_scan -r -x --size-only --top 20 --exclude Podcasts/ /mnt/music\n\nMySQL:\nUse mysql as default database to store mp3 files' info\n\n  -m, --mysql HOST USER [PASSWORD] DATABASE\n\n  HOST\t\t\t\tIP address od the MySQL database\n  USER\t\t\t\tusername used for login\n  PASSWORD\t\t\tpassword used for login -optional-\n  DATABASE\t\t\tname of database to use, put another option between DATABASE and\n\t\t\t\tthe PATHs if there are more than one, or it is taken as PASSWORD\n\nSQLite:\nUse sqlite as default database to store mp3 files' info\n\n  -l, --sqlite FILENAME\n      --bulk\n\n  FILENAME\t\t\tfilename for the database\n  --bulk\t\t\tfirst load of a table: the rows are staged in memory, then written in\n\t\t\t\ta single transaction without sync, and without journal into an empty\n\t\t\t\ttable (a crash during it can corrupt FILENAME); the indexes are built\n\t\t\t\tafter the rows\n\nOutput file:\nWrite the mp3 files' info to a file for a bulk loader instead of a database\n\n  -o, --output FORMAT[:FILE]\n      --rotate SIZE\n\n  FORMAT\t\t\tndjson (one JSON object per line) or csv (with a header line)\n  FILE\t\t\t\toutput file, - or none for the standard output\n  SIZE\t\t\t\tstart a new FILE.0001.EXT, FILE.0002.EXT, ... every SIZE bytes (K, M, G)\n\n  Examples: mp3_scan -r --output ndjson /mnt/music | clickhouse-client -q \"INSERT INTO mp3 FORMAT JSONEachRow\"\n            mp3_scan -r --output csv:music.csv --rotate 512M /mnt/music\n\nDistributed scan:\nSplit the top-level subdirectories of PATH among worker processes\n\n  -w, --workers N\n      --listen [HOST:]PORT\n      --worker HOST:PORT [PATH]\n\n  N\t\t\t\tnumber of local worker processes to spawn\n  HOST:PORT\t\t\taddress where the coordinator accepts remote workers, only on the\n\t\t\t\tloopback without HOST (0.0.0.0 for every interface); the workers\n\t\t\t\tare not authenticated, open it to trusted networks only\n  --worker\t\t\trun as a worker of the coordinator at HOST:PORT, PATH is\n\t\t\t\tthe local mount of the library root -optional-\n\n  Examples: mp3_scan -r -l music.db --workers 4 /mnt/music\n            mp3_scan -r -l music.db --listen 0.0.0.0:7100 /mnt/music   (coordinator on host A)\n            mp3_scan --worker hostA:7100 /mnt/music                     (worker on host B)\n\nCatalog server:\nAnswer artist, album and year lookups from memory on a Unix socket\n\n  mp3_scan serve --socket PATH -l FILENAME [-c TAB]\n  mp3_scan serve --socket PATH -m HOST USER [PASSWORD] DATABASE [-c TAB]\n\n  request\t\t\t4-byte big-endian length, then P FIELD PREFIX [LIMIT], E FIELD VALUE [LIMIT]\n\t\t\t\tor R FIELD FROM TO [LIMIT] separated by tabs, FIELD: artist, album or year\n  response\t\t\t4-byte big-endian length, then OK ROWS GENERATION and one line per row,\n\t\t\t\tor ERR MESSAGE; the catalog is reloaded when a scan commits or on SIGHUP\n\nCatalog diff:\nWrite the tracks added, removed and changed between two scans, by path and filename\n\n  mp3_scan diff OLD NEW [-c TAB] [--output ndjson|sql[:FILE]] [--memory MB]\n\n  OLD, NEW\t\t\tSQLite files of the two scans\n  ndjson\t\t\tone object per change, op: add, delete or modify, and the fields of\n\t\t\t\tthe row in NEW (default, to the standard output)\n  sql\t\t\t\tthe statements that bring the table of OLD to NEW, in a transaction\n  MB\t\t\t\tmemory of the sort (default 256), the rest is spilled to TMPDIR\n"
 
 #define COPYRIGHT "\nmp3_scan v1.0, Copyright (c) 2009 - by Simmiyy^ (simmiyy@gmail.com)\n"
 #define VERSION "This is free software. You may redistribute copies of it under the terms of\nthe GNU General Public License <http://www.gnu.org/licenses/gpl.html>.\nThere is NO WARRANTY, to the extent permitted by law.\n\n"
@@ -102,11 +224,24 @@ Use sqlite as default database to store mp3 files' info
 #define PATH_MAX 256
 #endif
 
+#define OUT_BUFFER    ( 1 << 20 )								// buffer of the --output writer
+
+#define MAX_WORKERS   256
+#define SERVE_KEYS    3											// indexes of serve: artist, album, year
+#define SERVE_REQUEST 65536										// longest request of a serve client
+#define SERVE_EVENTS  64
+#define SERVE_POLL    1											// seconds between two checks of the table by serve
+#define SERVE_QUIET   2											//   and without a change before it is loaded again
+#define IGNORE_MARKER ".mp3scanignore"								// a directory holding this file is not scanned
+#define PROTO_VERSION "9"
+#define BULK_PAGE_SIZE 16384										// page size of a new SQLite file, --bulk
+#define BULK_CACHE_KB  262144										//   and page cache of the load
+#define DIFF_MEMORY   256										// MB of the sort of diff, spilled beyond
+#define DIFF_FIELDS   10										// fields of a row of diff
+#define PROGRESS_INTERVAL 10										// seconds between two progress lines of the roots, --verbose
+
 #define VERBOSE_LOG( A ) { if( bVerbose ) print_message( STATUS, A ); }
 #define VERBOSE_LOG1( A, B ) { if( bVerbose ) print_message( STATUS, A, B ); }
-#define CHECKBUFFERS( A, B, C, D ) \
-	if( A[0] != '\0' && B[0] != '\0' && strcmp( A, B ) != 0 && bInteractive && chose_field( C, A, B, D ) ) A[0] = '\0'; \
-	if( A[0] == '\0' && B[0] != '\0' ) strcpy( A, B );
 
 typedef enum {
 	TOO_MANY_DB = 0,
@@ -132,14 +267,51 @@ typedef enum {
 	END_LOOP,
 	BAD_FORMAT,
 	FNFORMAT_PARAM_ERROR,
-	SPACECHAR_PARAM_ERROR
+	SPACECHAR_PARAM_ERROR,
+	WORKERS_PARAM_ERROR,
+	WORKER_PARAM_ERROR,
+	INTERACTIVE_WORKERS_ERROR,
+	SOCKET_ERROR,
+	PROTOCOL_ERROR,
+	NO_WORKER_AVAILABLE,
+	WORKER_PROGRAM_ERROR,
+	DEADLINE_PARAM_ERROR,
+	UPDATE_WORKERS_ERROR,
+	ART_PARAM_ERROR,
+	OUTPUT_PARAM_ERROR,
+	UPDATE_OUTPUT_ERROR,
+	FILTER_PARAM_ERROR,
+	JOBS_PARAM_ERROR,
+	SERVE_PARAM_ERROR,
+	SERVE_SOCKET_ERROR,
+	ROOTS_PARAM_ERROR,
+	BULK_PARAM_ERROR,
+	DIFF_PARAM_ERROR,
+	DIFF_OPEN_ERROR,
+	DIFF_SPILL_ERROR,
+	SIZE_PARAM_ERROR
 } RETURNCODE;
 
 typedef enum {
 	USE_MYSQL,
-	USE_SQLITE
+	USE_SQLITE,
+	USE_REMOTE,													// worker mode: records are sent to the coordinator
+	USE_FILE													// --output: records are written to a file for a bulk loader
 } SELDB;
 
+typedef enum {
+	OUT_NDJSON,
+	OUT_CSV,
+	OUT_SQL														// diff only
+} OUTFORMAT;
+
+typedef enum {
+	LINE_ERROR,
+	LINE_OK,
+	LINE_READY,
+	LINE_DONE
+} LINECODE;
+
 typedef enum {
 	ERROR,
 	STATUS,
@@ -152,6 +324,106 @@ typedef enum {
 #endif
 typedef unsigned char byte;
 
+typedef struct {												// buffered writer of --output
+	int       fd;
+	char     *buf;
+	size_t    len;
+	long long chunk;											// bytes of the current chunk
+	int       nchunk;
+} OUTWRITER;
+
+typedef struct {												// the table loaded by serve, one array per column
+	char     *heap;												// the rows in the response format, one line each
+	size_t    used;
+	size_t    size;
+	size_t   *line;												// of every row: its line in heap
+	unsigned *linelen;
+	size_t   *key[SERVE_KEYS];									//   and its artist, album and year fields (escaped)
+	unsigned *keylen[SERVE_KEYS];
+	int      *by[SERVE_KEYS];									// the rows sorted by each key, ignoring the ASCII case
+	int       rows;
+	int       cap;
+	int       generation;
+	int       refs;												// serve + the responses being sent out of the heap
+} CATALOG;
+
+typedef struct {												// a client connected to serve
+	int       fd;
+	char     *in;												// received, not answered yet
+	size_t    inlen;
+	size_t    incap;
+	CATALOG  *cat;												// of the response being sent, NULL if none
+	struct iovec *iov;											// the response: head, then lines of cat->heap
+	int       iovcnt;
+	int       iovcap;
+	int       iovpos;
+	char      head[64];											// length prefix and status line
+} CLIENT;
+
+typedef struct {												// a connected worker of a distributed scan
+	int    fd;
+	FILE  *out;
+	char  *buf;
+	size_t len;
+	size_t cap;
+	int    task;												// task in progress, -1 if idle
+	bool   bReady;												// HELLO received, can take a task
+	char  *rows;												// REC and DIR lines of the task, stored once it is done
+	size_t rowlen;
+	size_t rowcap;
+} WORKER;
+
+typedef struct {												// a PATH of a local scan
+	const char    *pArg;											// as given on the command line
+	char           szPath[PATH_MAX];								// absolute
+	dev_t          dev;												// disk holding it
+	int            device;											// in Devices
+	MP3SCAN_INDEX *pIndex;											// previous scan of the root, loaded by --update
+	MP3SCAN_STATS  stats;
+	long long      files;											// found so far, under RecordLock
+	long long      bytes;
+	long long      start;											// us, 0 = waiting for the roots before it on its disk
+	long long      stop;											//   0 = being scanned
+	RETURNCODE     ret;
+} ROOT;
+
+typedef struct {												// a disk, its roots are scanned one after the other
+	dev_t     dev;
+	pthread_t thread;
+	MP3SCAN_FILTER *pFilter;										// the rules, a filter per thread (its DFA grows while matching)
+} DEVICE;
+
+typedef struct {												// a sorted run of the rows of a catalog, see diff_catalogs
+	FILE   *file;												// spilled to a temporary file, NULL if in memory
+	char  **rows;												// in memory
+	int     nrows;
+	int     pos;
+	char   *line;												// current row, NULL at the end
+	char   *buf;												//   read from file
+	size_t  cap;
+} RUN;
+
+typedef struct {												// directory of the --top report
+	char     *pPath;
+	long long files;
+	long long bytes;
+} TOPDIR;
+
+typedef struct {												// the rows of a catalog, sorted by path and filename
+	char   *heap;												// rows being loaded, in the order of the table
+	size_t  used;
+	size_t  size;
+	char  **rows;
+	int     nrows;
+	int     cap;
+	RUN    *runs;
+	int     nruns;
+	int    *merge;												// heap of the runs by their current row
+	int     nmerge;
+	int     last;												// run of the row returned last, -1 if none
+	long long total;
+} SORTER;
+
 /*
  * Global Variables
  */
@@ -166,6 +438,17 @@ bool  bRelPath;
 bool  bUseFileName;
 bool  bUseSpaceChar;
 bool  bInteractive;
+bool  bStats;
+bool  bUpdate;
+bool  bTrustDirMtime;
+bool  bOneFileSystem;
+bool  bServe;
+bool  bDedupFiles;
+bool  bNoCache;
+bool  bBulk;
+bool  bDiff;
+bool  bSizeOnly;
+MP3SCAN_ORDER ReadOrder;
 byte  TagVersion;
 
 union handle_db {
@@ -175,6 +458,7 @@ union handle_db {
 #ifdef __SQLITE
 	sqlite3 *sqlite_handle;
 #endif
+	int remote_socket;
 	bool init;
 } DB_handle;
 
@@ -189,10 +473,47 @@ const char* pProgramName;
 const char* pError;
 const char* pFileNameFormat;
 const char* pSpaceChar;
+const char* pListen;
+const char* pCoordinator;
+const char* pArtDir;
+const char* pOutFile;											// NULL = stdout
+const char* pSocket;											// serve --socket
+const char* pDiffOld;											// diff OLD NEW
+const char* pDiffNew;
 
 char  szCurrentPath[PATH_MAX];
-char  szRelativePath[PATH_MAX];
+char  szArtDir[PATH_MAX];											// absolute path of --extract-art
+char  szRoot[PATH_MAX];											// absolute path of the library root
 int   Mp3Counter;
+int   Workers;
+FILE* pRemoteOut;
+OUTFORMAT OutFormat;
+OUTWRITER Out;
+long long RotateSize;											// --rotate, 0 = a single file
+long long DiffMemory;											// bytes of the sort of diff
+int   Deadline;													// per-file deadline in milliseconds, 0 = none
+int   Jobs;														// files read in parallel, MP3SCAN_JOBS_AUTO, 0 = one at a time
+long long CachedStart;											// page cache of the system at start (KB), -1 = unknown
+
+MP3SCAN_STATS  Stats;											// counters of all the scans of the run
+ROOT *Roots;													// the PATHs to scan
+int   nRoots;
+DEVICE *Devices;												// the disks of the roots, scanned in parallel
+int   nDevices;
+int   DevicesDone;
+pthread_mutex_t RecordLock = PTHREAD_MUTEX_INITIALIZER;			// records of the disks, the DB and the counters
+pthread_cond_t  DeviceDone = PTHREAD_COND_INITIALIZER;
+TOPDIR *pTop;													// --top: the largest directories, largest first
+int   nTop;
+int   TopDirs;													// --top N, 0 = no report
+MP3SCAN_FILTER *pFilter;										// --exclude and --include rules, NULL = none (a disk thread builds its own)
+char **pRules;													// the same rules as "-GLOB" and "+GLOB", for the workers
+int   nRules;
+CATALOG *pCatalog;												// served by serve
+CATALOG *pLoading;												// being loaded
+int   SortKey;													// index sorted by catalog_order
+char *pVersion;													// filled by table_version_row
+long long BulkRows;												// rows of the table before --bulk, filled by bulk_rows_row
 
 const char* pTBName = "MP3";
 
@@ -203,21 +524,95 @@ SELDB UseDB;
  */
 
 RETURNCODE check_flag( int argc, const char* argv[] );
-RETURNCODE mp3_scan_loop( bool bScanOnly );
+RETURNCODE mp3_scan_path( const char* pRel );
+RETURNCODE scan_result( MP3SCAN_RESULT res );
+RETURNCODE roots_open();
+bool root_inside( const char* pPath, const char* pRoot );
+dev_t root_disk( dev_t dev );
+RETURNCODE scan_roots();
+void* scan_device( void* arg );
+void scan_root( ROOT* r );
+void root_count( ROOT* r, off_t Size );
+void roots_progress();
+long long monotonic_usec();
+void scan_options( MP3SCAN_OPTIONS* opt );
+bool add_rule( char sign, const char* pPattern );
+MP3SCAN_FILTER* rules_filter();
+int  scan_record( const MP3SCAN_RECORD* rec, void* user );
+int  size_record( const MP3SCAN_DIRSIZE* dir, void* user );
+void top_add( ROOT* r, const MP3SCAN_DIRSIZE* dir );
+void print_top();
+void scan_message( MP3SCAN_MSGLEVEL level, const char* msg, void* user );
+bool record_path( const char* pRel, char* szPath );
+void load_index();
 RETURNCODE OpenDBConnection();
 RETURNCODE CloseDBConnection();
-bool is_mp3_file( char* pFileName );
-void filename_to_field( const char *pFileName, char *szTitle, char *szArtist, char *szAlbum, char *szYear );
-void sql_insert( const char* Title, const char* Artist, const char* Album, const char* Year, const char* FileName, const char* Path, off_t Size );
-void get_tags( const char *filename, char *title, char *artist, char *album, char *year );
+void sql_insert( const char* Title, const char* Artist, const char* Album, const char* Year, const char* FileName, const char* Path, off_t Size, time_t MTime, const char* Art, const char* Alias );
+void sql_delete( const char* Path, const char* FileName );
+void sql_delete_query( char* szQuery, size_t len, const char* Path, const char* FileName );
+void sql_exec( const char* szQuery );
+void sql_select( const char* szQuery, void (*row)( char** cols ) );
+const char* sql_escape( const char* str, int slot );
+void dir_store( const char* pRel, const char* pPath, long long MTime, int Entries, int Subdirs );
+void dir_delete( const char* Path );
+bool out_open();
+void out_flush();
+void out_write( const char* p, size_t len );
+void out_close();
+void out_puts( const char* str );
+void out_text( const char* str );
+void out_record( const char* Title, const char* Artist, const char* Album, const char* Year, const char* FileName, const char* Path, off_t Size, time_t MTime, const char* Art, const char* Alias );
+void print_stats();
+long long page_cache_kb();
 void print_message( MSGCODE code, const char* szFormat, ... );
-void get_id3_tag( const char* pFileName, off_t size );
-int chose_field( const char *filename, const char *field1, const char *field2, int fieldname );
-void replace_char( char *str );
+int  chose_field( const char *filename, const char *field1, const char *field2, int fieldname, void *user );
 void print_error( RETURNCODE code );
 void create_table();
+void create_indexes();
+void bulk_begin();
+void bulk_commit();
+void bulk_rows_row( char** cols );
 void size_count( off_t Size );
+void size_text( long long Size, char* szSize, size_t len );
 void init();
+RETURNCODE coordinator_loop();
+RETURNCODE worker_loop();
+int  open_socket( const char* pAddress, bool bListen );
+void remote_send_record( const char* Title, const char* Artist, const char* Album, const char* Year, const char* FileName, const char* Path, off_t Size, time_t MTime, const char* Art, const char* Alias );
+void escape_field( FILE* out, const char* str );
+int  split_fields( char* line, char* fields[], int max );
+LINECODE worker_line( WORKER* w, char* line );
+void worker_record( char* line );
+void worker_commit( WORKER* w );
+void worker_assign( WORKER* w, const char* pRelPath, bool bRecurse );
+void worker_drop( WORKER* w );
+RETURNCODE serve_loop();
+CATALOG* catalog_load();
+void catalog_row( char** cols );
+void catalog_append( CATALOG* cat, const char* str, size_t len );
+void catalog_release( CATALOG* cat );
+int  catalog_order( const void* a, const void* b );
+int  key_compare( const char* a, size_t alen, const char* b, size_t blen );
+void table_version( char* szVersion );
+void table_version_row( char** cols );
+bool serve_input( CLIENT* c );
+bool serve_pending( CLIENT* c );
+void serve_request( CLIENT* c, char* req );
+void serve_error( CLIENT* c, const char* msg );
+bool serve_flush( CLIENT* c );
+void serve_drop( CLIENT* c );
+RETURNCODE diff_catalogs();
+RETURNCODE sorter_load( SORTER* s, const char* pFile );
+bool sorter_spill( SORTER* s );
+const char* sorter_next( SORTER* s );
+void sorter_push( SORTER* s, int run );
+int  sorter_pop( SORTER* s );
+void sorter_free( SORTER* s );
+bool run_next( RUN* r );
+size_t row_escape( char* dst, const char* str );
+int  row_compare( const char* a, const char* b );
+int  row_order( const void* a, const void* b );
+void diff_record( const char* Op, char* pRow );
 
 /*
  * Procedures
@@ -231,9 +626,9 @@ int main( int argc, const char* argv[] ){
 	pProgramName = argv[0];
 	bNoSpaceAvailable = FALSE;
 	Mp3Counter = 0;
-	strcpy( szRelativePath, "" );								// initialize the relative path string
 	int mysql_check=0;
 	int sqlite_check=0;
+	int i;
 
 #ifndef __MYSQL
     mysql_check=1;
@@ -243,17 +638,46 @@ int main( int argc, const char* argv[] ){
     sqlite_check=1;
 #endif
 
-if(mysql_check && sqlite_check){
-	print_message( ERROR, "Program compiled without DB support. Unable to continue.\n");
-	exit( 0 );
-}
-
 	init();														// init all global variables
 	
 	if( ( ret = check_flag( argc, argv ) ) != PARAM_OK )
 		print_error( ret );										// output the right message for the error code 
 
-	if( !bNoSpaceAvailable ){
+if(mysql_check && sqlite_check && UseDB != USE_FILE && UseDB != USE_REMOTE && !bSizeOnly){	// --output, workers and --size-only need no DB
+	print_message( ERROR, "Program compiled without DB support. Unable to continue.\n");
+	exit( 0 );
+}
+
+	if( UseDB == USE_FILE && pOutFile == NULL ){				// records on stdout, the messages go to stderr
+		Out.fd = dup( STDOUT_FILENO );
+		dup2( STDERR_FILENO, STDOUT_FILENO );
+	}
+
+	if( bSizeOnly ){											// no tags and no DB, the sizes of the files only
+
+		if( ( ret = roots_open() ) != PARAM_OK )
+			print_error( ret );
+
+		VERBOSE_LOG( "Starting size scan\n" );
+
+		if( ( ret = scan_roots() ) != END_LOOP )
+			print_error( ret );
+
+		VERBOSE_LOG1( "Size scan terminated, found %d file(s)\n", Mp3Counter );
+
+		print_stats();
+
+		if( Mp3Counter > 0 ){
+
+			size_count( -1 );										// Print Total files size
+			print_top();
+
+		} else {
+
+			print_message( ERROR, "No MP3 file found\n" );
+		}
+
+	} else if( !bNoSpaceAvailable ){
 	
 		getcwd( szCurrentPath, PATH_MAX );						// save current path
 		
@@ -264,51 +688,110 @@ if(mysql_check && sqlite_check){
 
 		VERBOSE_LOG( "DB connection succeded\n" );
 
-		if( bCreateTab ){
-			
-			VERBOSE_LOG( "Creating new table into DB\n" );
-			create_table();
-			VERBOSE_LOG( "Table creation succeded\n" );
-		}
+		if( bServe ){												// query server of the table
 
-		VERBOSE_LOG1( "Changing to %s\n", pPath );
+			VERBOSE_LOG( "Starting catalog server\n" );
 
-		if( chdir( pPath ) != 0 )								// change to pPath
-			print_error( CHDIR_ERROR );
+			if( ( ret = serve_loop() ) != END_LOOP )
+				print_error( ret );
 
-		VERBOSE_LOG( "Changed directory\n" );
-		VERBOSE_LOG( "Start files counting\n" );
+			VERBOSE_LOG( "Catalog server terminated\n" );
 
-		if( ( ret = mp3_scan_loop( TRUE ) ) != END_LOOP )		// scan only loop
-			print_error( ret );
+		} else if( bDiff ){										// changes between two catalogs
 
-		if( Mp3Counter > 0 ){
+			VERBOSE_LOG( "Sorting the catalogs\n" );
 
-			VERBOSE_LOG1( "Found %d file(s)\n", Mp3Counter );
-			VERBOSE_LOG( "Starting files scan\n" );
-			
-			if(  ( ret = mp3_scan_loop( FALSE ) ) != END_LOOP )	// mp3 scan loop
+			if( ( ret = diff_catalogs() ) != END_LOOP )
 				print_error( ret );
-		
-			VERBOSE_LOG( "Files scan terminated\n" );
-			
-			if( bFsInfo )
-				size_count( -1 );								// Print Total files size
-			
+
+			VERBOSE_LOG( "Catalog diff terminated\n" );
+
+		} else if( UseDB == USE_REMOTE ){							// worker of a distributed scan
+
+			VERBOSE_LOG( "Starting worker loop\n" );
+
+			if( ( ret = worker_loop() ) != END_LOOP )
+				print_error( ret );
+
+			VERBOSE_LOG( "Worker loop terminated\n" );
+
+			print_stats();
+
 		} else {
-			
-			print_message( ERROR, "No MP3 file found\n" );
+
+			if( bCreateTab ){
+
+				VERBOSE_LOG( "Creating new table into DB\n" );
+				create_table();
+				VERBOSE_LOG( "Table creation succeded\n" );
+			}
+
+			if( bBulk ){
+
+				VERBOSE_LOG( "Staging the rows in memory\n" );
+				bulk_begin();
+			}
+
+			if( ( ret = roots_open() ) != PARAM_OK )				// absolute library roots, grouped by disk
+				print_error( ret );
+
+			snprintf( szRoot, PATH_MAX, "%s", Roots[0].szPath );	// the only one of a distributed scan
+
+			if( Workers > 0 || pListen != NULL ){					// distributed scan, workers do the tag reading
+
+				VERBOSE_LOG( "Starting distributed scan\n" );
+
+				if( ( ret = coordinator_loop() ) != END_LOOP )
+					print_error( ret );
+
+				VERBOSE_LOG( "Distributed scan terminated\n" );
+
+			} else {
+
+				if( bUpdate ){
+
+					VERBOSE_LOG( "Loading the previous scan\n" );
+					load_index();
+				}
+
+				VERBOSE_LOG( "Starting files scan\n" );
+
+				if(  ( ret = scan_roots() ) != END_LOOP )			// mp3 scan loop
+					print_error( ret );
+
+				VERBOSE_LOG1( "Files scan terminated, found %d file(s)\n", Mp3Counter );
+
+				print_stats();
+
+				for( i = 0; i < nRoots; i++ )
+					if( Roots[i].pIndex != NULL )
+						mp3scan_index_free( Roots[i].pIndex );
+			}
+
+			if( bBulk ){
+
+				VERBOSE_LOG( "Writing the staged rows into the table\n" );
+				bulk_commit();
+				VERBOSE_LOG( "Bulk load succeded\n" );
+			}
+
+			if( Mp3Counter > 0 ){
+
+				if( bFsInfo )
+					size_count( -1 );								// Print Total files size
+
+			} else {
+
+				print_message( ERROR, "No MP3 file found\n" );
+			}
 		}
-		
+
 		VERBOSE_LOG( "Closing DB connection\n" );
 		
 		if( ( ret = CloseDBConnection() ) != DBCLOSED )			// close DB connection
 			print_error( ret );
 		
 		VERBOSE_LOG( "DB connection closed\n" );
-		VERBOSE_LOG1( "Changing back to %s\n", szCurrentPath );
-			
-		chdir( szCurrentPath );									// change to initial path
 
 	} else {
 		
@@ -336,447 +819,2927 @@ void init(){
 	bUseSpaceChar = FALSE;
 	bInteractive = FALSE;
 	TagVersion = 0;
+	bStats = FALSE;
+	Deadline = 0;
+	Jobs = 0;
+	Workers = 0;
+	pListen = NULL;
+	pCoordinator = NULL;
+	pArtDir = NULL;
+	pOutFile = NULL;
+	OutFormat = OUT_NDJSON;
+	RotateSize = 0;
+	Out.fd = -1;
+	pRemoteOut = NULL;
+	bUpdate = FALSE;
+	bTrustDirMtime = FALSE;
+	bOneFileSystem = FALSE;
+	bDedupFiles = FALSE;
+	bNoCache = FALSE;
+	bBulk = FALSE;
+	bDiff = FALSE;
+	bSizeOnly = FALSE;
+	pTop = NULL;
+	nTop = 0;
+	TopDirs = 0;
+	pDiffOld = NULL;
+	pDiffNew = NULL;
+	DiffMemory = DIFF_MEMORY * 1048576LL;
+	CachedStart = page_cache_kb();
+	ReadOrder = MP3SCAN_ORDER_READDIR;
+	pFilter = NULL;
+	pRules = NULL;
+	nRules = 0;
+	bServe = FALSE;
+	pSocket = NULL;
+	pCatalog = NULL;
+	pLoading = NULL;
+	Roots = NULL;
+	nRoots = 0;
+	Devices = NULL;
+	nDevices = 0;
+	DevicesDone = 0;
 }
 
-// main scan loop
-RETURNCODE mp3_scan_loop( bool bScanOnly ){
+// Scan options from the command line
+void scan_options( MP3SCAN_OPTIONS* opt ){
+
+	mp3scan_default_options( opt );
+
+	opt->recursive       = bRecursive;
+	opt->relpath         = bRelPath;
+	opt->tagversion      = TagVersion;
+	opt->filename_format = bUseFileName ? pFileNameFormat : NULL;
+	opt->spacechar       = bUseSpaceChar ? pSpaceChar : NULL;
+	opt->deadline        = Deadline;
+	opt->trust_dir_mtime = bTrustDirMtime;
+	opt->art_dir         = pArtDir;
+	opt->read_order      = ReadOrder;
+	opt->filter          = pFilter;
+	opt->ignore_marker   = IGNORE_MARKER;
+	opt->one_file_system = bOneFileSystem;
+	opt->dedup_files     = bDedupFiles;
+	opt->jobs            = Jobs;
+	opt->no_cache_pollution = bNoCache;
+	opt->choose          = bInteractive ? chose_field : NULL;
+	opt->message         = scan_message;
+}
 
-	DIR	*dir;
-	struct dirent *file;
-	struct stat finfo;
 
-	if( (dir = opendir(".")) == NULL )
-		return OPENDIR_ERROR;
-	
-	while( ( file = readdir( dir ) ) != NULL ){
+// Add an --exclude (sign '-') or --include ('+') rule
+// Return FALSE if the pattern is not valid
+bool add_rule( char sign, const char* pPattern ){
 
-		if( strcmp( ".", file->d_name ) != 0 && strcmp( "..", file->d_name ) != 0 ){
+	if( pFilter == NULL )
+		pFilter = mp3scan_filter_new();
 
-			stat( file->d_name, &finfo );						// get file info and check the type
+	if( !mp3scan_filter_add( pFilter, pPattern, sign == '+' ) )
+		return FALSE;
 
-			if( finfo.st_mode & S_IFREG ){						// is a file
+	pRules = (char**)realloc( pRules, ( nRules + 1 ) * sizeof(char*) );
+	pRules[nRules] = (char*)malloc( strlen( pPattern ) + 2 );
+	sprintf( pRules[nRules++], "%c%s", sign, pPattern );
+	return TRUE;
+}
 
-				if( is_mp3_file( file->d_name ) ){				// if it's a MP3 file
-					if( bScanOnly )
-						Mp3Counter++;
-					else
-						get_id3_tag( file->d_name, finfo.st_size );
-				}
-			
-			} else if( finfo.st_mode & S_IFDIR ){				// is a directory
 
-				if( bRecursive ){
-					chdir( file->d_name );
-					strcat( szRelativePath, file->d_name );		// append directory name
-					strcat( szRelativePath, "/" );				// and a '/'
+// A filter of its own with the --exclude and --include rules, NULL if none
+MP3SCAN_FILTER* rules_filter(){
 
-					mp3_scan_loop( bScanOnly );
-																// remove directory name
-					szRelativePath[(strlen(szRelativePath) - strlen(file->d_name)) - 1] = '\0';
-					chdir("..");
-				}
-			}
-		} 														// .. and . check
-	} 															// while loop end
-	
-	closedir( dir );											// close the dir handle
-	
-	return END_LOOP;
+	MP3SCAN_FILTER *f;
+	int i;
+
+	if( nRules == 0 )
+		return NULL;
+
+	f = mp3scan_filter_new();
+	for( i = 0; i < nRules; i++ )
+		mp3scan_filter_add( f, pRules[i] + 1, pRules[i][0] == '+' );	// checked by add_rule
+	return f;
 }
 
-// Check if the file is an MP3 file - based on file extension
-bool is_mp3_file( char* pFileName ){
 
-	char *ptr = rindex( pFileName, '.' );
-		
-	if(  ptr != NULL &&
-		(strcmp( ptr, ".MP3" ) == 0 || strcmp( ptr, ".mp3" ) == 0 ||
-		 strcmp( ptr, ".Mp3" ) == 0 || strcmp( ptr, ".mP3" ) == 0 ) )
-		return TRUE;
+// Scan the directory pRel, relative to the library root
+RETURNCODE mp3_scan_path( const char* pRel ){
 
-	return FALSE;
+	MP3SCAN_OPTIONS opt;
+
+	scan_options( &opt );
+	opt.subdir = pRel;
+
+	return scan_result( mp3scan_scan( szRoot, &opt, scan_record, NULL, &Stats ) );
 }
 
 
-// get the ID3tag from the file
-void get_id3_tag( const char* pFileName, off_t size ){
+// Return code of a scan
+RETURNCODE scan_result( MP3SCAN_RESULT res ){
 
-	static char szTitle[31]      = {'\0'};
-	static char szArtist[31]     = {'\0'};
-	static char szAlbum[31]      = {'\0'};
-	static char szYear[5]        = {'\0'};
-	static char szPath[PATH_MAX] = {'\0'};
+	switch( res ){
+		case MP3SCAN_BAD_FORMAT:	return BAD_FORMAT;
+		case MP3SCAN_ART_DIR_ERROR:	return ART_PARAM_ERROR;
+		case MP3SCAN_OPENDIR_ERROR:	return OPENDIR_ERROR;
+		default:					return END_LOOP;
+	}
+}
 
-	if( bRelPath )
-		strcpy( szPath, szRelativePath );
-	else
-		getcwd( szPath, PATH_MAX );
-			
-	if( bFsInfo )													// Save file size
-		size_count( size );
 
-	get_tags( pFileName, szTitle, szArtist, szAlbum, szYear );		// Try to get all tags
+// Resolve the roots and group them by disk. A root already scanned as part
+// of another one (the same directory, or below it with --recursive) is skipped
+RETURNCODE roots_open(){
 
-	if( szTitle[0] == '\0' && szArtist[0] == '\0' && szAlbum[0] == '\0' && szYear[0] == '\0' ){
-		
-		if( bUseFileName ){											// Use file name to get song infos			
-			filename_to_field( pFileName, szTitle, szArtist, szAlbum, szYear );
-				
-		} else {													// print a warning message and return
-			if( bVerbose )
-				print_message( WARNING, "%s has no id3 Tag\n", pFileName );
+	struct stat info;
+	int i, j, n;
+
+	if( nRoots == 0 )
+		return CHDIR_ERROR;
+
+	for( i = 0, n = 0; i < nRoots; i++ ){
+
+		if( realpath( Roots[i].pArg, Roots[i].szPath ) == NULL || stat( Roots[i].szPath, &info ) != 0 ){
+			pError = Roots[i].pArg;
+			return CHDIR_ERROR;
+		}
+		Roots[i].dev = root_disk( info.st_dev );
+
+		for( j = 0; j < n && !root_inside( Roots[i].szPath, Roots[j].szPath ); j++ )
+			;
+		if( j < n ){
+			print_message( WARNING, "%s skipped, already scanned as part of %s\n", Roots[i].pArg, Roots[j].szPath );
+			continue;
 		}
+
+		for( j = 0; j < n; ){										// roots given before, below this one
+			if( root_inside( Roots[j].szPath, Roots[i].szPath ) ){
+				print_message( WARNING, "%s skipped, already scanned as part of %s\n", Roots[j].pArg, Roots[i].szPath );
+				memmove( &Roots[j], &Roots[j + 1], ( --n - j ) * sizeof(ROOT) );
+			} else {
+				j++;
+			}
+		}
+
+		if( i != n )
+			memcpy( &Roots[n], &Roots[i], sizeof(ROOT) );
+		n++;
+	}
+	nRoots = n;
+
+	for( i = 0; i < nRoots; i++ ){
+
+		for( j = 0; j < nDevices && Devices[j].dev != Roots[i].dev; j++ )
+			;
+		if( j == nDevices ){
+			Devices = (DEVICE*)realloc( Devices, ( nDevices + 1 ) * sizeof(DEVICE) );
+			Devices[nDevices++].dev = Roots[i].dev;
+		}
+		Roots[i].device = j;
+
+		VERBOSE_LOG1( "Library root is %s\n", Roots[i].szPath );
 	}
 
-	sql_insert( szTitle, szArtist, szAlbum, szYear, pFileName, szPath, size );
+	if( nDevices > 1 )
+		VERBOSE_LOG1( "%d disks scanned in parallel\n", nDevices );
+
+	return PARAM_OK;
 }
 
 
-// Gets all necessary field from the mp3 file
-void get_tags( const char *filename, char *title, char *artist, char *album, char *year ){
+// Return TRUE if pPath is scanned by a scan of pRoot
+bool root_inside( const char* pPath, const char* pRoot ){
+
+	size_t len = strlen( pRoot );
+
+	if( !strcmp( pPath, pRoot ) )
+		return TRUE;
+
+	return bRecursive && !strncmp( pPath, pRoot, len ) && ( pPath[len] == '/' || pRoot[len - 1] == '/' );
+}
 
-	ID3_Tag Version1;														// Create ID3v1 and ID3v2 object
-	ID3_Tag Version2;
-	ID3_Frame *Frame1;
-	ID3_Frame *Frame2;
 
-	/* empty each buffer */
-	title[0]  = '\0';
-	artist[0] = '\0';
-	album[0]  = '\0';
-	year[0]   = '\0';
+// Disk holding the file system dev: the partitions of a disk share its I/O.
+// Other file systems (network, tmpfs) are a device of their own
+dev_t root_disk( dev_t dev ){
 
-	char TmpBuffer[31] = {'\0'};
+#ifdef __linux__
+	char szFile[64];
+	unsigned int maj, min;
+	FILE *f;
 
-	Version1.Link( filename, ID3TT_ID3V1 );									// Read ID3 info from input file
-	Version2.Link( filename, ID3TT_ID3V2 );
+	snprintf( szFile, sizeof(szFile), "/sys/dev/block/%u:%u/partition", major( dev ), minor( dev ) );
+	if( access( szFile, F_OK ) != 0 )
+		return dev;
 
-	if( TagVersion & ID3v1 ){												// Get the track title from ID3v1
-		Frame1 = Version1.Find( ID3FID_TITLE );
-		if( Frame1 != NULL )
-			Frame1->Field( ID3FN_TEXT ).Get( title, 31 );	
+	snprintf( szFile, sizeof(szFile), "/sys/dev/block/%u:%u/../dev", major( dev ), minor( dev ) );
+	if( ( f = fopen( szFile, "r" ) ) != NULL ){
+		if( fscanf( f, "%u:%u", &maj, &min ) == 2 )
+			dev = makedev( maj, min );
+		fclose( f );
 	}
+#endif
+
+	return dev;
+}
+
 
-	if( TagVersion & ID3v2 ){												// Get the track title from ID3v2
-		Frame2 = Version2.Find( ID3FID_TITLE );
-		if( Frame2 != NULL )
-			Frame2->Field( ID3FN_TEXT ).Get( TmpBuffer, 31 );
+// Scan the roots, a thread per disk. Return an error only if no root could be scanned
+RETURNCODE scan_roots(){
+
+	struct timespec ts;
+	RETURNCODE ret = END_LOOP;
+	int i, failed = 0;
+	char buff[PATH_MAX + 64];
+
+	for( i = 0; i < nDevices; i++ ){
+		Devices[i].pFilter = rules_filter();
+		if( pthread_create( &Devices[i].thread, NULL, scan_device, &Devices[i] ) != 0 ){
+			Devices[i].thread = pthread_self();						// no thread, scanned here
+			scan_device( &Devices[i] );
+		}
 	}
-	
-	CHECKBUFFERS( title, TmpBuffer, filename, 0 );							// Check the title
 
-	if( TagVersion & ID3v1 ){												// Get the artist title from ID3v1
-		Frame1 = Version1.Find( ID3FID_LEADARTIST );
-		if( Frame1 != NULL )
-			Frame1->Field( ID3FN_TEXT ).Get( artist, 31 );
+	pthread_mutex_lock( &RecordLock );
+	while( DevicesDone < nDevices ){
+		clock_gettime( CLOCK_REALTIME, &ts );
+		ts.tv_sec += PROGRESS_INTERVAL;
+		if( pthread_cond_timedwait( &DeviceDone, &RecordLock, &ts ) == ETIMEDOUT && bVerbose )
+			roots_progress();
 	}
-	
-	if( TagVersion & ID3v2 ){												// Get the artist title from ID3v2
-		Frame2 = Version2.Find( ID3FID_LEADARTIST );
-		if( Frame2 != NULL )
-			Frame2->Field( ID3FN_TEXT ).Get( TmpBuffer, 31 );
+	pthread_mutex_unlock( &RecordLock );
+
+	for( i = 0; i < nDevices; i++ ){
+		if( !pthread_equal( Devices[i].thread, pthread_self() ) )
+			pthread_join( Devices[i].thread, NULL );
+		if( Devices[i].pFilter != NULL )
+			mp3scan_filter_free( Devices[i].pFilter );
 	}
 
-	CHECKBUFFERS( artist, TmpBuffer, filename, 1 );							// Check the artist
+	for( i = 0; i < nRoots; i++ ){
 
-	if( TagVersion & ID3v1 ){												// Get the album title from ID3v1
-		Frame1 = Version1.Find( ID3FID_ALBUM );
-		if( Frame1 != NULL )
-			Frame1->Field( ID3FN_TEXT ).Get( album, 31 );
+		mp3scan_stats_add( &Stats, &Roots[i].stats );
+
+		if( Roots[i].ret != END_LOOP ){
+			ret = Roots[i].ret;
+			failed++;
+			if( nRoots > 1 ){
+				snprintf( buff, sizeof(buff), "%s not scanned, unable to open the directory\n", Roots[i].szPath );
+				print_message( WARNING, "%s", buff );
+			}
+		}
 	}
 
-	if( TagVersion & ID3v2 ){												// Get the album title from ID3v2
-		Frame2 = Version2.Find( ID3FID_ALBUM );
-		if( Frame2 != NULL )
-			Frame2->Field( ID3FN_TEXT ).Get( TmpBuffer, 31 );
+	return failed == nRoots ? ret : END_LOOP;
+}
+
+
+// Thread of a disk: scan its roots one after the other
+void* scan_device( void* arg ){
+
+	DEVICE *d = (DEVICE*)arg;
+	ROOT *prev = NULL;
+	int i;
+
+	for( i = 0; i < nRoots; i++ ){
+
+		if( &Devices[Roots[i].device] != d )
+			continue;
+
+		if( prev != NULL )											// --jobs auto goes on from the level found on the disk
+			Roots[i].stats.jobs_level = prev->stats.jobs_level;
+
+		scan_root( &Roots[i] );
+		prev = &Roots[i];
 	}
-	
-	CHECKBUFFERS( album, TmpBuffer, filename, 2 );							// Check the album
 
-	if( TagVersion & ID3v1 ){												// Get the year from ID3v1
-		Frame1 = Version1.Find( ID3FID_YEAR );
-		if( Frame1 != NULL )
-			Frame1->Field( ID3FN_TEXT ).Get( year, 5 );
+	pthread_mutex_lock( &RecordLock );
+	DevicesDone++;
+	pthread_cond_signal( &DeviceDone );
+	pthread_mutex_unlock( &RecordLock );
+
+	return NULL;
+}
+
+
+// Scan a root into the table
+void scan_root( ROOT* r ){
+
+	MP3SCAN_OPTIONS opt;
+	char buff[PATH_MAX + 64];
+
+	scan_options( &opt );
+	opt.previous = r->pIndex;
+	opt.filter   = Devices[r->device].pFilter;
+
+	pthread_mutex_lock( &RecordLock );
+	r->start = monotonic_usec();
+	pthread_mutex_unlock( &RecordLock );
+
+	if( bSizeOnly )
+		r->ret = scan_result( mp3scan_sizes( r->szPath, &opt, size_record, r, &r->stats ) );
+	else
+		r->ret = scan_result( mp3scan_scan( r->szPath, &opt, scan_record, r, &r->stats ) );
+
+	pthread_mutex_lock( &RecordLock );
+	r->stop = monotonic_usec();
+	pthread_mutex_unlock( &RecordLock );
+
+	if( bVerbose && nRoots > 1 ){
+		snprintf( buff, sizeof(buff), "%s scanned: %lld file(s) in %.3f s\n", r->szPath, r->files, ( r->stop - r->start ) / 1000000.0 );
+		print_message( STATUS, "%s", buff );
 	}
+}
+
 
-	if( TagVersion & ID3v1 ){												// Get the year from ID3v1
-		Frame2 = Version2.Find( ID3FID_YEAR );	
-		if( Frame2 != NULL )
-			Frame2->Field( ID3FN_TEXT ).Get( TmpBuffer, 5 );
+// Count a file found in a root
+void root_count( ROOT* r, off_t Size ){
+
+	if( r != NULL ){
+		r->files++;
+		r->bytes += Size;
 	}
-	
-	CHECKBUFFERS( year, TmpBuffer, filename, 3 );							// Check the year
 }
 
 
-// query infos into db
-void sql_insert( const char* Title, const char* Artist, const char* Album, const char* Year, const char* FileName, const char* Path, off_t Size ){
+// Print the progress of the roots being scanned, called with RecordLock held
+void roots_progress(){
 
-#ifdef __MYSQL
-    #ifndef szQuery
-	    static char szQuery[1024] = {'\0'};
-	#endif
-#endif
+	char buff[PATH_MAX + 128];
+	long long now = monotonic_usec();
+	double sec;
+	int i;
 
-#ifdef __SQLITE
-    #ifndef szQuery
-	    static char szQuery[1024] = {'\0'};
-	#endif
-#endif
+	for( i = 0; i < nRoots; i++ ){
 
-	switch( UseDB ){
-		
-#ifdef __MYSQL	
-	case USE_MYSQL:
-	
-		snprintf( szQuery, 1024, "INSERT INTO %s( artist, title, album, year, filename, path, size ) VALUES ( \"%s\", \"%s\", \"%s\", \'%s\', \"%s\", \"%s\", \"%d\" )", pTabname, Artist, Title, Album, Year, FileName, Path, (int)Size );
-		
-		if ( mysql_query( DB_handle.mysql_handle, szQuery ) && bVerbose )
-			print_message( WARNING, "%s\n", mysql_error( DB_handle.mysql_handle ) );
-		break;
-#endif		
-		
-#ifdef __SQLITE	
-	case USE_SQLITE:
-	
-		snprintf( szQuery, 1024, "INSERT INTO %s VALUES ( NULL, \"%s\", \"%s\", \"%s\", \'%s\', \"%s\", \"%s\", \"%d\" )", pTabname, Artist, Title, Album, Year, FileName, Path, (int)Size );
-		
-		if( sqlite3_exec( DB_handle.sqlite_handle, szQuery, NULL, NULL, NULL )  != SQLITE_OK && bVerbose )
-			print_message( WARNING, "%s\n", sqlite3_errmsg(DB_handle.sqlite_handle) );
-		break;
-#endif
-	default:
-		print_error( NO_DB_SELECTED );
-		break;
+		if( Roots[i].start == 0 || Roots[i].stop != 0 )
+			continue;
+
+		sec = ( now - Roots[i].start ) / 1000000.0;
+		snprintf( buff, sizeof(buff), "%s: %lld file(s), %.1f MB, %.1f files/s, %.1f MB/s\n", Roots[i].szPath, Roots[i].files,
+				  Roots[i].bytes / 1048576.0, Roots[i].files / sec, Roots[i].bytes / 1048576.0 / sec );
+		print_message( STATUS, "%s", buff );
 	}
 }
 
-// Open a DB Connection
-RETURNCODE OpenDBConnection(){
-	
-	switch( UseDB ){
-		
-#ifdef __MYSQL
-	case USE_MYSQL:
-		DB_handle.mysql_handle = mysql_init( NULL );
-		
-		if( !mysql_real_connect( DB_handle.mysql_handle, pHost, pUser, pPass, pDB, 0, NULL, 0 ) )
-			return DBOPEN_ERROR;
-		break;
-#endif
 
-#ifdef __SQLITE
-	case USE_SQLITE:
-		if( sqlite3_open( pFilename, &DB_handle.sqlite_handle ) != SQLITE_OK )
-			return DBOPEN_ERROR;
-		break;
-#endif
+// Monotonic clock in microseconds
+long long monotonic_usec(){
+
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+// Callback of the scan: store the records found into the DB
+int scan_record( const MP3SCAN_RECORD* rec, void* user ){
+
+	ROOT *r = (ROOT*)user;											// NULL for a worker
+
+	pthread_mutex_lock( &RecordLock );								// the disks are scanned in parallel
+
+	switch( rec->event ){
+
+		case MP3SCAN_FILE:
+			if( rec->replaces )										// changed since the previous scan
+				sql_delete( rec->path, rec->filename );
+			if( bFsInfo )											// Save file size
+				size_count( rec->size );
+			sql_insert( rec->title, rec->artist, rec->album, rec->year, rec->filename, rec->path, rec->size, rec->mtime, rec->art, "" );
+			root_count( r, rec->size );
+			Mp3Counter++;
+			break;
+
+		case MP3SCAN_FILE_ALIAS:									// hard link of a file already stored, its size counted once
+			if( rec->replaces )
+				sql_delete( rec->path, rec->filename );
+			sql_insert( "", "", "", "", rec->filename, rec->path, rec->size, rec->mtime, "", rec->alias );
+			root_count( r, 0 );
+			Mp3Counter++;
+			break;
+
+		case MP3SCAN_FILE_UNCHANGED:
+			if( bFsInfo )
+				size_count( rec->size );
+			root_count( r, rec->size );
+			Mp3Counter++;
+			break;
+
+		case MP3SCAN_FILE_REMOVED:
+			sql_delete( rec->path, rec->filename );
+			break;
+
+		case MP3SCAN_FILE_QUARANTINED:
+			if( rec->replaces )
+				sql_delete( rec->path, rec->filename );
+			if( bFsInfo )
+				size_count( rec->size );
+			root_count( r, rec->size );
+			Mp3Counter++;
+
+			if( UseDB == USE_REMOTE ){								// let the coordinator know
+				fputs( "WARN\tquarantined, no record inserted: ", pRemoteOut );
+				escape_field( pRemoteOut, rec->file );
+				fputc( '\n', pRemoteOut );
+			} else {
+				print_message( WARNING, "Quarantined, no record inserted: %s\n", rec->file );
+			}
+			break;
+
+		case MP3SCAN_DIR:
+			dir_store( rec->relpath, rec->path, rec->dir_mtime, rec->dir_entries, rec->dir_subdirs );
+			break;
+
+		case MP3SCAN_DIR_REMOVED:
+			sql_delete( rec->path, NULL );
+			dir_delete( rec->path );
+			break;
+	}
+
+	pthread_mutex_unlock( &RecordLock );
+
+	return 0;
+}
+
+
+// Callback of the size scan: add up the mp3 files of a directory
+int size_record( const MP3SCAN_DIRSIZE* dir, void* user ){
+
+	ROOT *r = (ROOT*)user;
+
+	pthread_mutex_lock( &RecordLock );								// the disks are scanned in parallel
+
+	size_count( dir->bytes );
+	r->files += dir->files;
+	r->bytes += dir->bytes;
+	Mp3Counter += dir->files;
+
+	if( TopDirs > 0 )
+		top_add( r, dir );
+
+	pthread_mutex_unlock( &RecordLock );
+
+	return 0;
+}
+
+
+// Keep the directory if it is among the TopDirs largest ones found so far
+void top_add( ROOT* r, const MP3SCAN_DIRSIZE* dir ){
+
+	size_t len = strlen( dir->relpath );
+	int i;
+
+	if( nTop == TopDirs && dir->bytes <= pTop[nTop - 1].bytes )
+		return;
+
+	if( nTop < TopDirs )
+		pTop = (TOPDIR*)realloc( pTop, ++nTop * sizeof(TOPDIR) );
+	else
+		free( pTop[nTop - 1].pPath );								// the smallest one makes room
+
+	for( i = nTop - 1; i > 0 && pTop[i - 1].bytes < dir->bytes; i-- )
+		pTop[i] = pTop[i - 1];
+
+	pTop[i].pPath = (char*)malloc( strlen( r->szPath ) + len + 2 );	// as record_path, sized to fit
+	if( len == 0 )
+		strcpy( pTop[i].pPath, r->szPath );
+	else
+		sprintf( pTop[i].pPath, "%s/%.*s", r->szPath, (int)len - 1, dir->relpath );
+	pTop[i].files = dir->files;
+	pTop[i].bytes = dir->bytes;
+}
+
+
+// Print the --top report, largest directory first
+void print_top(){
+
+	char buff[64], szSize[32];
+	int i;
+
+	if( nTop == 0 )
+		return;
+
+	print_message( STATUS, "Largest directories (their own mp3 files):\n" );
+	for( i = 0; i < nTop; i++ ){
+		size_text( pTop[i].bytes, szSize, sizeof(szSize) );
+		snprintf( buff, sizeof(buff), "  %10s  %8lld file(s)  ", szSize, pTop[i].files );
+		print_message( STATUS, "%s%s\n", buff, pTop[i].pPath );	// the path is not limited to PATH_MAX
+		free( pTop[i].pPath );
+	}
+
+	free( pTop );
+	pTop = NULL;
+	nTop = 0;
+}
+
+
+// Messages of the scan, the verbose ones only with --verbose
+void scan_message( MP3SCAN_MSGLEVEL level, const char* msg, void* user ){
+
+	if( level == MP3SCAN_MSG_WARNING || bVerbose )
+		print_message( WARNING, "%s\n", msg );
+}
+
+
+// Build the path stored into the DB for a directory relative to the library root:
+// the relative path itself with --relativepath, otherwise the absolute path without trailing '/'
+// Return FALSE if it doesn't fit in PATH_MAX
+bool record_path( const char* pRel, char* szPath ){
+
+	int n;
+
+	if( bRelPath )
+		n = snprintf( szPath, PATH_MAX, "%s", pRel );
+	else if( pRel[0] == '\0' )
+		n = snprintf( szPath, PATH_MAX, "%s", szRoot );
+	else
+		n = snprintf( szPath, PATH_MAX, "%s/%.*s", szRoot, (int)strlen( pRel ) - 1, pRel );
+
+	return n < PATH_MAX;
+}
+
+
+// Row callbacks of load_index, the index of every root keeps the rows below it
+void load_dir_row( char** cols ){
+
+	int i;
+
+	for( i = 0; i < nRoots; i++ )
+		mp3scan_index_add_dir( Roots[i].pIndex, cols[0], cols[1] ? atoll( cols[1] ) : -1, cols[2] ? atoi( cols[2] ) : 0, cols[3] ? atoi( cols[3] ) : -1 );
+}
+
+void load_file_row( char** cols ){
+
+	int i;
+
+	for( i = 0; i < nRoots; i++ )
+		mp3scan_index_add_file( Roots[i].pIndex, cols[0], cols[1], cols[2] ? atoll( cols[2] ) : -1, cols[3] ? atoll( cols[3] ) : -1 );
+}
+
+
+// Load the directories and files stored by the previous scan, used by --update
+void load_index(){
+
+	static char szQuery[512];
+	size_t dirs = 0;
+	int i;
+
+	for( i = 0; i < nRoots; i++ )
+		Roots[i].pIndex = mp3scan_index_new( Roots[i].szPath, bRelPath );
+
+	snprintf( szQuery, sizeof(szQuery), "SELECT path, mtime, entries, subdirs FROM %s_dirs", pTabname );
+	sql_select( szQuery, load_dir_row );
+
+	snprintf( szQuery, sizeof(szQuery), "SELECT path, filename, size, mtime FROM %s", pTabname );
+	sql_select( szQuery, load_file_row );
+
+	for( i = 0; i < nRoots; i++ )
+		dirs += mp3scan_index_dirs( Roots[i].pIndex );
+
+	VERBOSE_LOG1( "%d known directories\n", (int)dirs );
+}
+
+
+// Print the end-of-run summary
+void print_stats(){
+
+	char buff[PATH_MAX + 64];
+	const double pct[] = { 0.50, 0.90, 0.99 };
+	const char *pctname[] = { "p50", "p90", "p99" };
+	long long seen, cached;
+	long page = sysconf( _SC_PAGESIZE );
+	int i, b;
+
+	if( !bStats )
+		return;
+
+	for( i = 0; i < nRoots && nRoots > 1; i++ ){					// the roots are scanned in parallel by disk
+		double sec = ( Roots[i].stop - Roots[i].start ) / 1000000.0;
+		snprintf( buff, sizeof(buff), "(disk %u:%u): %lld files, %.1f MB in %.3f s, %.1f files/s, %.1f MB/s\n",
+				  major( Roots[i].dev ), minor( Roots[i].dev ), Roots[i].files, Roots[i].bytes / 1048576.0, sec,
+				  sec > 0 ? Roots[i].files / sec : 0.0, sec > 0 ? Roots[i].bytes / 1048576.0 / sec : 0.0 );
+		print_message( STATUS, "Root %s %s", Roots[i].szPath, buff );
+	}
+
+	if( !bSizeOnly ){												// nothing is read
+		snprintf( buff, sizeof(buff), "Files read: %lld, quarantined: %lld (recovered on retry: %lld, failed: %lld)\n",
+				  Stats.files_read, Stats.quarantined, Stats.recovered, Stats.quarantined - Stats.recovered );
+		print_message( STATUS, "%s", buff );
+	}
+
+	snprintf( buff, sizeof(buff), "Directories enumerated: %lld, skipped (unchanged mtime): %lld\n", Stats.dirs_enumerated, Stats.dirs_skipped );
+	print_message( STATUS, "%s", buff );
+
+	if( bUpdate ){
+		snprintf( buff, sizeof(buff), "Files unchanged: %lld, changed: %lld, added: %lld, removed: %lld\n",
+				  Stats.files_unchanged, Stats.files_changed, Stats.files_added, Stats.files_removed );
+		print_message( STATUS, "%s", buff );
+	}
+
+	if( Stats.dirs_excluded > 0 || Stats.files_excluded > 0 ){
+		snprintf( buff, sizeof(buff), "Excluded: %lld directories (not opened), %lld files\n", Stats.dirs_excluded, Stats.files_excluded );
+		print_message( STATUS, "%s", buff );
+	}
+
+	if( Stats.dirs_revisited > 0 || Stats.dirs_other_fs > 0 ){
+		snprintf( buff, sizeof(buff), "Directories already scanned (symlink loops, bind mounts): %lld, on other file systems: %lld\n", Stats.dirs_revisited, Stats.dirs_other_fs );
+		print_message( STATUS, "%s", buff );
+	}
+
+	if( bDedupFiles ){
+		snprintf( buff, sizeof(buff), bSizeOnly ? "Hard links counted once: %lld\n" : "Hard links stored as aliases: %lld\n", Stats.files_aliased );
+		print_message( STATUS, "%s", buff );
+	}
+
+	if( pArtDir != NULL ){
+		snprintf( buff, sizeof(buff), "Cover art stored: %lld, shared with files already stored: %lld\n", Stats.art_stored, Stats.art_shared );
+		print_message( STATUS, "%s", buff );
+	}
+
+	if( Stats.files_read == 0 )
+		return;
+
+	snprintf( buff, sizeof(buff), "Tag read time: %.3f s, %.1f files/s%s\n", Stats.read_usec / 1000000.0,
+			  Stats.read_usec > 0 ? Stats.files_read * 1000000.0 / Stats.read_usec : 0.0,
+			  Jobs > 1 || Jobs == MP3SCAN_JOBS_AUTO ? " (summed over the parallel reads)" : "" );
+	print_message( STATUS, "%s", buff );
+
+	if( Jobs == MP3SCAN_JOBS_AUTO ){
+		snprintf( buff, sizeof(buff), "Parallel reads: %d (auto, peak %d, %lld changes)\n", Stats.jobs_level, Stats.jobs_peak, Stats.jobs_changes );
+		print_message( STATUS, "%s", buff );
+	} else if( Jobs > 1 ){
+		snprintf( buff, sizeof(buff), "Parallel reads: %d\n", Jobs );
+		print_message( STATUS, "%s", buff );
+	}
+
+	if( ReadOrder != MP3SCAN_ORDER_READDIR ){
+		snprintf( buff, sizeof(buff), "Disk order: %lld files by physical offset, %lld by inode, mapped in %.3f s\n",
+				  Stats.order_offset, Stats.order_inode, Stats.order_usec / 1000000.0 );
+		print_message( STATUS, "%s", buff );
+	}
+
+	if( bNoCache ){
+		snprintf( buff, sizeof(buff), "Page cache: %.1f MB brought in by the reads and dropped, %.1f MB could not be dropped\n",
+				  ( Stats.cache_pages - Stats.cache_kept ) * page / 1048576.0, Stats.cache_kept * page / 1048576.0 );
+		print_message( STATUS, "%s", buff );
+	}
+
+	if( CachedStart >= 0 && ( cached = page_cache_kb() ) >= 0 ){	// whatever else ran meanwhile, too
+		snprintf( buff, sizeof(buff), "Page cache growth: %+.1f MB (system wide, during the run)\n", ( cached - CachedStart ) / 1024.0 );
+		print_message( STATUS, "%s", buff );
+	}
+
+	for( i = 0; i < 3; i++ ){										// percentiles from the log2 histogram
+		for( b = 0, seen = 0; b < MP3SCAN_LATENCY_BUCKETS; b++ ){
+			seen += Stats.latency[b];
+			if( seen >= pct[i] * Stats.files_read )
+				break;
+		}
+		snprintf( buff, sizeof(buff), "Tag read latency %s: <= %.3f ms\n", pctname[i], ( 1LL << b ) / 1000.0 );
+		print_message( STATUS, "%s", buff );
+	}
+
+	print_message( STATUS, "Slowest files:\n" );
+	for( i = 0; i < Stats.nslowest; i++ ){
+		snprintf( buff, sizeof(buff), "  %10.3f ms  %s\n", Stats.slowest[i].usec / 1000.0, Stats.slowest[i].file );
+		print_message( STATUS, "%s", buff );
+	}
+}
+
+
+// Size of the page cache of the system in KB, -1 if unknown
+long long page_cache_kb(){
+
+	char line[128];
+	long long kb = -1;
+	FILE *f;
+
+	if( ( f = fopen( "/proc/meminfo", "r" ) ) == NULL )
+		return -1;
+
+	while( fgets( line, sizeof(line), f ) != NULL )
+		if( sscanf( line, "Cached: %lld kB", &kb ) == 1 )
+			break;
+
+	fclose( f );
+	return kb;
+}
+
+
+// query infos into db
+void sql_insert( const char* Title, const char* Artist, const char* Album, const char* Year, const char* FileName, const char* Path, off_t Size, time_t MTime, const char* Art, const char* Alias ){
+
+	static char szQuery[8 * PATH_MAX] = {'\0'};
+
+	if( UseDB == USE_REMOTE ){
+		remote_send_record( Title, Artist, Album, Year, FileName, Path, Size, MTime, Art, Alias );
+		return;
+	}
+
+	if( UseDB == USE_FILE ){
+		out_record( Title, Artist, Album, Year, FileName, Path, Size, MTime, Art, Alias );
+		return;
+	}
+
+	sql_row( szQuery, sizeof(szQuery), pTabname, UseDB == USE_MYSQL, Title, Artist, Album, Year, FileName, Path, Size, MTime, Art, Alias );
+	sql_exec( szQuery );
+}
+
+
+// delete the row of a file, or all the rows of a directory if FileName is NULL
+void sql_delete( const char* Path, const char* FileName ){
+
+	static char szQuery[5 * PATH_MAX] = {'\0'};					// two fields of sql_escape (2 * PATH_MAX each) and the statement
+
+	sql_delete_query( szQuery, sizeof(szQuery), Path, FileName );
+	sql_exec( szQuery );
+}
+
+
+// DELETE statement of sql_delete
+void sql_delete_query( char* szQuery, size_t len, const char* Path, const char* FileName ){
+
+	if( FileName != NULL )
+		snprintf( szQuery, len, "DELETE FROM %s WHERE path = '%s' AND filename = '%s'", pTabname, sql_escape( Path, 0 ), sql_escape( FileName, 1 ) );
+	else
+		snprintf( szQuery, len, "DELETE FROM %s WHERE path = '%s'", pTabname, sql_escape( Path, 0 ) );
+}
+
+
+// store the state of a directory of the scan into the directories table,
+// pRel is relative to the library root and pPath is the path stored
+void dir_store( const char* pRel, const char* pPath, long long MTime, int Entries, int Subdirs ){
+
+	static char szQuery[4 * PATH_MAX] = {'\0'};
+
+	if( UseDB == USE_FILE )											// only the files are written
+		return;
+
+	if( UseDB == USE_REMOTE ){										// the coordinator owns the DB
+		fputs( "DIR\t", pRemoteOut );
+		escape_field( pRemoteOut, pRel );
+		fprintf( pRemoteOut, "\t%lld\t%d\t%d\n", MTime, Entries, Subdirs );
+		return;
+	}
+
+	snprintf( szQuery, sizeof(szQuery), "%s INTO %s_dirs( path, mtime, entries, subdirs ) VALUES ( '%s', %lld, %d, %d )",
+			  UseDB == USE_MYSQL ? "REPLACE" : "INSERT OR REPLACE", pTabname, sql_escape( pPath, 0 ), MTime, Entries, Subdirs );
+
+	sql_exec( szQuery );
+}
+
+
+// delete a directory from the directories table
+void dir_delete( const char* Path ){
+
+	static char szQuery[4 * PATH_MAX] = {'\0'};
+
+	snprintf( szQuery, sizeof(szQuery), "DELETE FROM %s_dirs WHERE path = '%s'", pTabname, sql_escape( Path, 0 ) );
+	sql_exec( szQuery );
+}
+
+
+// Open the file of --output, the next chunk with --rotate
+// Return FALSE if the file can't be created
+bool out_open(){
+
+	char szName[PATH_MAX];
+	const char *ext;
+
+	if( pOutFile != NULL ){
+
+		if( RotateSize > 0 ){									// scan.ndjson -> scan.0001.ndjson
+			ext = rindex( pOutFile, '.' );
+			if( ext == NULL || rindex( pOutFile, '/' ) > ext )
+				ext = pOutFile + strlen( pOutFile );
+			snprintf( szName, sizeof(szName), "%.*s.%04d%s", (int)( ext - pOutFile ), pOutFile, Out.nchunk + 1, ext );
+		} else {
+			snprintf( szName, sizeof(szName), "%s", pOutFile );
+		}
+
+		if( ( Out.fd = open( szName, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) ) < 0 )
+			return FALSE;
+
+	} else if( Out.fd < 0 ){
+		return FALSE;
+	}
+
+	Out.nchunk++;
+	Out.chunk = 0;
+
+	if( OutFormat == OUT_CSV )									// every chunk can be loaded on its own
+		out_puts( "path,filename,title,artist,album,year,size,mtime,art,alias\n" );
+
+	return TRUE;
+}
+
+
+// Write the buffer of --output
+void out_flush(){
+
+	out_write( Out.buf, Out.len );
+	Out.len = 0;
+}
+
+
+// Write len bytes to the file of --output, retrying the short writes
+void out_write( const char* p, size_t len ){
+
+	size_t done = 0;
+	ssize_t n;
+
+	while( done < len ){
+		if( ( n = write( Out.fd, p + done, len - done ) ) < 0 ){
+			if( errno == EINTR )
+				continue;
+			print_message( ERROR, "Unable to write the output: %s\n", strerror( errno ) );
+			exit( 0 );
+		}
+		done += n;
+	}
+}
+
+
+// Flush and close the file of --output
+void out_close(){
+
+	out_flush();
+	if( Out.fd >= 0 )
+		close( Out.fd );
+	Out.fd = -1;
+}
+
+
+// Append a string to the buffer of --output
+void out_puts( const char* str ){
+
+	size_t len = strlen( str );
+
+	if( Out.len + len > OUT_BUFFER )
+		out_flush();
+	if( len > OUT_BUFFER )											// larger than the buffer, written as is
+		out_write( str, len );
+	else {
+		memcpy( Out.buf + Out.len, str, len );
+		Out.len += len;
+	}
+	Out.chunk += len;
+}
+
+
+// Append a text field: quoted, escaped for the format and always valid UTF-8
+// (file names, and the fields taken from them, may not be UTF-8: bytes that don't
+// form a valid sequence are taken as Latin-1)
+void out_text( const char* str ){
+
+	const unsigned char *p = (const unsigned char*)str;
+	char szTmp[8];
+	int i, n;
+
+	if( Out.len + 6 * strlen( str ) + 2 > OUT_BUFFER )				// worst case, \u00XX
+		out_flush();
+
+	char *dst = Out.buf + Out.len, *start = dst;
+
+	*dst++ = '"';
+	while( *p ){
+
+		n = ( *p < 0x80 ) ? 1 : ( *p & 0xE0 ) == 0xC0 ? 2 : ( *p & 0xF0 ) == 0xE0 ? 3 : ( *p & 0xF8 ) == 0xF0 ? 4 : 0;
+		for( i = 1; i < n && ( p[i] & 0xC0 ) == 0x80; i++ );
+
+		if( n > 1 && i == n && !( n == 2 && *p < 0xC2 ) ){		// valid multibyte sequence
+			memcpy( dst, p, n );
+			dst += n;
+			p   += n;
+			continue;
+		}
+
+		if( *p >= 0x80 ){										// Latin-1 byte
+			*dst++ = 0xC0 | ( *p >> 6 );
+			*dst++ = 0x80 | ( *p & 0x3F );
+
+		} else if( OutFormat == OUT_CSV ){						// RFC 4180, only the quote is special
+			if( *p == '"' )
+				*dst++ = '"';
+			*dst++ = *p;
+
+		} else if( *p == '"' || *p == '\\' ){
+			*dst++ = '\\';
+			*dst++ = *p;
+
+		} else if( *p < 0x20 ){
+			switch( *p ){
+				case '\n': strcpy( szTmp, "\\n" ); break;
+				case '\r': strcpy( szTmp, "\\r" ); break;
+				case '\t': strcpy( szTmp, "\\t" ); break;
+				default:   snprintf( szTmp, sizeof(szTmp), "\\u%04x", *p ); break;
+			}
+			memcpy( dst, szTmp, strlen( szTmp ) );
+			dst += strlen( szTmp );
+
+		} else {
+			*dst++ = *p;
+		}
+		p++;
+	}
+	*dst++ = '"';
+
+	Out.len   += dst - start;
+	Out.chunk += dst - start;
+}
+
+
+// Write a record to --output, one line per file
+void out_record( const char* Title, const char* Artist, const char* Album, const char* Year, const char* FileName, const char* Path, off_t Size, time_t MTime, const char* Art, const char* Alias ){
+
+	char szNum[64];
+	bool bJson = ( OutFormat == OUT_NDJSON );
+
+	if( RotateSize > 0 && Out.chunk >= RotateSize ){			// next chunk, a record never spans two of them
+		out_close();
+		if( !out_open() ){
+			print_message( ERROR, "Unable to create the next output chunk: %s\n", strerror( errno ) );
+			exit( 0 );
+		}
+	}
+
+	out_puts( bJson ? "{\"path\":" : "" );     out_text( Path );
+	out_puts( bJson ? ",\"filename\":" : "," ); out_text( FileName );
+	out_puts( bJson ? ",\"title\":" : "," );    out_text( Title );
+	out_puts( bJson ? ",\"artist\":" : "," );   out_text( Artist );
+	out_puts( bJson ? ",\"album\":" : "," );    out_text( Album );
+	out_puts( bJson ? ",\"year\":" : "," );     out_text( Year );
+
+	snprintf( szNum, sizeof(szNum), bJson ? ",\"size\":%lld,\"mtime\":%lld,\"art\":" : ",%lld,%lld,", (long long)Size, (long long)MTime );
+	out_puts( szNum );
+
+	if( Art[0] != '\0' )
+		out_text( Art );
+	else if( bJson )
+		out_puts( "null" );										// CSV: an empty field, NULL for the loaders
+
+	out_puts( bJson ? ",\"alias\":" : "," );
+	if( Alias[0] != '\0' )
+		out_text( Alias );
+	else if( bJson )
+		out_puts( "null" );
+
+	out_puts( bJson ? "}\n" : "\n" );
+}
+
+
+// Escape a string for a SQL literal between single quotes
+// Up to 8 strings (slot) can be used in the same query
+const char* sql_escape( const char* str, int slot ){
+
+	static char szBuffer[8][2 * PATH_MAX];
+
+	return sql_escape( str, UseDB == USE_MYSQL, szBuffer[slot], sizeof(szBuffer[slot]) );	// MySQL also uses backslash escapes
+}
+
+
+// Execute a query that returns no rows
+void sql_exec( const char* szQuery ){
+
+	switch( UseDB ){
+
+#ifdef __MYSQL
+	case USE_MYSQL:
+
+		if ( mysql_query( DB_handle.mysql_handle, szQuery ) && bVerbose )
+			print_message( WARNING, "%s\n", mysql_error( DB_handle.mysql_handle ) );
+		break;
+#endif
+
+#ifdef __SQLITE
+	case USE_SQLITE:
+
+		if( sqlite3_exec( DB_handle.sqlite_handle, szQuery, NULL, NULL, NULL )  != SQLITE_OK && bVerbose )
+			print_message( WARNING, "%s\n", sqlite3_errmsg(DB_handle.sqlite_handle) );
+		break;
+#endif
+
+	default:
+		print_error( NO_DB_SELECTED );
+		break;
+	}
+}
+
+
+// Execute a query and call row() for every row returned, NULL columns are NULL pointers
+void sql_select( const char* szQuery, void (*row)( char** cols ) ){
+
+#if defined( __MYSQL ) || defined( __SQLITE )
+	char *cols[16];
+	int i, n;
+#endif
+
+	switch( UseDB ){
+
+#ifdef __MYSQL
+	case USE_MYSQL: {
+
+		MYSQL_RES *res;
+		MYSQL_ROW  r;
+
+		if( mysql_query( DB_handle.mysql_handle, szQuery ) || ( res = mysql_use_result( DB_handle.mysql_handle ) ) == NULL ){
+			if( bVerbose )
+				print_message( WARNING, "%s\n", mysql_error( DB_handle.mysql_handle ) );
+			break;
+		}
+
+		n = mysql_num_fields( res ) < 16 ? mysql_num_fields( res ) : 16;
+		while( ( r = mysql_fetch_row( res ) ) != NULL ){
+			for( i = 0; i < n; i++ )
+				cols[i] = r[i];
+			row( cols );
+		}
+		mysql_free_result( res );
+		break;
+	}
+#endif
+
+#ifdef __SQLITE
+	case USE_SQLITE: {
+
+		sqlite3_stmt *stmt;
+
+		if( sqlite3_prepare_v2( DB_handle.sqlite_handle, szQuery, -1, &stmt, NULL ) != SQLITE_OK ){
+			if( bVerbose )
+				print_message( WARNING, "%s\n", sqlite3_errmsg( DB_handle.sqlite_handle ) );
+			break;
+		}
+
+		n = sqlite3_column_count( stmt ) < 16 ? sqlite3_column_count( stmt ) : 16;
+		while( sqlite3_step( stmt ) == SQLITE_ROW ){
+			for( i = 0; i < n; i++ )
+				cols[i] = (char*)sqlite3_column_text( stmt, i );
+			row( cols );
+		}
+		sqlite3_finalize( stmt );
+		break;
+	}
+#endif
+
+	default:
+		print_error( NO_DB_SELECTED );
+		break;
+	}
+}
+
+// Open a DB Connection
+RETURNCODE OpenDBConnection(){
+	
+	switch( UseDB ){
+		
+#ifdef __MYSQL
+	case USE_MYSQL:
+		DB_handle.mysql_handle = mysql_init( NULL );
+		
+		if( !mysql_real_connect( DB_handle.mysql_handle, pHost, pUser, pPass, pDB, 0, NULL, 0 ) )
+			return DBOPEN_ERROR;
+		mysql_set_character_set( DB_handle.mysql_handle, "utf8mb4" );	// the tags are UTF-8
+		break;
+#endif
+
+#ifdef __SQLITE
+	case USE_SQLITE: {
+
+		char szQuery[64];
+
+		if( sqlite3_open( pFilename, &DB_handle.sqlite_handle ) != SQLITE_OK )
+			return DBOPEN_ERROR;
+
+		if( bBulk ){												// only a new file takes it, before its first table
+			snprintf( szQuery, sizeof(szQuery), "PRAGMA page_size = %d", BULK_PAGE_SIZE );
+			sqlite3_exec( DB_handle.sqlite_handle, szQuery, NULL, NULL, NULL );
+		}
+		break;
+	}
+#endif
+
+	case USE_REMOTE:											// connect to the coordinator
+		if( ( DB_handle.remote_socket = open_socket( pCoordinator, FALSE ) ) < 0 )
+			return DBOPEN_ERROR;
+		break;
+
+	case USE_FILE:												// output file of a bulk loader
+		if( ( Out.buf = (char*)malloc( OUT_BUFFER ) ) == NULL || !out_open() )
+			return DBOPEN_ERROR;
+		break;
+
+	default:
+		return DBUNKNOWN_ERROR;
+		
+	}
+	
+	return DBOPENED;
+}
+
+
+// Close the DB Connection
+RETURNCODE CloseDBConnection(){
+
+	switch( UseDB ){
+
+#ifdef __MYSQL
+	case USE_MYSQL: 								// Close MySQL connection
+		
+		mysql_close( DB_handle.mysql_handle );
+		break;
+#endif
+
+#ifdef __SQLITE	
+	case USE_SQLITE:								// Close SQLite connection
+
+		sqlite3_close( DB_handle.sqlite_handle );
+		break;
+#endif
+
+	case USE_REMOTE:								// Close the coordinator connection
+
+		if( pRemoteOut != NULL )
+			fclose( pRemoteOut );
+		close( DB_handle.remote_socket );
+		break;
+
+	case USE_FILE:									// Flush the output file
+
+		out_close();
+		free( Out.buf );
+		break;
+	
+	default:
+		return DBUNKNOWN_ERROR;
+	}
+	
+	return DBCLOSED;
+}
+
+
+// if required create the standard table 
+void create_table(){
+
+#if defined( __MYSQL ) || defined( __SQLITE )
+	char szBuffer[512];
+#endif
+
+	switch( UseDB ){
+
+#ifdef __MYSQL
+	case USE_MYSQL:
+		
+		sprintf( szBuffer, "CREATE TABLE IF NOT EXISTS %s ( id INT NOT NULL AUTO_INCREMENT PRIMARY KEY, artist TEXT NULL, title TEXT NULL, album TEXT NULL, year VARCHAR(5) NULL, filename TEXT NULL, path TEXT NULL, size VARCHAR(20) NULL, mtime BIGINT NULL, art CHAR(64) NULL, alias TEXT NULL ) ENGINE = MYISAM", pTabname );
+
+		if( mysql_query( DB_handle.mysql_handle, szBuffer ) ){
+			print_message( ERROR, "%s\nUnable to continue\n", mysql_error( DB_handle.mysql_handle ) );
+			CloseDBConnection();
+			exit( 0 );
+		}
+
+		sprintf( szBuffer, "ALTER TABLE %s ADD COLUMN mtime BIGINT NULL", pTabname );		// table of an older version, fails if present
+		mysql_query( DB_handle.mysql_handle, szBuffer );
+		sprintf( szBuffer, "ALTER TABLE %s ADD COLUMN art CHAR(64) NULL", pTabname );
+		mysql_query( DB_handle.mysql_handle, szBuffer );
+		sprintf( szBuffer, "ALTER TABLE %s ADD COLUMN alias TEXT NULL", pTabname );
+		mysql_query( DB_handle.mysql_handle, szBuffer );
+		sprintf( szBuffer, "ALTER TABLE %s MODIFY artist TEXT NULL, MODIFY title TEXT NULL, MODIFY album TEXT NULL", pTabname );	// tags are no longer cut at 30 characters
+		mysql_query( DB_handle.mysql_handle, szBuffer );
+
+		sprintf( szBuffer, "CREATE TABLE IF NOT EXISTS %s_dirs ( path VARCHAR(700) NOT NULL PRIMARY KEY, mtime BIGINT NULL, entries INT NULL, subdirs INT NULL ) ENGINE = MYISAM", pTabname );
+
+		if( mysql_query( DB_handle.mysql_handle, szBuffer ) ){
+			print_message( ERROR, "%s\nUnable to continue\n", mysql_error( DB_handle.mysql_handle ) );
+			CloseDBConnection();
+			exit( 0 );
+		}
+		create_indexes();
+		break;
+#endif
+
+#ifdef __SQLITE
+	 case USE_SQLITE:
+
+		sprintf( szBuffer, "CREATE TABLE IF NOT EXISTS %s ( id INTEGER PRIMARY KEY, artist TEXT, title TEXT, album TEXT, year VARCHAR(5), filename TEXT, path TEXT, size VARCHAR(20), mtime INTEGER, art TEXT, alias TEXT )", pTabname );
+
+	 	if( sqlite3_exec( DB_handle.sqlite_handle, szBuffer, NULL, NULL, NULL ) != SQLITE_OK ){
+			
+			print_message( ERROR, "%s\nUnable to continue", sqlite3_errmsg( DB_handle.sqlite_handle ) );
+			CloseDBConnection();
+			exit( 0 );
+		}
+
+		sprintf( szBuffer, "ALTER TABLE %s ADD COLUMN mtime INTEGER", pTabname );			// table of an older version, fails if present
+		sqlite3_exec( DB_handle.sqlite_handle, szBuffer, NULL, NULL, NULL );
+		sprintf( szBuffer, "ALTER TABLE %s ADD COLUMN art TEXT", pTabname );
+		sqlite3_exec( DB_handle.sqlite_handle, szBuffer, NULL, NULL, NULL );
+		sprintf( szBuffer, "ALTER TABLE %s ADD COLUMN alias TEXT", pTabname );
+		sqlite3_exec( DB_handle.sqlite_handle, szBuffer, NULL, NULL, NULL );
+
+		sprintf( szBuffer, "CREATE TABLE IF NOT EXISTS %s_dirs ( path TEXT PRIMARY KEY, mtime INTEGER, entries INTEGER, subdirs INTEGER )", pTabname );
+
+	 	if( sqlite3_exec( DB_handle.sqlite_handle, szBuffer, NULL, NULL, NULL ) != SQLITE_OK ){
+
+			print_message( ERROR, "%s\nUnable to continue", sqlite3_errmsg( DB_handle.sqlite_handle ) );
+			CloseDBConnection();
+			exit( 0 );
+		}
+		if( !bBulk )												// else built after the rows by bulk_commit
+			create_indexes();
+		break;
+#endif
+
+	default:
+		break;
+	 }
+}
+
+
+// Indexes of the lookups on the table: artist, album, and path for the rows of a directory
+void create_indexes(){
+
+#if defined( __MYSQL ) || defined( __SQLITE )
+	const char *column[] = { "artist", "album", "path" };
+	char szBuffer[512];
+#endif
+	int i;
+
+	for( i = 0; i < 3; i++ ){
+
+		switch( UseDB ){
+
+#ifdef __MYSQL
+		case USE_MYSQL:												// TEXT columns are indexed on a prefix, fails if present
+			sprintf( szBuffer, "ALTER TABLE %s ADD INDEX %s_%s ( %s(%d) )", pTabname, pTabname, column[i], column[i], i == 2 ? 255 : 64 );
+			mysql_query( DB_handle.mysql_handle, szBuffer );
+			break;
+#endif
+
+#ifdef __SQLITE
+		case USE_SQLITE:
+			sprintf( szBuffer, "CREATE INDEX IF NOT EXISTS main.%s_%s ON %s( %s )", pTabname, column[i], pTabname, column[i] );
+			if( sqlite3_exec( DB_handle.sqlite_handle, szBuffer, NULL, NULL, NULL ) != SQLITE_OK )
+				print_message( WARNING, "%s\n", sqlite3_errmsg( DB_handle.sqlite_handle ) );
+			break;
+#endif
+
+		default:
+			break;
+		}
+	}
+}
+
+
+// --bulk: stage the rows in memory until bulk_commit. The TEMP tables have the
+// names of the ones of the table, the queries of the scan go to them unchanged
+void bulk_begin(){
+
+#ifdef __SQLITE
+	char szBuffer[512];
+
+	sqlite3_exec( DB_handle.sqlite_handle, "PRAGMA temp_store = MEMORY", NULL, NULL, NULL );
+
+	sprintf( szBuffer, "CREATE TEMP TABLE %s ( artist TEXT, title TEXT, album TEXT, year VARCHAR(5), filename TEXT, path TEXT, size VARCHAR(20), mtime INTEGER, art TEXT, alias TEXT )", pTabname );
+	if( sqlite3_exec( DB_handle.sqlite_handle, szBuffer, NULL, NULL, NULL ) != SQLITE_OK ){
+
+		print_message( ERROR, "%s\nUnable to continue", sqlite3_errmsg( DB_handle.sqlite_handle ) );
+		CloseDBConnection();
+		exit( 0 );
+	}
+
+	sprintf( szBuffer, "CREATE TEMP TABLE %s_dirs ( path TEXT PRIMARY KEY, mtime INTEGER, entries INTEGER, subdirs INTEGER )", pTabname );
+	sqlite3_exec( DB_handle.sqlite_handle, szBuffer, NULL, NULL, NULL );
+
+	sqlite3_exec( DB_handle.sqlite_handle, "BEGIN", NULL, NULL, NULL );
+#endif
+}
+
+
+// --bulk: write the staged rows into the table in a single transaction without sync,
+// then build its indexes. The indexes are dropped before the rows are written: building
+// them once is faster than updating them row by row. The journal is turned off only for
+// an empty table, there is nothing else to roll back to; a table with rows keeps the
+// journal of the file, a failure rolls the whole load back
+void bulk_commit(){
+
+#ifdef __SQLITE
+	char szBuffer[1024];
+	char szIndex[256];
+	const char *column[] = { "artist", "album", "path" };
+	bool bJournal, bOk = TRUE;
+	int i;
+
+	sqlite3_exec( DB_handle.sqlite_handle, "COMMIT", NULL, NULL, NULL );	// of the staging, the file is untouched so far
+
+	BulkRows = -1;
+	snprintf( szBuffer, sizeof(szBuffer), "SELECT ( SELECT count(*) FROM main.%s ) + ( SELECT count(*) FROM main.%s_dirs )", pTabname, pTabname );
+	sql_select( szBuffer, bulk_rows_row );
+	bJournal = ( BulkRows != 0 );
+
+	if( !bJournal )
+		sqlite3_exec( DB_handle.sqlite_handle, "PRAGMA main.journal_mode = OFF", NULL, NULL, NULL );
+	sqlite3_exec( DB_handle.sqlite_handle, "PRAGMA main.synchronous = OFF", NULL, NULL, NULL );
+	snprintf( szBuffer, sizeof(szBuffer), "PRAGMA main.cache_size = -%d", BULK_CACHE_KB );
+	sqlite3_exec( DB_handle.sqlite_handle, szBuffer, NULL, NULL, NULL );
+
+	sqlite3_exec( DB_handle.sqlite_handle, "BEGIN", NULL, NULL, NULL );
+
+	for( i = 0; i < 3 && bOk; i++ ){
+		snprintf( szIndex, sizeof(szIndex), "DROP INDEX IF EXISTS main.%s_%s", pTabname, column[i] );
+		bOk = ( sqlite3_exec( DB_handle.sqlite_handle, szIndex, NULL, NULL, NULL ) == SQLITE_OK );
+	}
+
+	snprintf( szBuffer, sizeof(szBuffer), "INSERT INTO main.%s( artist, title, album, year, filename, path, size, mtime, art, alias ) "
+			  "SELECT artist, title, album, year, filename, path, size, mtime, art, alias FROM temp.%s ORDER BY rowid", pTabname, pTabname );
+	bOk = bOk && sqlite3_exec( DB_handle.sqlite_handle, szBuffer, NULL, NULL, NULL ) == SQLITE_OK;
+
+	snprintf( szBuffer, sizeof(szBuffer), "INSERT OR REPLACE INTO main.%s_dirs( path, mtime, entries, subdirs ) SELECT path, mtime, entries, subdirs FROM temp.%s_dirs", pTabname, pTabname );
+	bOk = bOk && sqlite3_exec( DB_handle.sqlite_handle, szBuffer, NULL, NULL, NULL ) == SQLITE_OK;
+
+	if( !bOk ){
+
+		if( bJournal ){
+			print_message( ERROR, "%s\nNothing written, unable to continue\n", sqlite3_errmsg( DB_handle.sqlite_handle ) );
+			sqlite3_exec( DB_handle.sqlite_handle, "ROLLBACK", NULL, NULL, NULL );
+		} else {													// what is written stays: drop the file and run the scan again
+			print_message( ERROR, "%s\nThe table %s of %s is incomplete and can't be rolled back (no journal), unable to continue\n",
+						   sqlite3_errmsg( DB_handle.sqlite_handle ), pTabname, pFilename );
+		}
+		CloseDBConnection();
+		exit( 0 );
+	}
+
+	create_indexes();
+
+	if( sqlite3_exec( DB_handle.sqlite_handle, "COMMIT", NULL, NULL, NULL ) != SQLITE_OK )
+		print_message( ERROR, "%s\n", sqlite3_errmsg( DB_handle.sqlite_handle ) );
+
+	snprintf( szBuffer, sizeof(szBuffer), "DROP TABLE temp.%s; DROP TABLE temp.%s_dirs", pTabname, pTabname );
+	sqlite3_exec( DB_handle.sqlite_handle, szBuffer, NULL, NULL, NULL );
+#endif
+}
+
+
+// Row callback of bulk_commit
+void bulk_rows_row( char** cols ){
+
+	BulkRows = cols[0] != NULL ? atoll( cols[0] ) : -1;
+}
+
+
+// Open a TCP socket on "[HOST:]PORT", listening or connected depending on bListen
+// Without HOST it is the loopback: the protocol has no authentication, listening on
+// another interface must be asked for
+int open_socket( const char* pAddress, bool bListen ){
+
+	char szHost[256];
+	const char *pPort;
+	struct addrinfo hints, *res, *ai;
+	int fd = -1, on = 1;
+
+	strncpy( szHost, pAddress, sizeof(szHost) - 1 );
+	szHost[sizeof(szHost) - 1] = '\0';
+
+	char *ptr = rindex( szHost, ':' );
+	if( ptr != NULL ){												// HOST:PORT
+		*ptr = '\0';
+		pPort = ptr + 1;
+	} else {														// PORT only
+		pPort = szHost;
+	}
+
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if( getaddrinfo( ( ptr != NULL && szHost[0] != '\0' ) ? szHost : "127.0.0.1", pPort, &hints, &res ) != 0 )
+		return -1;
+
+	for( ai = res; ai != NULL; ai = ai->ai_next ){
+
+		if( ( fd = socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol ) ) < 0 )
+			continue;
+
+		if( bListen ){
+			setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+			if( bind( fd, ai->ai_addr, ai->ai_addrlen ) == 0 && listen( fd, MAX_WORKERS ) == 0 )
+				break;
+		} else if( connect( fd, ai->ai_addr, ai->ai_addrlen ) == 0 ){
+			break;
+		}
+
+		close( fd );
+		fd = -1;
+	}
+
+	freeaddrinfo( res );
+	return fd;
+}
+
+
+// Write a protocol field, escaping the characters used as separators
+void escape_field( FILE* out, const char* str ){
+
+	for( ; *str; str++ ){
+		switch( *str ){
+		case '\\': fputs( "\\\\", out ); break;
+		case '\t': fputs( "\\t", out );  break;
+		case '\n': fputs( "\\n", out );  break;
+		case '\r': fputs( "\\r", out );  break;
+		default:   putc( *str, out );    break;
+		}
+	}
+}
+
+
+// Split a protocol line in tab separated fields and unescape them in place
+// Return the number of fields found
+int split_fields( char* line, char* fields[], int max ){
+
+	int n = 0;
+	char *src = line, *dst = line;
+
+	fields[n++] = dst;
+
+	for( ; *src && *src != '\n'; src++ ){
+
+		if( *src == '\t' ){											// end of the current field
+			*dst++ = '\0';
+			if( n == max )
+				return -1;
+			fields[n++] = dst;
+
+		} else if( *src == '\\' && src[1] != '\0' ){				// escaped character
+			src++;
+			*dst++ = ( *src == 't' ) ? '\t' : ( *src == 'n' ) ? '\n' : ( *src == 'r' ) ? '\r' : *src;
+
+		} else {
+			*dst++ = *src;
+		}
+	}
+	*dst = '\0';
+
+	return n;
+}
+
+
+// Send a record found by the worker to the coordinator
+void remote_send_record( const char* Title, const char* Artist, const char* Album, const char* Year, const char* FileName, const char* Path, off_t Size, time_t MTime, const char* Art, const char* Alias ){
+
+	fputs( "REC", pRemoteOut );
+	fputc( '\t', pRemoteOut ); escape_field( pRemoteOut, Title );
+	fputc( '\t', pRemoteOut ); escape_field( pRemoteOut, Artist );
+	fputc( '\t', pRemoteOut ); escape_field( pRemoteOut, Album );
+	fputc( '\t', pRemoteOut ); escape_field( pRemoteOut, Year );
+	fputc( '\t', pRemoteOut ); escape_field( pRemoteOut, FileName );
+	fputc( '\t', pRemoteOut ); escape_field( pRemoteOut, Path );
+	fprintf( pRemoteOut, "\t%lld\t%lld\t", (long long)Size, (long long)MTime );
+	escape_field( pRemoteOut, Art );
+	fputc( '\t', pRemoteOut ); escape_field( pRemoteOut, Alias );
+	fputc( '\n', pRemoteOut );
+}
+
+
+// Worker side of a distributed scan: scan the subtrees sent by the coordinator
+// and stream back the records found
+RETURNCODE worker_loop(){
+
+	FILE *in;
+	char *line = NULL;
+	char *fields[12];
+	size_t cap = 0;
+	int n;
+
+	signal( SIGPIPE, SIG_IGN );
+
+	bRelPath     = TRUE;										// the coordinator builds the absolute paths
+	bInteractive = FALSE;
+
+	szRoot[0] = '\0';
+	if( pPath != NULL && realpath( pPath, szRoot ) == NULL )	// local mount of the library root
+		return CHDIR_ERROR;
+
+	if( ( in = fdopen( dup( DB_handle.remote_socket ), "r" ) ) == NULL ||
+		( pRemoteOut = fdopen( dup( DB_handle.remote_socket ), "w" ) ) == NULL )
+		return SOCKET_ERROR;
+
+	fprintf( pRemoteOut, "HELLO\t%s\n", PROTO_VERSION );
+	fflush( pRemoteOut );
+
+	while( getline( &line, &cap, in ) > 0 ){
+
+		n = split_fields( line, fields, 12 );
+
+		if( n == 12 && !strcmp( fields[0], "CONF" ) ){			// CONF tagversion fnformat spacechar root deadline artdir order onefs dedup jobs nocache
+
+			TagVersion = (byte)atoi( fields[1] );
+			if( fields[2][0] != '\0' ){
+				pFileNameFormat = strdup( fields[2] );
+				bUseFileName    = TRUE;
+			}
+			if( fields[3][0] != '\0' ){
+				pSpaceChar    = strdup( fields[3] );
+				bUseSpaceChar = TRUE;
+			}
+			if( szRoot[0] == '\0' )
+				strncpy( szRoot, fields[4], PATH_MAX - 1 );
+			Deadline = atoi( fields[5] );
+			if( pArtDir == NULL && fields[6][0] != '\0' )		// the local --extract-art wins, as PATH
+				pArtDir = strdup( fields[6] );
+			if( ReadOrder == MP3SCAN_ORDER_READDIR )			// the disks are the ones of the worker
+				ReadOrder = (MP3SCAN_ORDER)atoi( fields[7] );
+			bOneFileSystem = atoi( fields[8] );
+			bDedupFiles    = atoi( fields[9] );
+			if( Jobs == 0 )										// as the read order
+				Jobs = atoi( fields[10] );
+			bNoCache       = bNoCache || atoi( fields[11] );		// the page cache is the one of the worker
+
+			VERBOSE_LOG1( "Library root is %s\n", szRoot );
+
+		} else if( n == 2 && !strcmp( fields[0], "RULE" ) ){	// RULE [+-]glob, after the local ones
+
+			if( !add_rule( fields[1][0], fields[1] + 1 ) )
+				return PROTOCOL_ERROR;
+
+		} else if( n == 3 && !strcmp( fields[0], "TASK" ) ){	// TASK relpath recursive
+
+			VERBOSE_LOG1( "Scanning %s\n", fields[1][0] ? fields[1] : "./" );
+
+			bRecursive = atoi( fields[2] );
+
+			if( mp3_scan_path( fields[1] ) != END_LOOP ){
+
+				fputs( "WARN\tunable to open ", pRemoteOut );
+				escape_field( pRemoteOut, szRoot );
+				fputc( '/', pRemoteOut );
+				escape_field( pRemoteOut, fields[1] );
+				fputc( '\n', pRemoteOut );
+			}
+
+			fputs( "DONE\n", pRemoteOut );
+			if( fflush( pRemoteOut ) != 0 )
+				return SOCKET_ERROR;
+
+		} else if( n == 1 && !strcmp( fields[0], "QUIT" ) ){
+
+			break;
+
+		} else {
+
+			return PROTOCOL_ERROR;
+		}
+	}
+
+	free( line );
+	fclose( in );
+
+	return END_LOOP;
+}
+
+
+// Parse a message received from a worker
+LINECODE worker_line( WORKER* w, char* line ){
+
+	char *fields[11], *p;
+	size_t len = strlen( line );
+	int i, n;
+
+	if( !strncmp( line, "REC\t", 4 ) || !strncmp( line, "DIR\t", 4 ) ){	// kept until DONE, the task of a lost worker is scanned again
+
+		for( n = 1, p = line; ( p = index( p, '\t' ) ) != NULL; p++ )
+			n++;
+		if( w->task < 0 || n != ( line[0] == 'R' ? 11 : 5 ) )	// REC has 11 fields, DIR 5
+			return LINE_ERROR;
+
+		if( w->rowlen + len + 1 > w->rowcap ){
+			w->rowcap = ( w->rowlen + len + 1 ) * 2;
+			w->rows   = (char*)realloc( w->rows, w->rowcap );
+		}
+		memcpy( w->rows + w->rowlen, line, len );
+		w->rowlen += len;
+		w->rows[w->rowlen++] = '\n';
+		return LINE_OK;
+	}
+
+	n = split_fields( line, fields, 11 );
+
+	if( n == 2 && !strcmp( fields[0], "HELLO" ) ){					// HELLO version
+
+		if( strcmp( fields[1], PROTO_VERSION ) != 0 )
+			return LINE_ERROR;
+
+		fputs( "CONF", w->out );
+		fprintf( w->out, "\t%d\t", TagVersion );
+		escape_field( w->out, bUseFileName ? pFileNameFormat : "" );
+		fputc( '\t', w->out );
+		escape_field( w->out, bUseSpaceChar ? pSpaceChar : "" );
+		fputc( '\t', w->out );
+		escape_field( w->out, szRoot );
+		fprintf( w->out, "\t%d\t", Deadline );
+		escape_field( w->out, pArtDir != NULL ? pArtDir : "" );
+		fprintf( w->out, "\t%d\t%d\t%d\t%d\t%d\n", ReadOrder, bOneFileSystem, bDedupFiles, Jobs, bNoCache );
+		for( i = 0; i < nRules; i++ ){
+			fputs( "RULE\t", w->out );
+			escape_field( w->out, pRules[i] );
+			fputc( '\n', w->out );
+		}
+		fflush( w->out );
+
+		return LINE_READY;
+
+	} else if( n == 2 && !strcmp( fields[0], "WARN" ) ){			// WARN message
+
+		print_message( WARNING, "worker: %s\n", fields[1] );
+		return LINE_OK;
+
+	} else if( n == 1 && !strcmp( fields[0], "DONE" ) ){
+
+		if( w->task < 0 )
+			return LINE_ERROR;
+		worker_commit( w );
+		return LINE_DONE;
+	}
+
+	return LINE_ERROR;
+}
+
+
+// Store a REC or DIR line of a worker, its fields counted by worker_line
+void worker_record( char* line ){
+
+	static char szPath[PATH_MAX];
+	static char szAlias[PATH_MAX];
+	char *fields[11];
+	off_t size;
+
+	if( split_fields( line, fields, 11 ) == 5 ){					// DIR relpath mtime entries subdirs
+
+		if( !record_path( fields[1], szPath ) ){
+			print_message( WARNING, "%s: path too long, skipped\n", fields[1] );
+			return;
+		}
+		dir_store( fields[1], szPath, atoll( fields[2] ), atoi( fields[3] ), atoi( fields[4] ) );
+		return;
+	}
+
+	// REC title artist album year filename relpath size mtime art alias
+	if( !record_path( fields[6], szPath ) ){
+		print_message( WARNING, "%s%s: path too long, skipped\n", fields[6], fields[5] );
+		return;
+	}
+
+	size = (off_t)atoll( fields[7] );
+	if( bFsInfo && fields[10][0] == '\0' )							// an alias is a file already counted
+		size_count( size );
+
+	if( fields[10][0] != '\0' && !bRelPath ){						// relative to the root, as relpath
+		if( snprintf( szAlias, PATH_MAX, "%s/%s", szRoot, fields[10] ) >= PATH_MAX ){
+			print_message( WARNING, "%s%s: path too long, skipped\n", fields[6], fields[5] );
+			return;
+		}
+		fields[10] = szAlias;
+	}
+
+	sql_insert( fields[1], fields[2], fields[3], fields[4], fields[5], szPath, size, (time_t)atoll( fields[8] ), fields[9], fields[10] );
+	Mp3Counter++;
+}
+
+
+// Store the records of the task a worker completed
+void worker_commit( WORKER* w ){
+
+	char *line = w->rows, *end;
+
+	while( line < w->rows + w->rowlen ){
+		end = index( line, '\n' );
+		*end = '\0';
+		worker_record( line );
+		line = end + 1;
+	}
+	w->rowlen = 0;
+}
+
+
+// Send a task to an idle worker
+void worker_assign( WORKER* w, const char* pRelPath, bool bRecurse ){
+
+	fputs( "TASK\t", w->out );
+	escape_field( w->out, pRelPath );
+	fprintf( w->out, "\t%d\n", bRecurse ? 1 : 0 );
+	fflush( w->out );
+}
+
+
+// Close the connection with a worker
+void worker_drop( WORKER* w ){
+
+	fclose( w->out );
+	close( w->fd );
+	free( w->buf );
+	free( w->rows );
+}
+
+
+// Coordinator side of a distributed scan: split the top-level subtrees of the
+// current directory among the workers and store the records they send back
+RETURNCODE coordinator_loop(){
+
+	static char szAddress[300];
+	static char szProgram[PATH_MAX];
+	static char szMarker[PATH_MAX];
+	static WORKER Worker[MAX_WORKERS];
+	struct pollfd fds[MAX_WORKERS + 1];
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	char szPort[NI_MAXSERV];
+	char **pTask = NULL;
+	int  *Pending;
+	int  nTask = 0, nPending = 0, nDone = 0, nWorker = 0, nChildren = 0;
+	int  i, fd, lfd;
+	DIR  *dir;
+	struct dirent *file;
+	struct stat finfo, rinfo;
+	ino_t *pTaskIno = NULL;										// of the top-level directories, two names of one are one task
+	int  nTaskIno = 0;
+
+	if( bInteractive )
+		return INTERACTIVE_WORKERS_ERROR;
+
+	signal( SIGPIPE, SIG_IGN );
+
+	// Build the task list: the files in the root plus, if recursive, one task per top-level directory
+	if( ( dir = opendir( szRoot ) ) == NULL || fstat( dirfd( dir ), &rinfo ) != 0 )
+		return OPENDIR_ERROR;
+
+	pTask = (char**)malloc( sizeof(char*) );
+	pTask[nTask++] = strdup( "" );
+
+	while( bRecursive && ( file = readdir( dir ) ) != NULL ){
+
+		if( strcmp( ".", file->d_name ) != 0 && strcmp( "..", file->d_name ) != 0 &&
+			fstatat( dirfd( dir ), file->d_name, &finfo, 0 ) == 0 && S_ISDIR( finfo.st_mode ) ){
+
+			snprintf( szMarker, PATH_MAX, "%s/%s", file->d_name, IGNORE_MARKER );
+			if( ( pFilter != NULL && !mp3scan_filter_match( pFilter, file->d_name, TRUE ) ) ||
+				faccessat( dirfd( dir ), szMarker, F_OK, 0 ) == 0 ){
+				Stats.dirs_excluded++;
+				continue;
+			}
+
+			if( finfo.st_dev != rinfo.st_dev ){
+				if( bOneFileSystem ){
+					Stats.dirs_other_fs++;
+					continue;
+				}
+			} else {												// the sets of the workers don't see the other tasks
+				for( i = 0; i < nTaskIno && pTaskIno[i] != finfo.st_ino; i++ );
+				if( finfo.st_ino == rinfo.st_ino || i < nTaskIno ){
+					VERBOSE_LOG1( "%s: already scanned (symlink loop or bind mount), skipped\n", file->d_name );
+					Stats.dirs_revisited++;
+					continue;
+				}
+				pTaskIno = (ino_t*)realloc( pTaskIno, ( nTaskIno + 1 ) * sizeof(ino_t) );
+				pTaskIno[nTaskIno++] = finfo.st_ino;
+			}
+
+			pTask = (char**)realloc( pTask, ( nTask + 1 ) * sizeof(char*) );
+			pTask[nTask] = (char*)malloc( strlen( file->d_name ) + 2 );
+			sprintf( pTask[nTask++], "%s/", file->d_name );
+		}
+	}
+	closedir( dir );
+	free( pTaskIno );
+
+	Pending = (int*)malloc( nTask * sizeof(int) );				// tasks not yet assigned, used as a ring
+	for( i = 0; i < nTask; i++ )
+		Pending[i] = nTask - 1 - i;								// popped from the end
+	nPending = nTask;
+
+	VERBOSE_LOG1( "Library split in %d task(s)\n", nTask );
+
+	// Open the coordinator socket, by default only local workers on the loopback
+	if( ( lfd = open_socket( pListen != NULL ? pListen : "127.0.0.1:0", TRUE ) ) < 0 )
+		return SOCKET_ERROR;
+
+	getsockname( lfd, (struct sockaddr*)&addr, &addrlen );
+	getnameinfo( (struct sockaddr*)&addr, addrlen, NULL, 0, szPort, sizeof(szPort), NI_NUMERICSERV );
+
+	if( pListen != NULL && rindex( pListen, ':' ) != NULL && pListen[0] != ':' )
+		snprintf( szAddress, sizeof(szAddress), "%.*s:%s", (int)( rindex( pListen, ':' ) - pListen ), pListen, szPort );
+	else
+		snprintf( szAddress, sizeof(szAddress), "127.0.0.1:%s", szPort );
+
+	VERBOSE_LOG1( "Waiting for workers on %s\n", szAddress );
+
+	// Spawn the local workers: the running binary (Linux), else a relative program name refers to the initial path
+	if( Workers > 0 && realpath( "/proc/self/exe", szProgram ) == NULL ){
+		if( pProgramName[0] != '/' && index( pProgramName, '/' ) != NULL ){
+			if( snprintf( szProgram, PATH_MAX, "%s/%s", szCurrentPath, pProgramName ) >= PATH_MAX )
+				return WORKER_PROGRAM_ERROR;
+		} else if( snprintf( szProgram, PATH_MAX, "%s", pProgramName ) >= PATH_MAX )
+			return WORKER_PROGRAM_ERROR;
+	}
+
+	fflush( stdout );
+	for( i = 0; i < Workers; i++ ){
+
+		pid_t pid = fork();
+
+		if( pid == 0 ){
+			const char *args[6] = { szProgram, "--worker", szAddress, NULL, NULL, NULL };
+			int n = 3;
+			if( bStats )
+				args[n++] = "-S";
+			if( bVerbose )
+				args[n++] = "-V";
+			close( lfd );
+			execvp( szProgram, (char* const*)args );
+			_exit( 1 );
+		}
+		if( pid > 0 )
+			nChildren++;
+	}
+
+	// Event loop: accept workers, hand out the tasks and store the records
+	while( nDone < nTask ){
+
+		fds[0].fd     = lfd;
+		fds[0].events = POLLIN;
+		for( i = 0; i < nWorker; i++ ){
+			fds[i + 1].fd     = Worker[i].fd;
+			fds[i + 1].events = POLLIN;
+		}
+
+		if( poll( fds, nWorker + 1, 1000 ) < 0 && errno != EINTR )
+			return SOCKET_ERROR;
+
+		for( i = nWorker - 1; i >= 0; i-- ){						// backwards, dropped workers are swapped with the last one
+
+			if( !( fds[i + 1].revents & ( POLLIN | POLLHUP | POLLERR ) ) )
+				continue;
+
+			WORKER *w = &Worker[i];
+			ssize_t rd;
+			bool bAlive = TRUE;
+
+			if( w->cap - w->len < 4096 ){
+				w->cap = w->cap * 2 + 65536;
+				w->buf = (char*)realloc( w->buf, w->cap );
+			}
+
+			if( ( rd = read( w->fd, w->buf + w->len, w->cap - w->len - 1 ) ) <= 0 ){
+				bAlive = FALSE;
+			} else {
+
+				char *line = w->buf, *end;
+				w->len += rd;
+				w->buf[w->len] = '\0';
+
+				while( bAlive && ( end = index( line, '\n' ) ) != NULL ){
+
+					*end = '\0';
+
+					switch( worker_line( w, line ) ){
+
+					case LINE_DONE:									// task completed, its records stored
+						nDone++;
+						w->task = -1;
+						break;
+
+					case LINE_READY:
+						w->bReady = TRUE;
+						break;
+
+					case LINE_ERROR:
+						bAlive = FALSE;
+						break;
+
+					default:
+						break;
+					}
+					line = end + 1;
+				}
+
+				w->len -= line - w->buf;							// keep the incomplete line
+				memmove( w->buf, line, w->len );
+			}
+
+			if( !bAlive ){
+				if( w->task >= 0 ){									// requeue the task of the lost worker
+					print_message( WARNING, "Worker lost, rescanning %s\n", pTask[w->task][0] ? pTask[w->task] : "./" );
+					Pending[nPending++] = w->task;
+				}
+				worker_drop( w );
+				Worker[i] = Worker[--nWorker];
+			}
+		}
+
+		if( fds[0].revents & POLLIN ){								// new worker
+
+			if( ( fd = accept( lfd, NULL, NULL ) ) >= 0 ){
+
+				if( nWorker == MAX_WORKERS ){
+					close( fd );
+				} else {
+					memset( &Worker[nWorker], 0, sizeof(WORKER) );
+					Worker[nWorker].fd   = fd;
+					Worker[nWorker].out  = fdopen( dup( fd ), "w" );
+					Worker[nWorker].task = -1;
+					nWorker++;
+					VERBOSE_LOG1( "Worker connected, %d active\n", nWorker );
+				}
+			}
+		}
+
+		for( i = 0; i < nWorker && nPending > 0; i++ )				// hand out the tasks to the idle workers, a requeued one too
+			if( Worker[i].bReady && Worker[i].task < 0 ){
+				Worker[i].task = Pending[--nPending];
+				worker_assign( &Worker[i], pTask[Worker[i].task], Worker[i].task != 0 );
+			}
+
+		while( nChildren > 0 && waitpid( -1, NULL, WNOHANG ) > 0 )
+			nChildren--;
+
+		if( nWorker == 0 && nChildren == 0 && pListen == NULL )
+			return NO_WORKER_AVAILABLE;
+	}
+
+	// All tasks done, release the workers
+	for( i = 0; i < nWorker; i++ ){
+		fputs( "QUIT\n", Worker[i].out );
+		worker_drop( &Worker[i] );
+	}
+	close( lfd );
+
+	while( nChildren-- > 0 )
+		wait( NULL );
+
+	for( i = 0; i < nTask; i++ )
+		free( pTask[i] );
+	free( pTask );
+	free( Pending );
+
+	return END_LOOP;
+}
+
+// Catalog server: answer the queries of the local clients on the Unix socket --socket out
+// of the table loaded in memory, loaded again once a scan changed it
+//
+// A request is a 4-byte big-endian length and that many bytes: the tab separated fields
+//   P FIELD PREFIX [LIMIT]		rows whose FIELD starts with PREFIX
+//   E FIELD VALUE [LIMIT]		rows whose FIELD is VALUE
+//   R FIELD FROM TO [LIMIT]	rows whose FIELD is between FROM and TO
+// FIELD is artist, album or year, the comparisons ignore the ASCII case and the values are
+// escaped as in the distributed scan protocol. The response is a 4-byte big-endian length
+// and "OK ROWS GENERATION\n" followed by the rows in FIELD order, one line each:
+// artist title album year filename path size mtime art alias; or "ERR MESSAGE\n"
+RETURNCODE serve_loop(){
+
+#ifdef __linux__
+	static CLIENT Listener, Signals;								// to tell their events from the clients'
+	struct epoll_event ev, events[SERVE_EVENTS];
+	struct sockaddr_un addr;
+	struct signalfd_siginfo si;
+	struct stat sinfo;
+	sigset_t mask;
+	char szVersion[64], szLoaded[64], szSeen[64];					// of the table: now, loaded, last seen
+	time_t now, checked = 0, changed = 0;
+	bool bQuit = FALSE, bReload = FALSE;
+	CATALOG *old;
+	CLIENT *c;
+	int efd, lfd, sfd, fd, i, n;
+
+	signal( SIGPIPE, SIG_IGN );
+
+	table_version( szLoaded );
+	strcpy( szSeen, szLoaded );
+	pCatalog = catalog_load();
+	print_message( STATUS, "Catalog loaded: %d rows\n", pCatalog->rows );
+
+	if( strlen( pSocket ) >= sizeof(addr.sun_path) )
+		return SERVE_SOCKET_ERROR;
+
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	strcpy( addr.sun_path, pSocket );
+
+	if( lstat( pSocket, &sinfo ) == 0 && S_ISSOCK( sinfo.st_mode ) )	// left by a previous server
+		unlink( pSocket );
+
+	if( ( lfd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 ) ) < 0 ||
+		bind( lfd, (struct sockaddr*)&addr, sizeof(addr) ) != 0 || listen( lfd, SOMAXCONN ) != 0 )
+		return SERVE_SOCKET_ERROR;
+
+	sigemptyset( &mask );											// SIGHUP: load the table now
+	sigaddset( &mask, SIGHUP );
+	sigaddset( &mask, SIGINT );
+	sigaddset( &mask, SIGTERM );
+	sigprocmask( SIG_BLOCK, &mask, NULL );
+
+	if( ( sfd = signalfd( -1, &mask, SFD_NONBLOCK | SFD_CLOEXEC ) ) < 0 || ( efd = epoll_create1( EPOLL_CLOEXEC ) ) < 0 )
+		return SERVE_SOCKET_ERROR;
+
+	Listener.fd = lfd;
+	Signals.fd  = sfd;
+	ev.events   = EPOLLIN;
+	ev.data.ptr = &Listener;
+	epoll_ctl( efd, EPOLL_CTL_ADD, lfd, &ev );
+	ev.data.ptr = &Signals;
+	epoll_ctl( efd, EPOLL_CTL_ADD, sfd, &ev );
+
+	VERBOSE_LOG1( "Serving on %s\n", pSocket );
+
+	while( !bQuit ){
+
+		n = epoll_wait( efd, events, SERVE_EVENTS, SERVE_POLL * 1000 );
+
+		for( i = 0; i < n; i++ ){
+
+			c = (CLIENT*)events[i].data.ptr;
+
+			if( c == &Listener ){
+
+				while( ( fd = accept4( lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC ) ) >= 0 ){
+					c = (CLIENT*)calloc( 1, sizeof(CLIENT) );
+					c->fd       = fd;
+					c->iovcap   = 64;									// iov[0] is the head of the response
+					c->iov      = (struct iovec*)malloc( c->iovcap * sizeof(struct iovec) );
+					ev.events   = EPOLLIN;
+					ev.data.ptr = c;
+					epoll_ctl( efd, EPOLL_CTL_ADD, fd, &ev );
+				}
+
+			} else if( c == &Signals ){
+
+				while( read( sfd, &si, sizeof(si) ) == sizeof(si) ){
+					if( si.ssi_signo == SIGHUP )
+						bReload = TRUE;
+					else
+						bQuit = TRUE;
+				}
+
+			} else if( ( events[i].events & EPOLLOUT ) && ( !serve_flush( c ) || !serve_pending( c ) ) ){	// then the requests
+
+				serve_drop( c );
+
+			} else if( ( events[i].events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) ) && !serve_input( c ) ){
+
+				serve_drop( c );
+
+			} else {													// write the response or wait for the next request
+				ev.events   = ( c->iovcnt > 0 ) ? EPOLLOUT : EPOLLIN;
+				ev.data.ptr = c;
+				epoll_ctl( efd, EPOLL_CTL_MOD, c->fd, &ev );
+			}
+		}
+
+		if( ( now = time( NULL ) ) - checked >= SERVE_POLL ){		// committed by a scan since the last load?
+			checked = now;
+			table_version( szVersion );
+			if( strcmp( szVersion, szSeen ) != 0 ){				// still changing, wait for the end of the scan
+				strcpy( szSeen, szVersion );
+				changed = ( strcmp( szVersion, szLoaded ) != 0 ) ? now : 0;
+			}
+		}
+
+		if( bReload || ( changed != 0 && now - changed >= SERVE_QUIET ) ){
+
+			table_version( szLoaded );
+			strcpy( szSeen, szLoaded );
+			old = pCatalog;
+			pCatalog = catalog_load();							// the responses in progress keep the old one
+			pCatalog->generation = old->generation + 1;
+			catalog_release( old );
+
+			print_message( STATUS, "Catalog loaded again: %d rows, generation %d\n", pCatalog->rows, pCatalog->generation );
+			bReload = FALSE;
+			changed = 0;
+		}
+	}
+
+	close( efd );													// the clients go with the process
+	close( sfd );
+	close( lfd );
+	unlink( pSocket );
+	catalog_release( pCatalog );
+
+	return END_LOOP;
+#else
+	print_message( ERROR, "serve needs Linux (epoll)\n" );
+	return SERVE_SOCKET_ERROR;
+#endif
+}
+
+
+// Load the table into a new catalog and sort its indexes
+CATALOG* catalog_load(){
+
+	static char szQuery[512];
+	CATALOG *cat = (CATALOG*)calloc( 1, sizeof(CATALOG) );
+	int i, k;
+
+	pLoading = cat;												// filled by catalog_row, sorted by catalog_order
+	snprintf( szQuery, sizeof(szQuery), "SELECT artist, title, album, year, filename, path, size, mtime, art, alias FROM %s", pTabname );
+	sql_select( szQuery, catalog_row );
+
+	for( k = 0; k < SERVE_KEYS; k++ ){
+		cat->by[k] = (int*)malloc( ( cat->rows + 1 ) * sizeof(int) );
+		for( i = 0; i < cat->rows; i++ )
+			cat->by[k][i] = i;
+		SortKey = k;
+		qsort( cat->by[k], cat->rows, sizeof(int), catalog_order );
+	}
+	pLoading = NULL;
+	cat->generation = 1;
+	cat->refs = 1;
+
+	return cat;
+}
+
+
+// Row callback of catalog_load: append the line of the row to the heap
+void catalog_row( char** cols ){
+
+	static const int keycol[SERVE_KEYS] = { 0, 2, 3 };			// artist, album, year
+	CATALOG *cat = pLoading;
+	size_t start = cat->used;
+	int i, k;
+
+	if( cat->rows == cat->cap ){
+		cat->cap = cat->cap ? cat->cap * 2 : 1024;
+		cat->line    = (size_t*)realloc( cat->line, cat->cap * sizeof(size_t) );
+		cat->linelen = (unsigned*)realloc( cat->linelen, cat->cap * sizeof(unsigned) );
+		for( k = 0; k < SERVE_KEYS; k++ ){
+			cat->key[k]    = (size_t*)realloc( cat->key[k], cat->cap * sizeof(size_t) );
+			cat->keylen[k] = (unsigned*)realloc( cat->keylen[k], cat->cap * sizeof(unsigned) );
+		}
+	}
+
+	for( i = 0, k = 0; i < 10; i++ ){
+		if( k < SERVE_KEYS && keycol[k] == i )
+			cat->key[k][cat->rows] = cat->used;
+		catalog_append( cat, cols[i] != NULL ? cols[i] : "", (size_t)-1 );
+		if( k < SERVE_KEYS && keycol[k] == i ){
+			cat->keylen[k][cat->rows] = cat->used - cat->key[k][cat->rows];
+			k++;
+		}
+		catalog_append( cat, i < 9 ? "\t" : "\n", 1 );
+	}
+
+	cat->line[cat->rows]    = start;
+	cat->linelen[cat->rows] = cat->used - start;
+	cat->rows++;
+}
+
+
+// Append a field to the heap, escaped unless len is given
+void catalog_append( CATALOG* cat, const char* str, size_t len ){
+
+	size_t i, n = ( len == (size_t)-1 ) ? strlen( str ) : len;
+
+	if( cat->used + 2 * n + 1 > cat->size ){
+		while( cat->used + 2 * n + 1 > cat->size )
+			cat->size = cat->size ? cat->size * 2 : ( 1 << 20 );
+		cat->heap = (char*)realloc( cat->heap, cat->size );
+	}
+
+	if( len != (size_t)-1 ){
+		memcpy( cat->heap + cat->used, str, n );
+		cat->used += n;
+		return;
+	}
+
+	for( i = 0; i < n; i++ ){										// as escape_field
+		switch( str[i] ){
+		case '\\': cat->heap[cat->used++] = '\\'; cat->heap[cat->used++] = '\\'; break;
+		case '\t': cat->heap[cat->used++] = '\\'; cat->heap[cat->used++] = 't';  break;
+		case '\n': cat->heap[cat->used++] = '\\'; cat->heap[cat->used++] = 'n';  break;
+		case '\r': cat->heap[cat->used++] = '\\'; cat->heap[cat->used++] = 'r';  break;
+		default:   cat->heap[cat->used++] = str[i]; break;
+		}
+	}
+}
+
+
+// Drop a reference to a catalog, free it with the last one
+void catalog_release( CATALOG* cat ){
+
+	int k;
+
+	if( --cat->refs > 0 )
+		return;
+
+	for( k = 0; k < SERVE_KEYS; k++ ){
+		free( cat->key[k] );
+		free( cat->keylen[k] );
+		free( cat->by[k] );
+	}
+	free( cat->line );
+	free( cat->linelen );
+	free( cat->heap );
+	free( cat );
+}
+
+
+// qsort of the index SortKey of pLoading: by key, then by row
+int catalog_order( const void* a, const void* b ){
+
+	CATALOG *cat = pLoading;
+	int k = SortKey, ra = *(const int*)a, rb = *(const int*)b;
+	int cmp = key_compare( cat->heap + cat->key[k][ra], cat->keylen[k][ra], cat->heap + cat->key[k][rb], cat->keylen[k][rb] );
+
+	return cmp != 0 ? cmp : ra - rb;
+}
+
+
+// Compare two keys ignoring the ASCII case
+int key_compare( const char* a, size_t alen, const char* b, size_t blen ){
+
+	size_t i, n = alen < blen ? alen : blen;
+	int ca, cb;
+
+	for( i = 0; i < n; i++ ){
+		ca = (unsigned char)a[i];
+		cb = (unsigned char)b[i];
+		if( ca >= 'A' && ca <= 'Z' )
+			ca += 'a' - 'A';
+		if( cb >= 'A' && cb <= 'Z' )
+			cb += 'a' - 'A';
+		if( ca != cb )
+			return ca - cb;
+	}
+	return ( alen > blen ) - ( alen < blen );
+}
+
+
+// Version of the table, changed by every commit of a scan: the data_version of SQLite
+// (only changed by the other connections) or the update time of the MyISAM table
+void table_version( char* szVersion ){
+
+	static char szQuery[4 * PATH_MAX];
+
+	szVersion[0] = '\0';
+	pVersion = szVersion;
+
+	if( UseDB == USE_SQLITE )
+		snprintf( szQuery, sizeof(szQuery), "PRAGMA data_version" );
+	else
+		snprintf( szQuery, sizeof(szQuery), "SELECT UPDATE_TIME FROM information_schema.TABLES WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = '%s'", sql_escape( pTabname, 0 ) );
+
+	sql_select( szQuery, table_version_row );
+}
+
+
+// Row callback of table_version
+void table_version_row( char** cols ){
+
+	snprintf( pVersion, 64, "%s", cols[0] != NULL ? cols[0] : "" );
+}
+
+
+// Read the requests of a client and answer them, one at a time
+// Return FALSE if the client is gone or broke the protocol
+bool serve_input( CLIENT* c ){
+
+	ssize_t n;
+
+	for( ;; ){
+
+		if( c->incap - c->inlen < 4096 ){
+			c->incap = c->incap ? c->incap * 2 : 8192;
+			if( c->incap > SERVE_REQUEST * 2 )
+				return FALSE;
+			c->in = (char*)realloc( c->in, c->incap );
+		}
+
+		if( ( n = read( c->fd, c->in + c->inlen, c->incap - c->inlen ) ) == 0 )
+			return FALSE;
+		if( n < 0 ){
+			if( errno == EAGAIN || errno == EWOULDBLOCK )
+				break;
+			return FALSE;
+		}
+		c->inlen += n;
+	}
+
+	return serve_pending( c );
+}
+
+
+// Answer the requests already read from a client, one at a time: called again when a
+// response that filled the socket is out, the next request may be buffered already
+// Return FALSE if the client is gone or broke the protocol
+bool serve_pending( CLIENT* c ){
+
+	static char szRequest[SERVE_REQUEST + 1];
+	size_t len;
+
+	while( c->iovcnt == 0 && c->inlen >= 4 ){						// the next request, once the response is out
+
+		len = (size_t)( (byte)c->in[0] << 24 | (byte)c->in[1] << 16 | (byte)c->in[2] << 8 | (byte)c->in[3] );
+		if( len > SERVE_REQUEST )
+			return FALSE;
+		if( c->inlen < 4 + len )
+			break;
+
+		memcpy( szRequest, c->in + 4, len );
+		szRequest[len] = '\0';
+		memmove( c->in, c->in + 4 + len, c->inlen - 4 - len );
+		c->inlen -= 4 + len;
+
+		serve_request( c, szRequest );
+		if( !serve_flush( c ) )
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+// Build the response to a request: the rows are sent straight out of the catalog heap
+void serve_request( CLIENT* c, char* req ){
+
+	static const char *keyname[SERVE_KEYS] = { "artist", "album", "year" };
+	CATALOG *cat = pCatalog;
+	char *f[6], *p;
+	size_t alen, blen, body, len;
+	int n = 0, k, lo, hi, mid, r, i, limit = 0, rows = 0, head;
+
+	while( n < 6 && ( p = strsep( &req, "\t" ) ) != NULL )		// the values stay escaped, as in the heap
+		f[n++] = p;
+
+	if( n < 3 || f[0][1] != '\0' || strchr( "PER", f[0][0] ) == NULL ){
+		serve_error( c, "bad request" );
+		return;
+	}
+	for( k = 0; k < SERVE_KEYS && strcmp( f[1], keyname[k] ) != 0; k++ );
+	if( k == SERVE_KEYS ){
+		serve_error( c, "unknown field" );
+		return;
+	}
+	if( f[0][0] == 'R' ? ( n < 4 || n > 5 ) : n > 4 ){
+		serve_error( c, "bad number of fields" );
+		return;
+	}
+	if( n == ( f[0][0] == 'R' ? 5 : 4 ) )
+		limit = atoi( f[n - 1] );
+
+	alen = strlen( f[2] );
+	blen = ( f[0][0] == 'R' ) ? strlen( f[3] ) : 0;
+
+	lo = 0;															// first row >= the value
+	hi = cat->rows;
+	while( lo < hi ){
+		mid = ( lo + hi ) / 2;
+		r = cat->by[k][mid];
+		if( key_compare( cat->heap + cat->key[k][r], cat->keylen[k][r], f[2], alen ) < 0 )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	c->iovcnt = 1;													// iov[0] is the head
+	body = 0;
+
+	for( i = lo; i < cat->rows && ( limit <= 0 || rows < limit ); i++ ){
+
+		r   = cat->by[k][i];
+		p   = cat->heap + cat->key[k][r];
+		len = cat->keylen[k][r];
+
+		if( f[0][0] == 'P' ? ( len < alen || key_compare( p, alen, f[2], alen ) != 0 ) :
+			f[0][0] == 'E' ? key_compare( p, len, f[2], alen ) != 0 :
+							 key_compare( p, len, f[3], blen ) > 0 )
+			break;
+
+		if( c->iovcnt > 1 && (char*)c->iov[c->iovcnt - 1].iov_base + c->iov[c->iovcnt - 1].iov_len == cat->heap + cat->line[r] ){
+			c->iov[c->iovcnt - 1].iov_len += cat->linelen[r];	// next line of the heap, one write
+		} else {
+			if( c->iovcnt == c->iovcap ){
+				c->iovcap *= 2;
+				c->iov = (struct iovec*)realloc( c->iov, c->iovcap * sizeof(struct iovec) );
+			}
+			c->iov[c->iovcnt].iov_base = cat->heap + cat->line[r];
+			c->iov[c->iovcnt].iov_len  = cat->linelen[r];
+			c->iovcnt++;
+		}
+		body += cat->linelen[r];
+		rows++;
+	}
+
+	head = snprintf( c->head + 4, sizeof(c->head) - 4, "OK %d %d\n", rows, cat->generation );
+	body += head;
+	if( body > 0xFFFFFFFFULL ){
+		c->iovcnt = 0;
+		serve_error( c, "response too large, use a limit" );
+		return;
+	}
+
+	c->head[0] = (char)( body >> 24 );
+	c->head[1] = (char)( body >> 16 );
+	c->head[2] = (char)( body >> 8 );
+	c->head[3] = (char)body;
+	c->iov[0].iov_base = c->head;
+	c->iov[0].iov_len  = 4 + head;
+	c->iovpos = 0;
+
+	c->cat = cat;													// kept until the response is out
+	cat->refs++;
+}
+
+
+// Response to a bad request
+void serve_error( CLIENT* c, const char* msg ){
+
+	int len = snprintf( c->head + 4, sizeof(c->head) - 4, "ERR %s\n", msg );
+
+	c->head[0] = c->head[1] = c->head[2] = 0;
+	c->head[3] = (char)len;
+	c->iov[0].iov_base = c->head;
+	c->iov[0].iov_len  = 4 + len;
+	c->iovcnt = 1;
+	c->iovpos = 0;
+}
+
+
+// Write as much of the response as the socket takes
+// Return FALSE if the client is gone
+bool serve_flush( CLIENT* c ){
+
+	ssize_t n;
+
+	while( c->iovpos < c->iovcnt ){
+
+		n = writev( c->fd, c->iov + c->iovpos, ( c->iovcnt - c->iovpos < IOV_MAX ) ? c->iovcnt - c->iovpos : IOV_MAX );
+		if( n < 0 )
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+
+		while( n > 0 ){												// skip what has been written
+			if( (size_t)n >= c->iov[c->iovpos].iov_len ){
+				n -= c->iov[c->iovpos].iov_len;
+				c->iovpos++;
+			} else {
+				c->iov[c->iovpos].iov_base = (char*)c->iov[c->iovpos].iov_base + n;
+				c->iov[c->iovpos].iov_len -= n;
+				n = 0;
+			}
+		}
+	}
+
+	c->iovcnt = 0;													// response out
+	c->iovpos = 0;
+	if( c->cat != NULL ){
+		catalog_release( c->cat );
+		c->cat = NULL;
+	}
+	return TRUE;
+}
+
+
+// Close the connection of a client
+void serve_drop( CLIENT* c ){
+
+	if( c->cat != NULL )
+		catalog_release( c->cat );
+	close( c->fd );													// out of the epoll set too
+	free( c->iov );
+	free( c->in );
+	free( c );
+}
+
+
+// diff: write the tracks added, removed and changed from the catalog pDiffOld to pDiffNew.
+// Both are sorted by path and filename, in runs of DiffMemory / 2 spilled to temporary
+// files, then a single pass merges them: the memory doesn't depend on the catalog size
+RETURNCODE diff_catalogs(){
+
+#ifdef __SQLITE
+	SORTER Old, New;
+	const char *o, *n;
+	char szBuff[256];
+	long long added = 0, deleted = 0, modified = 0;
+	RETURNCODE ret;
+	int c;
+
+	if( ( ret = sorter_load( &Old, pDiffOld ) ) != END_LOOP || ( ret = sorter_load( &New, pDiffNew ) ) != END_LOOP )
+		return ret;
+
+	if( OutFormat == OUT_SQL )
+		out_puts( "BEGIN;\n" );
+
+	o = sorter_next( &Old );
+	n = sorter_next( &New );
+
+	while( o != NULL || n != NULL ){
+
+		c = ( o == NULL ) ? 1 : ( n == NULL ) ? -1 : row_compare( o, n );
+
+		if( c < 0 ){												// only in the old catalog
+			diff_record( "delete", (char*)o );
+			deleted++;
+			o = sorter_next( &Old );
+
+		} else if( c > 0 ){											// only in the new one
+			diff_record( "add", (char*)n );
+			added++;
+			n = sorter_next( &New );
+
+		} else {													// in both, same path and filename
+			if( strcmp( o, n ) ){
+				diff_record( "modify", (char*)n );
+				modified++;
+			}
+			o = sorter_next( &Old );
+			n = sorter_next( &New );
+		}
+	}
+
+	if( OutFormat == OUT_SQL )
+		out_puts( "COMMIT;\n" );
+
+	if( bStats ){
+		snprintf( szBuff, sizeof(szBuff), "Rows: %lld old (%d sorted runs), %lld new (%d sorted runs)\n", Old.total, Old.nruns, New.total, New.nruns );
+		print_message( STATUS, "%s", szBuff );
+		snprintf( szBuff, sizeof(szBuff), "Added: %lld, deleted: %lld, modified: %lld\n", added, deleted, modified );
+		print_message( STATUS, "%s", szBuff );
+	}
+
+	sorter_free( &Old );
+	sorter_free( &New );
+
+	return END_LOOP;
+#else
+	return DIFF_PARAM_ERROR;
+#endif
+}
+
+
+// Read the rows of the table of a catalog into sorted runs, ready for sorter_next.
+// A row is a line of escaped fields separated by tabs: path, filename, title, artist,
+// album, year, size, mtime, art and alias. The last run stays in memory
+RETURNCODE sorter_load( SORTER* s, const char* pFile ){
+
+#ifdef __SQLITE
+	const char *column[DIFF_FIELDS];
+	char szQuery[256];
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	size_t need;
+	int i, rc;
+
+	memset( s, 0, sizeof(SORTER) );
+	s->size = DiffMemory / 2;
+	s->last = -1;
+
+	snprintf( szQuery, sizeof(szQuery), "SELECT path, filename, title, artist, album, year, size, mtime, art, alias FROM %s", pTabname );
+
+	if( sqlite3_open_v2( pFile, &db, SQLITE_OPEN_READONLY, NULL ) != SQLITE_OK || sqlite3_prepare_v2( db, szQuery, -1, &stmt, NULL ) != SQLITE_OK ){
+		print_message( ERROR, "%s: %s\n", pFile, sqlite3_errmsg( db ) );
+		sqlite3_close( db );
+		pError = pFile;
+		return DIFF_OPEN_ERROR;
+	}
+
+	if( ( s->heap = (char*)malloc( s->size ) ) == NULL ){
+		sqlite3_finalize( stmt );
+		sqlite3_close( db );
+		return DIFF_PARAM_ERROR;
+	}
+
+	while( ( rc = sqlite3_step( stmt ) ) == SQLITE_ROW ){
+
+		for( i = 0, need = 1; i < DIFF_FIELDS; i++ ){
+			column[i] = (const char*)sqlite3_column_text( stmt, i );
+			if( column[i] == NULL )
+				column[i] = "";
+			need += 2 * strlen( column[i] ) + 1;					// all escaped, worst case
+		}
+
+		if( s->used + need + ( s->nrows + 1 ) * sizeof(char*) > s->size && s->nrows > 0 && !sorter_spill( s ) ){
+			sqlite3_finalize( stmt );
+			sqlite3_close( db );
+			return DIFF_SPILL_ERROR;
+		}
+
+		if( s->nrows == s->cap ){
+			s->cap  = s->cap ? 2 * s->cap : 1024;
+			s->rows = (char**)realloc( s->rows, s->cap * sizeof(char*) );
+		}
+		if( s->used + need > s->size ){								// a row larger than the memory given
+			s->size = s->used + need;
+			s->heap = (char*)realloc( s->heap, s->size );
+		}
+
+		s->rows[s->nrows++] = s->heap + s->used;
+		for( i = 0; i < DIFF_FIELDS; i++ ){
+			if( i > 0 )
+				s->heap[s->used++] = '\t';
+			s->used += row_escape( s->heap + s->used, column[i] );
+		}
+		s->heap[s->used++] = '\0';
+		s->total++;
+	}
+
+	sqlite3_finalize( stmt );
+
+	if( rc != SQLITE_DONE ){
+		print_message( ERROR, "%s: %s\n", pFile, sqlite3_errmsg( db ) );
+		sqlite3_close( db );
+		pError = pFile;
+		return DIFF_OPEN_ERROR;
+	}
+	sqlite3_close( db );
+
+	qsort( s->rows, s->nrows, sizeof(char*), row_order );			// the last run, in memory
+	s->runs = (RUN*)realloc( s->runs, ( s->nruns + 1 ) * sizeof(RUN) );
+	memset( &s->runs[s->nruns], 0, sizeof(RUN) );
+	s->runs[s->nruns].rows  = s->rows;
+	s->runs[s->nruns].nrows = s->nrows;
+	s->nruns++;
+
+	s->merge = (int*)malloc( s->nruns * sizeof(int) );				// the first row of every run
+	for( i = 0; i < s->nruns; i++ )
+		if( run_next( &s->runs[i] ) )
+			sorter_push( s, i );
+
+	return END_LOOP;
+#else
+	return DIFF_PARAM_ERROR;
+#endif
+}
+
+
+// Sort the rows loaded and write them to a temporary file as a run
+bool sorter_spill( SORTER* s ){
+
+	char szName[PATH_MAX];
+	const char *pDir = getenv( "TMPDIR" );
+	RUN r;
+	int fd, i;
+
+	qsort( s->rows, s->nrows, sizeof(char*), row_order );
+
+	snprintf( szName, sizeof(szName), "%s/mp3_scan.diff.XXXXXX", pDir != NULL ? pDir : "/tmp" );
+	if( ( fd = mkstemp( szName ) ) < 0 ){
+		print_message( ERROR, "Unable to create a temporary file in %s: %s\n", pDir != NULL ? pDir : "/tmp", strerror( errno ) );
+		return FALSE;
+	}
+	unlink( szName );												// gone with the last close
+
+	memset( &r, 0, sizeof(r) );
+	r.file = fdopen( fd, "w+" );
+
+	for( i = 0; i < s->nrows; i++ ){
+		fputs( s->rows[i], r.file );
+		putc( '\n', r.file );
+	}
+
+	if( fflush( r.file ) != 0 || fseek( r.file, 0, SEEK_SET ) != 0 ){
+		print_message( ERROR, "Unable to write a temporary file: %s\n", strerror( errno ) );
+		fclose( r.file );
+		return FALSE;
+	}
+
+	s->runs = (RUN*)realloc( s->runs, ( s->nruns + 1 ) * sizeof(RUN) );
+	s->runs[s->nruns++] = r;
+
+	s->nrows = 0;
+	s->used  = 0;
+	return TRUE;
+}
+
+
+// Next row of a sorted catalog, NULL at the end. The row is valid until the next call
+const char* sorter_next( SORTER* s ){
+
+	int top;
+
+	if( s->last >= 0 ){												// the run of the row returned last time goes on
+		top = sorter_pop( s );
+		if( run_next( &s->runs[top] ) )
+			sorter_push( s, top );
+	}
+
+	if( s->nmerge == 0 )
+		return NULL;
+
+	s->last = s->merge[0];
+	return s->runs[s->last].line;
+}
+
+
+// Heap of the runs by their current row, smallest first
+void sorter_push( SORTER* s, int run ){
 
-	default:
-		return DBUNKNOWN_ERROR;
-		
+	int i = s->nmerge++, parent;
+
+	while( i > 0 && row_compare( s->runs[run].line, s->runs[s->merge[parent = ( i - 1 ) / 2]].line ) < 0 ){
+		s->merge[i] = s->merge[parent];
+		i = parent;
 	}
-	
-	return DBOPENED;
+	s->merge[i] = run;
 }
 
+int sorter_pop( SORTER* s ){
 
-// Close the DB Connection
-RETURNCODE CloseDBConnection(){
+	int top = s->merge[0], last = s->merge[--s->nmerge];
+	int i = 0, child;
 
-	switch( UseDB ){
+	while( ( child = 2 * i + 1 ) < s->nmerge ){
+		if( child + 1 < s->nmerge && row_compare( s->runs[s->merge[child + 1]].line, s->runs[s->merge[child]].line ) < 0 )
+			child++;
+		if( row_compare( s->runs[s->merge[child]].line, s->runs[last].line ) >= 0 )
+			break;
+		s->merge[i] = s->merge[child];
+		i = child;
+	}
+	if( s->nmerge > 0 )
+		s->merge[i] = last;
 
-#ifdef __MYSQL
-	case USE_MYSQL: 								// Close MySQL connection
-		
-		mysql_close( DB_handle.mysql_handle );
-		break;
-#endif
+	return top;
+}
 
-#ifdef __SQLITE	
-	case USE_SQLITE:								// Close SQLite connection
 
-		sqlite3_close( DB_handle.sqlite_handle );
-		break;
-#endif
-	
-	default:
-		return DBUNKNOWN_ERROR;
+// Read the next row of a run, FALSE at its end
+bool run_next( RUN* r ){
+
+	ssize_t len;
+
+	if( r->file == NULL ){
+		r->line = ( r->pos < r->nrows ) ? r->rows[r->pos++] : NULL;
+		return r->line != NULL;
 	}
-	
-	return DBCLOSED;
+
+	if( ( len = getline( &r->buf, &r->cap, r->file ) ) <= 0 ){
+		r->line = NULL;
+		return FALSE;
+	}
+	if( r->buf[len - 1] == '\n' )
+		r->buf[len - 1] = '\0';
+	r->line = r->buf;
+
+	return TRUE;
 }
 
 
-// if required create the standard table 
-void create_table(){
+// Free the runs and the rows of a catalog
+void sorter_free( SORTER* s ){
 
-#ifdef __MYSQL
-    #ifndef szBuffer
-	    char szBuffer[512];
-	#endif
-#endif
+	int i;
 
-#ifdef __SQLITE
-    #ifndef szBuffer
-	    char szBuffer[512];
-	#endif
-#endif
+	for( i = 0; i < s->nruns; i++ ){
+		if( s->runs[i].file != NULL )
+			fclose( s->runs[i].file );
+		free( s->runs[i].buf );
+	}
+	free( s->runs );
+	free( s->merge );
+	free( s->rows );
+	free( s->heap );
+}
 
-	switch( UseDB ){
 
-#ifdef __MYSQL
-	case USE_MYSQL:
-		
-		sprintf( szBuffer, "CREATE TABLE IF NOT EXISTS %s ( id INT NOT NULL AUTO_INCREMENT PRIMARY KEY, artist VARCHAR(35) NULL, title VARCHAR(35) NULL, album VARCHAR(35) NULL, year VARCHAR(5) NULL, filename TEXT NULL, path TEXT NULL, size VARCHAR(20) NULL ) ENGINE = MYISAM", pTabname );
+// Escape a field of a row as escape_field does, return its length
+size_t row_escape( char* dst, const char* str ){
 
-		if( mysql_query( DB_handle.mysql_handle, szBuffer ) ){
-			print_message( ERROR, "%s\nUnable to continue\n", mysql_error( DB_handle.mysql_handle ) );
-			CloseDBConnection();
-			exit( 0 );
+	char *start = dst;
+
+	for( ; *str; str++ ){
+		switch( *str ){
+		case '\\': *dst++ = '\\'; *dst++ = '\\'; break;
+		case '\t': *dst++ = '\\'; *dst++ = 't';  break;
+		case '\n': *dst++ = '\\'; *dst++ = 'n';  break;
+		case '\r': *dst++ = '\\'; *dst++ = 'r';  break;
+		default:   *dst++ = *str;                break;
 		}
-		break;
-#endif
+	}
 
-#ifdef __SQLITE
-	 case USE_SQLITE:
+	return dst - start;
+}
 
-		sprintf( szBuffer, "CREATE TABLE IF NOT EXISTS %s ( id INTEGER PRIMARY KEY, artist VARCHAR(35), title VARCHAR(35), album VARCHAR(35), year VARCHAR(5), filename TEXT, path TEXT, size VARCHAR(20) )", pTabname );
 
-	 	if( sqlite3_exec( DB_handle.sqlite_handle, szBuffer, NULL, NULL, NULL ) != SQLITE_OK ){
-			
-			print_message( ERROR, "%s\nUnable to continue", sqlite3_errmsg( DB_handle.sqlite_handle ) );
-			CloseDBConnection();
-			exit( 0 );
-		}
-		break;
-#endif
+// Order of two rows by their key, the path and filename fields. Escaped, the key
+// of a row tells it apart as well: any total order of the keys fits the merge
+int row_compare( const char* a, const char* b ){
 
-	default:
-		break;
-	 }
+	const char *ka = strchr( a, '\t' ), *kb = strchr( b, '\t' );
+	size_t alen, blen;
+	int c;
+
+	ka = strchr( ka + 1, '\t' );									// after the filename
+	kb = strchr( kb + 1, '\t' );
+	alen = ka - a;
+	blen = kb - b;
+
+	if( ( c = memcmp( a, b, alen < blen ? alen : blen ) ) != 0 )
+		return c;
+
+	return alen < blen ? -1 : alen > blen ? 1 : 0;
 }
 
+int row_order( const void* a, const void* b ){
 
-// Sum the size of all mp3 files 
-void size_count( off_t Size ){
-	
-	static long long unsigned int TotalSize = 0;
-	const char *p[] = { "B", "KB", "MB", "GB", "TB" };
-	int index = 0;
+	return row_compare( *(const char**)a, *(const char**)b );
+}
 
-	if( Size >= 0 ){
-		TotalSize += Size;
-	} else {
 
-		char buff[512];
-		float temp = (float)TotalSize;
-		while( temp > 1024 ){
-			index++;
-			temp /= 1024;
+// Write a change of the diff: an NDJSON object with its op and the fields of
+// the row, or the SQL statements that apply it to a table of the old catalog
+void diff_record( const char* Op, char* pRow ){
+
+	static char szQuery[8 * PATH_MAX];
+	const char *column[] = { "path", "filename", "title", "artist", "album", "year", "size", "mtime", "art", "alias" };
+	char *f[DIFF_FIELDS];
+	int i;
+
+	if( split_fields( pRow, f, DIFF_FIELDS ) != DIFF_FIELDS )
+		return;
+
+	if( OutFormat == OUT_SQL ){
+
+		if( strcmp( Op, "add" ) ){
+			sql_delete_query( szQuery, sizeof(szQuery), f[0], f[1] );
+			out_puts( szQuery );
+			out_puts( ";\n" );
+		}
+		if( strcmp( Op, "delete" ) ){
+			sql_row( szQuery, sizeof(szQuery), pTabname, UseDB == USE_MYSQL, f[2], f[3], f[4], f[5], f[1], f[0], (off_t)atoll( f[6] ), (time_t)atoll( f[7] ), f[8], f[9] );
+			out_puts( szQuery );
+			out_puts( ";\n" );
 		}
-		if( index > 4 ) index = 4;
-		sprintf( buff, "Total files size: %.1f %s\n", temp, p[index] );
-		print_message( STATUS, buff );
+		return;
+	}
+
+	out_puts( "{\"op\":\"" );
+	out_puts( Op );
+	out_puts( "\"" );
+
+	for( i = 0; i < DIFF_FIELDS; i++ ){
+
+		out_puts( ",\"" );
+		out_puts( column[i] );
+		out_puts( "\":" );
+
+		if( ( i == 6 || i == 7 ) && f[i][0] != '\0' )				// size and mtime are numbers
+			out_puts( f[i] );
+		else if( i < 6 || f[i][0] != '\0' )
+			out_text( f[i] );
+		else
+			out_puts( "null" );									// as out_record: no art, no alias
 	}
+
+	out_puts( "}\n" );
 }
 
 
-// Read from filename all information available
-void filename_to_field( const char *pFileName, char *szTitle, char *szArtist, char *szAlbum, char *szYear ){
 
-	int i, len, last = strlen(pFileNameFormat) - 1;
-	char Buffer[256];
-	bool stop = FALSE;
-	char *lastC;										// end field pointer, point to the last char of the string to copy
-	char *firstC = Buffer;								// start field pointer, point to the first char of the string to copy
-	
-	strcpy( Buffer, pFileName );						// copy the filename into an internal buffer
-	replace_char( Buffer );								// replace all provided characters with space
+// Sum the size of all mp3 files, print the total with Size -1
+void size_count( off_t Size ){
 	
-	for( i = 0; i < last && !stop; i++ ){
+	static long long TotalSize = 0;								// exact, only the printed value is rounded
 
-		// pFileNameFormat[last] is the field separator
-		if( (lastC = index( firstC, pFileNameFormat[last] )) == NULL ) {
-		
-			lastC = &firstC[strlen(firstC)-4];			// get the end field pointer
-			stop = TRUE;									// force to be the last loop
-		}
-		
-		len = (lastC - firstC) / sizeof(char);			// get the length of the field found
-		while( firstC[0] == 0x20 ){						// delete all spaces at the beginning of the string
-			
-			firstC ++;
-			len--;
-		}
+	if( Size >= 0 ){
+		TotalSize += Size;
+	} else {
 
-		// Una volta che ho controllato il tutto posso fare la copia
-		switch( pFileNameFormat[i] ){
-				
-				case 'A':
-					strncpy( szArtist, firstC, len>=31?30:len );
-					if( szArtist[len-1] == 0x20 )					// remove, if present, a space at the end of the string
-						szArtist[len-1] = '\0';
-					else
-						szArtist[len] = '\0';
-					break;
-				case 'M':
-					strncpy( szAlbum,  firstC, len>=31?30:len );
-					if( szAlbum[len-1] == 0x20 )					// remove, if present, a space at the end of the string
-						szAlbum[len-1] = '\0';
-					else
-						szAlbum[len] = '\0';
-					break;
-				case 'T':
-					strncpy( szTitle,  firstC, len>=31?30:len );
-					if( szTitle[len-1] == 0x20 )					// remove, if present, a space at the end of the string
-						szTitle[len-1] = '\0';
-					else
-						szTitle[len] = '\0';
-					break;
-				case 'Y':
-					strncpy( szYear,   firstC, len>=5?4:len );
-					szYear[5] = '\0';
-					break;
-				default:
-					CloseDBConnection();
-					print_error( BAD_FORMAT );
-		}
-		
-		// set the pointer to first position to actual last + 1
-		firstC = lastC + 1;
+		char buff[128], szSize[32];
+		size_text( TotalSize, szSize, sizeof(szSize) );
+		snprintf( buff, sizeof(buff), "Total files size: %s (%lld bytes)\n", szSize, TotalSize );
+		print_message( STATUS, "%s", buff );
 	}
 }
 
 
+// Size in the largest unit it is at least one of
+void size_text( long long Size, char* szSize, size_t len ){
 
-// Replace all SpaceChar in str with the space character
-void replace_char( char *str ){
-	
-	if( bUseSpaceChar ){
-		unsigned int  i;
-		
-		for( i = 0; i < strlen(str); i++ ){
-			if( strchr( pSpaceChar, str[i] ) != NULL )
-				str[i] = 0x20;								// replace the SpaceChar with space ( " " )
-		}
+	const char *p[] = { "B", "KB", "MB", "GB", "TB", "PB" };
+	double temp = (double)Size;
+	int index = 0;
+
+	while( temp >= 1024 && index < 5 ){
+		index++;
+		temp /= 1024;
 	}
+	snprintf( szSize, len, "%.1f %s", temp, p[index] );
 }
 
 
 // Prompt to user the two strings found and ask to make a choice
 // Return code 0 = user chose field1, 1 = user chose field2
-int chose_field( const char *filename, const char *field1, const char *field2, int fieldname ){
+int chose_field( const char *filename, const char *field1, const char *field2, int fieldname, void *user ){
 	
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;		// one question at a time, the disks are scanned in parallel
 	int res = 0;
 	const char *fieldtag[] = { "title", "artist", "album", "year" };
+
+	pthread_mutex_lock( &lock );
 	printf( "\nInconsistencies found in tag '%s' for '%s' file\n\t1. %s\n\t2. %s\nwhich one should be used [1/2]: ", 
 																			fieldtag[fieldname], filename, field1, field2 );
 	
 	if( (char)getchar() == '2' )
 		res = 1;
 	getchar();
-		
+	pthread_mutex_unlock( &lock );
+
 	return res;
 }
 
@@ -911,6 +3874,12 @@ void print_error( RETURNCODE code ){
 			printf( "%s Unable to open SQLite database file.\n", pErrorMsg );
 			break;
 #endif
+		case USE_REMOTE:
+			printf( "%s Unable to connect to coordinator %s\n", pErrorMsg, pCoordinator );
+			break;
+		case USE_FILE:
+			printf( "%s Unable to create the output file %s\n", pErrorMsg, pOutFile );
+			break;
 		default:
 			break;
 		}
@@ -920,6 +3889,101 @@ void print_error( RETURNCODE code ){
 		printf( "%s DB no proper selected.\n", pErrorMsg );
 		break;
 
+	case WORKERS_PARAM_ERROR:
+		printf("%s Distributed scan invalid parameters, please see the help menu.\n", pErrorMsg);
+		break;
+
+	case WORKER_PARAM_ERROR:
+		printf("%s Worker invalid parameters, please see the help menu.\n", pErrorMsg);
+		break;
+
+	case INTERACTIVE_WORKERS_ERROR:
+		printf("%s Interactive mode cannot be used with a distributed scan.\n", pErrorMsg);
+		break;
+
+	case SOCKET_ERROR:
+		printf("%s Unable to open the distributed scan socket.\n", pErrorMsg);
+		break;
+
+	case PROTOCOL_ERROR:
+		printf("%s Unexpected message from the coordinator.\n", pErrorMsg);
+		break;
+
+	case WORKER_PROGRAM_ERROR:
+		printf("%s Unable to find the program to run the local workers: path too long.\n", pErrorMsg);
+		break;
+
+	case NO_WORKER_AVAILABLE:
+		printf("%s All workers terminated before the end of the scan.\n", pErrorMsg);
+		break;
+
+	case DIFF_PARAM_ERROR:
+		printf("%s Diff needs OLD and NEW, and writes ndjson or sql without --rotate, please see the help menu.\n", pErrorMsg);
+		break;
+
+	case DIFF_OPEN_ERROR:
+		printf("%s Unable to read the catalog %s\n", pErrorMsg, pError);
+		break;
+
+	case DIFF_SPILL_ERROR:
+		printf("%s Unable to spill the sort of the catalogs to TMPDIR.\n", pErrorMsg);
+		break;
+
+	case SIZE_PARAM_ERROR:
+		printf("%s Size only mode uses no database, it cannot be used with --sqlite, --mysql, --output, --update or a distributed scan; --top N needs it.\n", pErrorMsg);
+		break;
+
+	case BULK_PARAM_ERROR:
+		printf("%s Bulk mode loads a table from scratch, it needs --sqlite and cannot be used with --update.\n", pErrorMsg);
+		break;
+
+	case SERVE_PARAM_ERROR:
+		printf("%s Serve needs --socket PATH and a database (--sqlite or --mysql), please see the help menu.\n", pErrorMsg);
+		break;
+
+	case SERVE_SOCKET_ERROR:
+		printf("%s Unable to open the serve socket.\n", pErrorMsg);
+		break;
+
+	case JOBS_PARAM_ERROR:
+		printf("%s Jobs invalid parameters, please see the help menu.\n", pErrorMsg);
+		break;
+
+	case DEADLINE_PARAM_ERROR:
+		printf("%s Deadline invalid parameters, please see the help menu.\n", pErrorMsg);
+		break;
+
+	case UPDATE_WORKERS_ERROR:
+		printf("%s Update mode cannot be used with a distributed scan.\n", pErrorMsg);
+		break;
+
+	case ART_PARAM_ERROR:
+		printf("%s Cover art directory invalid or not writable, please see the help menu.\n", pErrorMsg);
+		break;
+
+	case OUTPUT_PARAM_ERROR:
+		printf("%s Output invalid parameters, please see the help menu.\n", pErrorMsg);
+		break;
+
+	case UPDATE_OUTPUT_ERROR:
+		printf("%s Update mode needs the table of the previous scan, it cannot be used with --output.\n", pErrorMsg);
+		break;
+
+	case FILTER_PARAM_ERROR:
+		printf("%s Exclude or include pattern invalid, please see the help menu.\n", pErrorMsg);
+		break;
+
+	case CHDIR_ERROR:
+		if( pError != NULL )
+			printf("%s Unable to open the directory to scan: %s\n", pErrorMsg, pError);
+		else
+			printf("%s Unable to open the directory to scan.\n", pErrorMsg);
+		break;
+
+	case ROOTS_PARAM_ERROR:
+		printf("%s Several PATHs cannot be used with --relativepath or a distributed scan.\n", pErrorMsg);
+		break;
+
 	default:
 		printf("%s Unknown error message recived, exit.\n", pErrorMsg);
 		break;
@@ -933,7 +3997,7 @@ void print_error( RETURNCODE code ){
 // check input parameter function
 RETURNCODE check_flag( int argc, const char* argv[] ){
 
-	int i, j = 0, db = 0;
+	int i, j = 0, db = 0, last = argc - 1;						// last: PATH
 
 // if no parameter output error message
 	if( argc < 2 )
@@ -942,8 +4006,17 @@ RETURNCODE check_flag( int argc, const char* argv[] ){
 // Init table name by default	
 	pTabname = pTBName;
 
+// serve and diff take no PATH
+	if( !strcmp( argv[1], "serve" ) ){
+		bServe = TRUE;
+		last   = argc;
+	} else if( !strcmp( argv[1], "diff" ) ){
+		bDiff  = TRUE;
+		last   = argc;
+	}
+
 // scan all input parameter
-	for( i = 1; i < argc; i++ ){
+	for( i = bServe || bDiff ? 2 : 1; i < argc; i++ ){
 		
 		if( !strcmp( argv[i], "--version" ) || !strcmp( argv[i], "-v" ) ){
 
@@ -987,17 +4060,111 @@ RETURNCODE check_flag( int argc, const char* argv[] ){
 
 			TagVersion 	   |= ID3v2;
 
+		} else if( !strcmp( argv[i], "--update" ) || !strcmp( argv[i], "-U" ) ){
+
+			bUpdate			= TRUE;
+
+		} else if( !strcmp( argv[i], "--trust-dir-mtime" ) ){
+
+			bTrustDirMtime	= TRUE;
+
+		} else if( !strcmp( argv[i], "--exclude" ) || !strcmp( argv[i], "--include" ) ){
+
+			if( (i+1) >= last || !add_rule( argv[i][2] == 'i' ? '+' : '-', argv[i+1] ) )
+				return FILTER_PARAM_ERROR;
+
+			i++;
+
+			// usage --exclude GLOB, --include GLOB
+
+		} else if( !strcmp( argv[i], "--one-file-system" ) || !strcmp( argv[i], "-x" ) ){
+
+			bOneFileSystem	= TRUE;
+
+		} else if( !strcmp( argv[i], "--dedup-files" ) ){
+
+			bDedupFiles		= TRUE;
+
+		} else if( !strcmp( argv[i], "--no-cache-pollution" ) ){
+
+			bNoCache		= TRUE;
+
+		} else if( !strcmp( argv[i], "--size-only" ) ){
+
+			bSizeOnly		= TRUE;
+
+		} else if( !strcmp( argv[i], "--top" ) ){
+
+			if( (i+1) >= last || ( TopDirs = atoi( argv[i+1] ) ) <= 0 )
+				return SIZE_PARAM_ERROR;
+
+			i++;
+
+			// usage --size-only --top N
+
+		} else if( !strcmp( argv[i], "--bulk" ) ){
+
+			bBulk			= TRUE;
+
+		} else if( !strcmp( argv[i], "--hdd" ) ){
+
+			ReadOrder		= MP3SCAN_ORDER_DIR;
+
+		} else if( !strcmp( argv[i], "--hdd-scan" ) ){
+
+			ReadOrder		= MP3SCAN_ORDER_SCAN;
+
+		} else if( !strcmp( argv[i], "--extract-art" ) ){
+
+			if( (i+1) >= last || realpath( argv[i+1], szArtDir ) == NULL || access( szArtDir, W_OK | X_OK ) != 0 )
+				return ART_PARAM_ERROR;
+
+			pArtDir = szArtDir;
+			i++;
+
+			// usage --extract-art DIR
+
+		} else if( !strcmp( argv[i], "--stats" ) || !strcmp( argv[i], "-S" ) ){
+
+			bStats			= TRUE;
+
+		} else if( !strcmp( argv[i], "--jobs" ) || !strcmp( argv[i], "-j" ) ){
+
+			if( (i+1) >= last )
+				return JOBS_PARAM_ERROR;
+
+			if( !strcmp( argv[i+1], "auto" ) )
+				Jobs = MP3SCAN_JOBS_AUTO;
+			else if( ( Jobs = atoi( argv[i+1] ) ) <= 0 || Jobs > MP3SCAN_JOBS_MAX )
+				return JOBS_PARAM_ERROR;
+
+			i++;
+
+			// usage --jobs N|auto
+
+		} else if( !strcmp( argv[i], "--deadline" ) || !strcmp( argv[i], "-t" ) ){
+
+			if( (i+1) >= last || ( Deadline = atoi( argv[i+1] ) ) <= 0 )
+				return DEADLINE_PARAM_ERROR;
+
+			i++;
+
+			// usage --deadline MS
+
 		} else if( !strcmp( argv[i], "--usefilename" ) || !strcmp( argv[i], "-n" ) ){
 			
-			if( (i+1) >= (argc-1) || argv[i+1][0] == '-' )
+			if( (i+1) >= last || argv[i+1][0] == '-' )
 				return FNFORMAT_PARAM_ERROR;
 
 			pFileNameFormat = argv[++i];
 			bUseFileName	= TRUE;
 
+			if( !check_filename_format( pFileNameFormat ) )
+				return BAD_FORMAT;
+
 		} else if( !strcmp( argv[i], "--spacechar" ) || !strcmp( argv[i], "-s" ) ){
 
-			if( (i+1) >= (argc-1) || argv[i+1][0] == '-' )
+			if( (i+1) >= last || argv[i+1][0] == '-' )
 				return SPACECHAR_PARAM_ERROR;
 
 			pSpaceChar = argv[++i];
@@ -1005,7 +4172,7 @@ RETURNCODE check_flag( int argc, const char* argv[] ){
 
 		} else if( !strcmp( argv[i], "--createtab" ) || !strcmp( argv[i], "-c" ) ){
 	
-			if( (i+1) < (argc-1) && argv[i+1][0] != '-' )
+			if( (i+1) < last && argv[i+1][0] != '-' )
 				pTabname = argv[++i];
 
 			bCreateTab = TRUE;
@@ -1014,7 +4181,7 @@ RETURNCODE check_flag( int argc, const char* argv[] ){
 
 		} else if( !strcmp( argv[i], "--sqlite" ) || !strcmp( argv[i], "-l" ) ){
 	
-			if( (i+1) >= (argc-1) || argv[i+1][0] == '-' )
+			if( (i+1) >= last || argv[i+1][0] == '-' )
 				return SQLITE_PARAM_ERROR;
 
 			pFilename = argv[++i];
@@ -1025,13 +4192,13 @@ RETURNCODE check_flag( int argc, const char* argv[] ){
 
 		} else if( !strcmp( argv[i], "--mysql" ) || !strcmp( argv[i], "-m" ) ){
 			
-			if( (i+3) >= (argc-1) || argv[i+1][0] == '-' || argv[i+2][0] == '-' || argv[i+3][0] == '-' )
+			if( (i+3) >= last || argv[i+1][0] == '-' || argv[i+2][0] == '-' || argv[i+3][0] == '-' )
 				return MYSQL_PARAM_ERROR;
 			
 			pHost = argv[++i];
 			pUser = argv[++i];
 		// if no '-' can be the password AND there is at least one param after the DATABASE this is the password
-			if( argv[i+2][0] != '-' && (i+2) < (argc-1) )						// the password isn't mandatory
+			if( (i+2) < last && argv[i+2][0] != '-' )						// the password isn't mandatory
 				pPass = argv[++i];
 			else
 				pPass = NULL;
@@ -1042,8 +4209,102 @@ RETURNCODE check_flag( int argc, const char* argv[] ){
 			
 			// usage --mysql HOST USER [PASSWORD] DATABASE
 
+		} else if( !strcmp( argv[i], "--output" ) || !strcmp( argv[i], "-o" ) ){
+
+			if( (i+1) >= last || argv[i+1][0] == '-' )
+				return OUTPUT_PARAM_ERROR;
+
+			i++;
+			if( !strncmp( argv[i], "ndjson", 6 ) )
+				OutFormat = OUT_NDJSON;
+			else if( !strncmp( argv[i], "csv", 3 ) )
+				OutFormat = OUT_CSV;
+			else if( !strncmp( argv[i], "sql", 3 ) )
+				OutFormat = OUT_SQL;
+			else
+				return OUTPUT_PARAM_ERROR;
+
+			pOutFile = strchr( argv[i], ':' );					// FORMAT[:FILE|-]
+			if( pOutFile != NULL && ( pOutFile - argv[i] ) != ( OutFormat == OUT_NDJSON ? 6 : 3 ) )
+				return OUTPUT_PARAM_ERROR;
+			if( pOutFile == NULL && argv[i][OutFormat == OUT_NDJSON ? 6 : 3] != '\0' )
+				return OUTPUT_PARAM_ERROR;
+			if( pOutFile != NULL && ( !strcmp( ++pOutFile, "-" ) || pOutFile[0] == '\0' ) )
+				pOutFile = NULL;
+
+			UseDB = USE_FILE;
+			db++;
+
+			// usage --output ndjson|csv|sql[:FILE|-]
+
+		} else if( !strcmp( argv[i], "--memory" ) ){
+
+			if( (i+1) >= last || ( DiffMemory = atoll( argv[i+1] ) * 1048576LL ) <= 0 )
+				return DIFF_PARAM_ERROR;
+
+			i++;
+
+			// usage diff --memory MB
+
+		} else if( !strcmp( argv[i], "--rotate" ) ){
+
+			char *end;
+
+			if( (i+1) >= last || ( RotateSize = strtoll( argv[i+1], &end, 10 ) ) <= 0 )
+				return OUTPUT_PARAM_ERROR;
+
+			switch( *end ){
+				case 'G': case 'g': RotateSize <<= 10;
+				case 'M': case 'm': RotateSize <<= 10;
+				case 'K': case 'k': RotateSize <<= 10;
+				case '\0':			break;
+				default:			return OUTPUT_PARAM_ERROR;
+			}
+			i++;
+
+			// usage --rotate SIZE[K|M|G]
+
+		} else if( !strcmp( argv[i], "--workers" ) || !strcmp( argv[i], "-w" ) ){
+
+			if( (i+1) >= last || ( Workers = atoi( argv[i+1] ) ) <= 0 || Workers > MAX_WORKERS )
+				return WORKERS_PARAM_ERROR;
+
+			i++;
+
+			// usage --workers N
+
+		} else if( !strcmp( argv[i], "--socket" ) ){
+
+			if( (i+1) >= last || argv[i+1][0] == '-' )
+				return SERVE_PARAM_ERROR;
+
+			pSocket = argv[++i];
+
+			// usage serve --socket PATH
+
+		} else if( !strcmp( argv[i], "--listen" ) ){
+
+			if( (i+1) >= last || argv[i+1][0] == '-' )
+				return WORKERS_PARAM_ERROR;
+
+			pListen = argv[++i];
+
+			// usage --listen [HOST:]PORT
+
+		} else if( !strcmp( argv[i], "--worker" ) ){
+
+			if( (i+1) >= argc || argv[i+1][0] == '-' )		// PATH is optional for a worker
+				return WORKER_PARAM_ERROR;
+
+			pCoordinator = argv[++i];
+			UseDB = USE_REMOTE;
+			db++;
+
+			// usage --worker HOST:PORT [PATH]
+
 		} else if( argv[i][0] == '-' && argv[i][1] != '-' ){
 
+			j = 0;
 			while( argv[i][++j] ){
 				
 				switch( argv[i][j] ){
@@ -1071,28 +4332,73 @@ RETURNCODE check_flag( int argc, const char* argv[] ){
 				case '2':
 					TagVersion |= ID3v2;
 					break;
+				case 'S':
+					bStats = TRUE;
+					break;
+				case 'U':
+					bUpdate = TRUE;
+					break;
 				default:
 					pError = argv[i];
 					return UNKNOW_PARAM;
 				}
 			}
 
-		} else if( i != (argc - 1) ){
+		} else if( bServe || ( bDiff && pDiffNew != NULL ) ){
 		
 			pError = argv[i];
 			return UNKNOW_PARAM;
 
-		} else {
+		} else if( bDiff ){											// OLD, then NEW
+
+			if( pDiffOld == NULL )
+				pDiffOld = argv[i];
+			else
+				pDiffNew = argv[i];
+
+		} else {													// a PATH, the last argument is always one
 
-			pPath = argv[i];
+			Roots = (ROOT*)realloc( Roots, ( nRoots + 1 ) * sizeof(ROOT) );
+			memset( &Roots[nRoots], 0, sizeof(ROOT) );
+			Roots[nRoots++].pArg = argv[i];
 		}
 	}
 
+	pPath = nRoots > 0 ? Roots[0].pArg : NULL;
+
+// size only reads neither tags nor a table, the directories are enumerated in parallel
+	if( bSizeOnly ){
+		if( db > 0 || bServe || bDiff || bUpdate || Workers > 0 || pListen != NULL ) return SIZE_PARAM_ERROR;
+		if( Jobs == 0 ) Jobs = MP3SCAN_JOBS_AUTO;
+		bFsInfo = TRUE;
+		return PARAM_OK;
+	}
+	if( TopDirs > 0 ) return SIZE_PARAM_ERROR;
+
+// diff reads two SQLite files and writes the changes, by default as NDJSON to stdout
+	if( bDiff ){
+		if( pDiffNew == NULL || ( db > 0 && UseDB != USE_FILE ) || OutFormat == OUT_CSV || RotateSize > 0 ) return DIFF_PARAM_ERROR;
+		UseDB = USE_FILE;
+		db    = 1;
+	}
+	if( !bDiff && OutFormat == OUT_SQL ) return OUTPUT_PARAM_ERROR;
+// serve reads a table
+	if( bServe && ( pSocket == NULL || ( UseDB != USE_SQLITE && UseDB != USE_MYSQL ) ) ) return SERVE_PARAM_ERROR;
 // check db variable
 	if( db <= 0 ) return NO_DB_SELECTED;
 	if( db >= 2 ) return TOO_MANY_DB;
 // by default get info from ID3v1 and ID3v2
 	if( !TagVersion ) TagVersion = ID3v1 | ID3v2;
+// the previous scan is only known to a single process
+	if( bUpdate && ( Workers > 0 || pListen != NULL ) ) return UPDATE_WORKERS_ERROR;
+// and to a table
+	if( bUpdate && UseDB == USE_FILE ) return UPDATE_OUTPUT_ERROR;
+// relative paths of several roots would mix, workers share a single root
+	if( nRoots > 1 && ( bRelPath || Workers > 0 || pListen != NULL || UseDB == USE_REMOTE ) ) return ROOTS_PARAM_ERROR;
+// the rows are staged in SQLite, the previous ones are not read
+	if( bBulk && ( UseDB != USE_SQLITE || bUpdate ) ) return BULK_PARAM_ERROR;
+// chunks need a file name
+	if( RotateSize > 0 && ( UseDB != USE_FILE || pOutFile == NULL ) ) return OUTPUT_PARAM_ERROR;
 	
 	return PARAM_OK;
 }
@@ -0,0 +1,256 @@
+#ifndef MP3SCAN_H
+#define MP3SCAN_H
+
+#include <sys/types.h>
+#include <limits.h>
+#include <time.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 256
+#endif
+
+/*
+ libmp3scan - scan a directory tree for mp3 files and read their ID3 tags
+
+ mp3scan_scan() walks the tree and calls back the caller with one record for
+ every file (and directory) found, no database is needed. All the state of a
+ scan lives in the scan itself, so several scans can run at the same time in
+ the same process (on different threads). The callbacks of a scan are always
+ called from the thread that called mp3scan_scan().
+
+	MP3SCAN_OPTIONS opt;
+	mp3scan_default_options( &opt );
+	opt.recursive = true;
+	mp3scan_scan( "/mnt/music", &opt, print_record, NULL, NULL );
+*/
+
+#define MP3SCAN_ID3V1 0x01
+#define MP3SCAN_ID3V2 0x02
+#define MP3SCAN_ART   0x04										// read_tags(): also locate the cover art (APIC frame)
+#define MP3SCAN_NOCACHE 0x08									// read_tags(): no read-ahead, drop from the page cache what the read brought in
+
+#define MP3SCAN_TITLE_LEN  1024								// buffer sizes of the tag fields, UTF-8
+#define MP3SCAN_YEAR_LEN   5
+#define MP3SCAN_HASH_LEN   65									// SHA-256 in hex of the cover art
+
+#define MP3SCAN_JOBS_AUTO  -1									// MP3SCAN_OPTIONS.jobs: adapted to the throughput
+#define MP3SCAN_JOBS_MAX   256
+
+#define MP3SCAN_SLOWEST_FILES   10
+#define MP3SCAN_LATENCY_BUCKETS 40								// log2 buckets of microseconds
+
+typedef enum {
+	MP3SCAN_OK = 0,
+	MP3SCAN_OPENDIR_ERROR,										// the root can't be opened
+	MP3SCAN_BAD_FORMAT,											// bad filename_format option
+	MP3SCAN_ART_DIR_ERROR,										// the art_dir can't be opened
+	MP3SCAN_ABORTED												// the callback asked to stop
+} MP3SCAN_RESULT;
+
+typedef enum {
+	MP3SCAN_FILE,												// file read, tags are valid
+	MP3SCAN_FILE_UNCHANGED,										// file unchanged since the previous scan, tags are not read
+	MP3SCAN_FILE_REMOVED,										// file of the previous scan not found anymore
+	MP3SCAN_FILE_QUARANTINED,									// file that never answered within the deadline, no tags
+	MP3SCAN_FILE_ALIAS,											// another name of a file already reported (hard link), no tags
+	MP3SCAN_DIR,												// directory enumerated, after the records of its files
+	MP3SCAN_DIR_REMOVED											// directory of the previous scan not found anymore
+} MP3SCAN_EVENT;
+
+typedef enum {
+	MP3SCAN_MSG_WARNING,
+	MP3SCAN_MSG_VERBOSE											// only of interest for a verbose output
+} MP3SCAN_MSGLEVEL;
+
+typedef enum {
+	MP3SCAN_ORDER_READDIR = 0,									// read the tags in directory order
+	MP3SCAN_ORDER_DIR,											// in disk order, per directory (spinning disks)
+	MP3SCAN_ORDER_SCAN											// in disk order, once the whole tree is enumerated
+} MP3SCAN_ORDER;
+
+typedef struct {
+	MP3SCAN_EVENT event;
+	const char *title;
+	const char *artist;
+	const char *album;
+	const char *year;
+	const char *filename;										// NULL for the directory events
+	const char *relpath;										// directory relative to the root: "" or "a/b/"
+	const char *path;											// directory as stored by a catalog, see MP3SCAN_OPTIONS.relpath
+	const char *file;											// absolute path of the file or directory
+	off_t       size;
+	time_t      mtime;
+	bool        replaces;										// MP3SCAN_FILE of a file changed since the previous scan
+	const char *art;											// MP3SCAN_FILE: hash of the cover art stored in art_dir, "" if none
+	const char *alias;											// MP3SCAN_FILE_ALIAS: the file first reported, as path + filename
+	long long   dir_mtime;										// MP3SCAN_DIR: mtime in nanoseconds (-1: filtered, don't skip it),
+	int         dir_entries;									//   number of entries
+	int         dir_subdirs;									//   and of subdirectories
+} MP3SCAN_RECORD;
+
+// Return non zero to stop the scan
+typedef int (*MP3SCAN_CALLBACK)( const MP3SCAN_RECORD *rec, void *user );
+
+typedef struct {												// mp3 files of a directory, see mp3scan_sizes()
+	const char *relpath;										// directory relative to the root: "" or "a/b/"
+	long long   files;
+	long long   bytes;
+} MP3SCAN_DIRSIZE;
+
+// Return non zero to stop the scan
+typedef int (*MP3SCAN_SIZE_CALLBACK)( const MP3SCAN_DIRSIZE *dir, void *user );
+
+typedef struct MP3SCAN_INDEX MP3SCAN_INDEX;						// catalog of a previous scan, see mp3scan_index_new()
+typedef struct MP3SCAN_FILTER MP3SCAN_FILTER;					// include/exclude rules, see mp3scan_filter_new()
+
+typedef struct {
+	bool           recursive;
+	bool           relpath;										// record paths relative to the root instead of absolute
+	unsigned char  tagversion;									// MP3SCAN_ID3V1 | MP3SCAN_ID3V2
+	const char    *filename_format;								// use the file name if no tag found (see mp3_scan --usefilename), NULL = no
+	const char    *spacechar;									// characters of the file name to replace with space, NULL = none
+	const char    *subdir;										// scan only this directory of the root ("a/b/"), NULL = the root
+	int            deadline;									// per-file read deadline in milliseconds, 0 = none
+	MP3SCAN_INDEX *previous;									// report only the differences from this catalog, NULL = full scan
+	bool           trust_dir_mtime;								// with previous, don't stat the files of unchanged directories
+	const char    *art_dir;										// store the cover art of the files here as HASH.EXT, NULL = no
+	MP3SCAN_ORDER  read_order;									// order of the tag reads, the records follow it
+	MP3SCAN_FILTER *filter;										// skip the entries it excludes, NULL = none
+	const char    *ignore_marker;								// skip the directories holding a file of this name, NULL = none
+	bool           one_file_system;								// don't descend into the directories of other file systems
+	bool           dedup_files;									// report the hard links of a file read once as MP3SCAN_FILE_ALIAS
+	int            jobs;										// files read in parallel by a pool of threads, 0 or 1 = one at a time
+																//   by the scan itself, MP3SCAN_JOBS_AUTO = the level of the best throughput
+	bool           no_cache_pollution;							// leave the page cache as found: the pages of a file brought in by
+																//   the tag and cover art reads are dropped once read (Linux)
+
+	// Choose between the ID3v1 (return 0) and ID3v2 (return 1) value of a field, NULL = keep ID3v1
+	int  (*choose)( const char *file, const char *field1, const char *field2, int fieldname, void *user );
+	// Warnings, NULL = discard
+	void (*message)( MP3SCAN_MSGLEVEL level, const char *msg, void *user );
+} MP3SCAN_OPTIONS;
+
+typedef struct {												// counters are added up, clear it before the first scan
+	long long files_read;
+	long long quarantined;
+	long long recovered;										// quarantined files read by the retry pass
+	long long dirs_enumerated;
+	long long dirs_skipped;										// unchanged mtime, not enumerated
+	long long files_unchanged;
+	long long files_changed;
+	long long files_added;
+	long long files_removed;
+	long long art_stored;										// cover art files written to art_dir
+	long long art_shared;										// cover art already in art_dir
+	long long files_excluded;									// by the filter
+	long long dirs_excluded;									// by the filter or the ignore marker, not opened
+	long long dirs_revisited;									// already scanned through another path: symlink loop, bind mount
+	long long dirs_other_fs;									// not scanned, see one_file_system
+	long long files_aliased;									// MP3SCAN_FILE_ALIAS
+	long long read_usec;										// time spent reading tags
+	long long order_usec;										// time spent mapping and sorting files in disk order
+	long long order_offset;										// files sorted by physical offset (FIEMAP)
+	long long order_inode;										//   and by inode number, the file system can't map them
+	int       jobs_level;										// jobs: level of the last scan, where the next one with these stats starts
+	int       jobs_peak;										//   highest level used
+	long long jobs_changes;										//   changes of level made by MP3SCAN_JOBS_AUTO
+	long long cache_pages;										// no_cache_pollution: pages brought into the page cache by the reads
+	long long cache_kept;										//   and still there after the drop (dirty, locked)
+	long long latency[MP3SCAN_LATENCY_BUCKETS];					// tag read latency histogram, bucket n is <= 2^n us
+	int       nslowest;
+	struct {
+		long long usec;
+		char      file[PATH_MAX];
+	} slowest[MP3SCAN_SLOWEST_FILES];							// sorted, slowest first
+} MP3SCAN_STATS;
+
+typedef struct {												// tag fields in UTF-8, [0] from ID3v1 and [1] from ID3v2
+	char Title[2][MP3SCAN_TITLE_LEN];
+	char Artist[2][MP3SCAN_TITLE_LEN];
+	char Album[2][MP3SCAN_TITLE_LEN];
+	char Year[2][MP3SCAN_YEAR_LEN];
+	bool bBadSize;												// ID3v2 declared size larger than the file
+	off_t ArtOffset;											// with MP3SCAN_ART: image data of the APIC frame in the file,
+	off_t ArtLength;											//   0 if none (or not stored as is: compressed, unsynchronised)
+	char  ArtMime[32];
+	long long CachePages;										// with MP3SCAN_NOCACHE: pages the read brought into the page cache
+	long long CacheKept;										//   and the ones that could not be dropped
+} TAGINFO;
+
+
+void           mp3scan_default_options( MP3SCAN_OPTIONS *opt );
+MP3SCAN_RESULT mp3scan_scan( const char *root, const MP3SCAN_OPTIONS *opt, MP3SCAN_CALLBACK callback, void *user, MP3SCAN_STATS *stats );
+void           mp3scan_stats_add( MP3SCAN_STATS *stats, const MP3SCAN_STATS *add );	// sum of the stats of several scans
+// Sizes only: no tag read, no record. Every directory holding mp3 files is called back once
+// with the count and the total size of its own files (not of its subdirectories), in no
+// particular order. recursive, filter, ignore_marker, one_file_system and dedup_files (a
+// hard linked file is counted once) are honored, the other options are ignored. The
+// directories are enumerated by jobs threads (0 or 1 = one, MP3SCAN_JOBS_AUTO = 4 per CPU)
+// with getdents64() and statx() limited to the size on Linux; the callbacks still come from
+// the calling thread.
+MP3SCAN_RESULT mp3scan_sizes( const char *root, const MP3SCAN_OPTIONS *opt, MP3SCAN_SIZE_CALLBACK callback, void *user, MP3SCAN_STATS *stats );
+
+// Catalog of a previous scan, built from the records it produced. root and
+// relpath must match the ones of the scan that will use it. An index can be
+// used by one scan at a time.
+MP3SCAN_INDEX* mp3scan_index_new( const char *root, bool relpath );
+void           mp3scan_index_add_dir( MP3SCAN_INDEX *idx, const char *path, long long mtime, int entries, int subdirs );
+void           mp3scan_index_add_file( MP3SCAN_INDEX *idx, const char *path, const char *filename, long long size, long long mtime );
+size_t         mp3scan_index_dirs( const MP3SCAN_INDEX *idx );
+void           mp3scan_index_free( MP3SCAN_INDEX *idx );
+
+// Include/exclude rules matched against the path of every entry relative to the root.
+// The first rule that matches an entry decides, an entry no rule matches is scanned.
+// Patterns are globs as in .gitignore: * and ? don't match '/', ** matches across
+// directories, [a-z] and [!a-z] are classes, \ quotes the next character. A trailing
+// '/' matches only directories. A pattern with no other '/' matches the name at any
+// depth, else the path from the root. The rules are compiled into a DFA built while
+// the paths are matched, so that an entry costs a table lookup per character whatever
+// the number of rules. A filter can be used by one scan at a time.
+MP3SCAN_FILTER* mp3scan_filter_new();
+bool           mp3scan_filter_add( MP3SCAN_FILTER *f, const char *pattern, bool include );	// false: bad pattern
+bool           mp3scan_filter_match( MP3SCAN_FILTER *f, const char *path, bool dir );		// true: scanned
+void           mp3scan_filter_free( MP3SCAN_FILTER *f );
+
+// The governor of MP3SCAN_JOBS_AUTO driven by a simulated device instead of a scan, to
+// measure how fast it finds the best level (see mp3scan_bench governor). rate returns the
+// files/s of the device with jobs reads in flight, once per measure window, and the scan is
+// always waiting for a reader. Every window of the first seconds of simulated time, up to
+// max, goes into windows. Return the number of windows.
+typedef double (*MP3SCAN_RATE_CALLBACK)( int jobs, void *user );
+typedef struct {
+	double time;												// s, end of the window
+	double rate;												// files/s measured over it
+	int    limit;												// reads in flight during the window
+	int    base;												// level kept at its end
+} MP3SCAN_GOVWINDOW;
+int            mp3scan_governor_sim( MP3SCAN_RATE_CALLBACK rate, void *user, double seconds, MP3SCAN_GOVWINDOW *windows, int max );
+
+// Building blocks of the scan
+bool is_mp3_file( const char *pFileName );
+bool check_filename_format( const char *pFormat );
+void filename_to_field( const char *pFileName, const char *pFormat, const char *pSpaceChar, char *szTitle, char *szArtist, char *szAlbum, char *szYear );
+void replace_char( char *str, const char *pSpaceChar );
+void read_tags( const char *filename, off_t size, unsigned char Version, TAGINFO *Info );
+// Same as read_tags() on a file of size bytes known only by its first headlen and last taillen
+// bytes, enough to hold its ID3v2 and ID3v1 tags. The frames only id3lib can decode (compressed
+// or unsynchronised) are left empty.
+void parse_tags( const unsigned char *head, size_t headlen, const unsigned char *tail, size_t taillen, off_t size, unsigned char Version, TAGINFO *Info );
+// Merge the ID3v1 and ID3v2 fields of Info into MP3SCAN_TITLE_LEN (MP3SCAN_YEAR_LEN) buffers:
+// ID3v1 first, ID3v2 where it is empty; choose (see MP3SCAN_OPTIONS, NULL = keep ID3v1)
+// decides between two different values
+void merge_tags( const TAGINFO *Info, const char *filename, int (*choose)( const char*, const char*, const char*, int, void* ), void *user,
+				 char *szTitle, char *szArtist, char *szAlbum, char *szYear );
+// Decode the text of an ID3 frame into UTF-8, up to its first null character. encoding is
+// the first byte of an ID3v2 text frame: 0 ISO-8859-1 (also ID3v1), 1 UTF-16 with BOM,
+// 2 UTF-16BE, 3 UTF-8. dst always ends with a '\0', a character that doesn't fit is
+// dropped whole. Return the length of dst.
+size_t id3_text_to_utf8( const unsigned char *src, size_t len, int encoding, char *dst, size_t cap );
+// Escape str for a SQL literal between single quotes into dst of cap bytes (truncated):
+// quotes are doubled, and backslashes too with backslash (MySQL). Return dst
+const char *sql_escape( const char *str, bool backslash, char *dst, size_t cap );
+// INSERT statement of a file into the table of a catalog, as mp3_scan writes it ("" = no art, no alias)
+void sql_row( char *query, size_t len, const char *table, bool backslash, const char *title, const char *artist, const char *album, const char *year,
+			  const char *filename, const char *path, off_t size, time_t mtime, const char *art, const char *alias );
+
+#endif
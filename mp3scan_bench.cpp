@@ -0,0 +1,737 @@
+/*
+ mp3scan_bench - microbenchmark of the per-file functions of the scan
+
+ Measures the time (ns/op) and the heap allocations per call of the functions
+ the scan runs for every entry and every file, on names and tags captured once
+ from a real library. Nothing touches a file system or a database while
+ measuring: the tags are parsed from memory (parse_tags) and the SQL rows are
+ only built. Capture a dataset, then run it before and after a change.
+
+	mp3scan_bench capture PATH NAMES TAGS		capture the entry names and the tags of the mp3 files under PATH
+	mp3scan_bench run NAMES TAGS [MS]			run every benchmark for at least MS milliseconds (default 500)
+	mp3scan_bench order PATH [RUNS]				scan PATH in each read order, the cache of its files dropped first
+	mp3scan_bench filter						check the --exclude and --include rules on paths that match or not
+	mp3scan_bench governor [SEEDS]				time the --jobs auto governor to the best level of simulated devices
+
+ order is the one mode that reads a file system: it compares the directory order
+ with --hdd and --hdd-scan on the disk of PATH, best of RUNS (default 3) cold scans.
+ Only the data of the files can be dropped from the page cache, run it after
+ echo 3 > /proc/sys/vm/drop_caches to start with cold directories too.
+
+ NAMES is a text file, one entry name per line. TAGS holds, for every mp3 file,
+ its name, its size, its ID3v2 tag and its last 128 bytes (the ID3v1 tag).
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "mp3scan.h"
+
+#define FALSE 0
+#define TRUE  1
+
+#define BENCH_MAGIC     "mp3scan_bench tags 1\n"
+#define BENCH_HEAD_MAX  ( 16 << 20 )								// longest ID3v2 tag captured
+#define BENCH_TIME      500											// ms, default time of a benchmark
+#define BENCH_FORMAT    "AT-"										// file name schema of the filename_to_field benchmark
+#define BENCH_SPACECHAR "_"
+#define BENCH_TABLE     "MP3"										// table of the sql_row benchmark, rows built as for SQLite
+#define BENCH_RUNS      3											// cold scans of each read order, the best one is kept
+#define BENCH_SEEDS     20											// noise draws of each simulated device
+#define BENCH_SIM_TIME  30											// s of simulated time of the governor
+#define BENCH_SIM_RATE  2000.0										// files/s of a simulated device at its knee
+#define BENCH_WINDOWS   1024										// measure windows kept, enough for BENCH_SIM_TIME
+
+typedef unsigned char byte;
+
+typedef struct {												// header of a file of TAGS, followed by its name, head and tail
+	long long size;
+	unsigned  namelen;
+	unsigned  headlen;
+	unsigned  taillen;
+} CAPTURE;
+
+typedef struct {												// device of the governor benchmark
+	int    knee;														// reads in flight of the best throughput,
+	double fall;														//   throughput lost by each read past it
+	double noise;														//   and the spread of a measure, +-
+	unsigned seed;
+} DEVICE;
+
+typedef struct {												// tags of a file, in memory
+	CAPTURE hdr;
+	char   *name;
+	byte   *head;
+	byte   *tail;
+	TAGINFO Info;													// parsed once, input of the merge and row benchmarks
+	char    szTitle[MP3SCAN_TITLE_LEN];
+	char    szArtist[MP3SCAN_TITLE_LEN];
+	char    szAlbum[MP3SCAN_TITLE_LEN];
+	char    szYear[MP3SCAN_YEAR_LEN];
+} TAGFILE;
+
+int bench_capture( const char* pPath, const char* pNames, const char* pTags );
+void capture_dir( const char* pDir, FILE* names, FILE* tags, int* nNames, int* nTags );
+bool capture_file( const char* pFile, const char* pName, off_t size, FILE* tags );
+int bench_run( const char* pNames, const char* pTags, int ms );
+bool load_names( const char* pNames );
+bool load_tags( const char* pTags );
+void bench( const char* pName, void (*op)( int ), int n, int ms );
+long long now_nsec();
+void op_copy( int i );
+void op_is_mp3_file( int i );
+void op_replace_char( int i );
+void op_filename_to_field( int i );
+void op_parse_id3v1( int i );
+void op_parse_id3v2( int i );
+void op_parse_tags( int i );
+void op_merge_tags( int i );
+void op_sql_row( int i );
+int bench_order( const char* pPath, int runs );
+void drop_dir( const char* pDir );
+int count_record( const MP3SCAN_RECORD* rec, void* user );
+int bench_filter();
+int bench_governor( int seeds );
+double device_rate( int jobs, void* user );
+
+char **Names;													// dataset
+int   nNames;
+char **Mp3Names;												//   the names of mp3 files among them
+int   nMp3Names;
+TAGFILE *Tags;
+int   nTags;
+
+volatile long long Sink;										// results of the operations, never optimized out
+long long Allocs;												// calls to malloc, calloc and realloc
+
+#ifdef __GLIBC__
+extern "C" void* __libc_malloc( size_t size );
+extern "C" void* __libc_calloc( size_t n, size_t size );
+extern "C" void* __libc_realloc( void* ptr, size_t size );
+
+// Count the allocations of the benchmarks (new goes through malloc too)
+extern "C" void* malloc( size_t size ){
+
+	Allocs++;
+	return __libc_malloc( size );
+}
+
+extern "C" void* calloc( size_t n, size_t size ){
+
+	Allocs++;
+	return __libc_calloc( n, size );
+}
+
+extern "C" void* realloc( void* ptr, size_t size ){
+
+	Allocs++;
+	return __libc_realloc( ptr, size );
+}
+#endif
+
+
+int main( int argc, char* argv[] ){
+
+	if( argc == 5 && !strcmp( argv[1], "capture" ) )
+		return bench_capture( argv[2], argv[3], argv[4] );
+
+	if( ( argc == 4 || argc == 5 ) && !strcmp( argv[1], "run" ) )
+		return bench_run( argv[2], argv[3], argc == 5 ? atoi( argv[4] ) : BENCH_TIME );
+
+	if( ( argc == 3 || argc == 4 ) && !strcmp( argv[1], "order" ) )
+		return bench_order( argv[2], argc == 4 ? atoi( argv[3] ) : BENCH_RUNS );
+
+	if( argc == 2 && !strcmp( argv[1], "filter" ) )
+		return bench_filter();
+
+	if( ( argc == 2 || argc == 3 ) && !strcmp( argv[1], "governor" ) )
+		return bench_governor( argc == 3 ? atoi( argv[2] ) : BENCH_SEEDS );
+
+	fprintf( stderr, "Usage: %s capture PATH NAMES TAGS\n       %s run NAMES TAGS [MS]\n       %s order PATH [RUNS]\n       %s filter\n"
+			 "       %s governor [SEEDS]\n", argv[0], argv[0], argv[0], argv[0], argv[0] );
+	return 1;
+}
+
+
+// Capture the dataset of the library at pPath
+int bench_capture( const char* pPath, const char* pNames, const char* pTags ){
+
+	FILE *names, *tags;
+	int nNames = 0, nTags = 0;
+
+	if( ( names = fopen( pNames, "w" ) ) == NULL || ( tags = fopen( pTags, "wb" ) ) == NULL ){
+		fprintf( stderr, "Unable to create %s or %s\n", pNames, pTags );
+		return 1;
+	}
+
+	fputs( BENCH_MAGIC, tags );
+	capture_dir( pPath, names, tags, &nNames, &nTags );
+
+	if( fclose( names ) != 0 || fclose( tags ) != 0 ){
+		fprintf( stderr, "Unable to write %s or %s\n", pNames, pTags );
+		return 1;
+	}
+
+	printf( "%d names, %d mp3 files captured\n", nNames, nTags );
+	return 0;
+}
+
+
+// Capture the names and the tags of a directory and its subdirectories
+void capture_dir( const char* pDir, FILE* names, FILE* tags, int* nNames, int* nTags ){
+
+	char szPath[PATH_MAX];
+	struct dirent *entry;
+	struct stat info;
+	DIR *dir;
+
+	if( ( dir = opendir( pDir ) ) == NULL )
+		return;
+
+	while( ( entry = readdir( dir ) ) != NULL ){
+
+		if( !strcmp( entry->d_name, "." ) || !strcmp( entry->d_name, ".." ) || strchr( entry->d_name, '\n' ) != NULL )
+			continue;
+
+		snprintf( szPath, PATH_MAX, "%s/%s", pDir, entry->d_name );
+		if( lstat( szPath, &info ) != 0 )
+			continue;
+
+		fprintf( names, "%s\n", entry->d_name );					// every name goes through is_mp3_file
+		(*nNames)++;
+
+		if( S_ISDIR( info.st_mode ) )
+			capture_dir( szPath, names, tags, nNames, nTags );
+		else if( S_ISREG( info.st_mode ) && is_mp3_file( entry->d_name ) && capture_file( szPath, entry->d_name, info.st_size, tags ) )
+			(*nTags)++;
+	}
+
+	closedir( dir );
+}
+
+
+// Append the tags of a file to TAGS
+// Return FALSE if the file can't be read
+bool capture_file( const char* pFile, const char* pName, off_t size, FILE* tags ){
+
+	CAPTURE hdr;
+	byte id3[10], *buf;
+	off_t head = 0;
+	bool bOk;
+	int fd;
+
+	if( ( fd = open( pFile, O_RDONLY ) ) < 0 )
+		return FALSE;
+
+	if( size >= 10 && pread( fd, id3, 10, 0 ) == 10 && !memcmp( id3, "ID3", 3 ) ){	// the whole ID3v2 tag, footer included
+		head = 20 + ( ( id3[6] & 0x7f ) << 21 | ( id3[7] & 0x7f ) << 14 | ( id3[8] & 0x7f ) << 7 | ( id3[9] & 0x7f ) );
+		if( head > BENCH_HEAD_MAX )
+			head = BENCH_HEAD_MAX;
+	}
+	if( head > size )
+		head = size;
+
+	hdr.size    = size;
+	hdr.namelen = strlen( pName );
+	hdr.headlen = head;
+	hdr.taillen = size < 128 ? size : 128;
+
+	buf  = (byte*)malloc( hdr.headlen + hdr.taillen );
+	bOk  = pread( fd, buf, hdr.headlen, 0 ) == (ssize_t)hdr.headlen &&
+		   pread( fd, buf + hdr.headlen, hdr.taillen, size - hdr.taillen ) == (ssize_t)hdr.taillen;
+	close( fd );
+
+	if( bOk ){
+		fwrite( &hdr, sizeof(hdr), 1, tags );
+		fwrite( pName, hdr.namelen, 1, tags );
+		fwrite( buf, hdr.headlen + hdr.taillen, 1, tags );
+	}
+
+	free( buf );
+	return bOk;
+}
+
+
+// Run all the benchmarks on a dataset
+int bench_run( const char* pNames, const char* pTags, int ms ){
+
+	int i;
+
+	if( !load_names( pNames ) || !load_tags( pTags ) ){
+		fprintf( stderr, "Unable to load %s or %s, see mp3scan_bench capture\n", pNames, pTags );
+		return 1;
+	}
+
+	for( i = 0; i < nTags; i++ ){
+		parse_tags( Tags[i].head, Tags[i].hdr.headlen, Tags[i].tail, Tags[i].hdr.taillen, Tags[i].hdr.size, MP3SCAN_ID3V1 | MP3SCAN_ID3V2, &Tags[i].Info );
+		merge_tags( &Tags[i].Info, Tags[i].name, NULL, NULL, Tags[i].szTitle, Tags[i].szArtist, Tags[i].szAlbum, Tags[i].szYear );
+	}
+
+	printf( "%d names (%d mp3), %d tags\n\n", nNames, nMp3Names, nTags );
+	printf( "%-28s %12s %10s %10s\n", "", "ops", "ns/op", "allocs/op" );
+
+	bench( "copy of the name (baseline)", op_copy,              nNames,    ms );
+	bench( "is_mp3_file",                 op_is_mp3_file,       nNames,    ms );
+	bench( "replace_char (+ copy)",       op_replace_char,      nNames,    ms );
+	bench( "filename_to_field",           op_filename_to_field, nMp3Names, ms );
+	bench( "parse_tags ID3v1",            op_parse_id3v1,       nTags,     ms );
+	bench( "parse_tags ID3v2",            op_parse_id3v2,       nTags,     ms );
+	bench( "parse_tags ID3v1 + ID3v2",    op_parse_tags,        nTags,     ms );
+	bench( "merge_tags",                  op_merge_tags,        nTags,     ms );
+	bench( "sql_row",                     op_sql_row,           nTags,     ms );
+
+	return 0;
+}
+
+
+// Load NAMES
+// Return FALSE if it can't be read
+bool load_names( const char* pNames ){
+
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	FILE *f;
+
+	if( ( f = fopen( pNames, "r" ) ) == NULL )
+		return FALSE;
+
+	Names    = (char**)malloc( sizeof(char*) );
+	Mp3Names = (char**)malloc( sizeof(char*) );
+
+	while( ( len = getline( &line, &cap, f ) ) > 0 ){
+
+		if( line[len - 1] == '\n' )
+			line[len - 1] = '\0';
+
+		Names = (char**)realloc( Names, ( nNames + 1 ) * sizeof(char*) );
+		Names[nNames++] = strdup( line );
+
+		if( is_mp3_file( line ) ){
+			Mp3Names = (char**)realloc( Mp3Names, ( nMp3Names + 1 ) * sizeof(char*) );
+			Mp3Names[nMp3Names++] = Names[nNames - 1];
+		}
+	}
+
+	free( line );
+	fclose( f );
+	return nNames > 0;
+}
+
+
+// Load TAGS
+// Return FALSE if it can't be read
+bool load_tags( const char* pTags ){
+
+	char szMagic[sizeof(BENCH_MAGIC)];
+	CAPTURE hdr;
+	TAGFILE *t;
+	FILE *f;
+
+	if( ( f = fopen( pTags, "rb" ) ) == NULL )
+		return FALSE;
+
+	if( fread( szMagic, sizeof(BENCH_MAGIC) - 1, 1, f ) != 1 || memcmp( szMagic, BENCH_MAGIC, sizeof(BENCH_MAGIC) - 1 ) != 0 ){
+		fclose( f );
+		return FALSE;
+	}
+
+	while( fread( &hdr, sizeof(hdr), 1, f ) == 1 ){
+
+		Tags = (TAGFILE*)realloc( Tags, ( nTags + 1 ) * sizeof(TAGFILE) );
+		t = &Tags[nTags];
+		t->hdr  = hdr;
+		t->name = (char*)malloc( hdr.namelen + 1 );
+		t->head = (byte*)malloc( hdr.headlen + hdr.taillen + 1 );
+		t->tail = t->head + hdr.headlen;
+
+		if( fread( t->name, hdr.namelen, 1, f ) + ( hdr.headlen + hdr.taillen > 0 ? fread( t->head, hdr.headlen + hdr.taillen, 1, f ) : 1 ) != 2 ){
+			free( t->name );
+			free( t->head );
+			break;
+		}
+		t->name[hdr.namelen] = '\0';
+		nTags++;
+	}
+
+	fclose( f );
+	return nTags > 0;
+}
+
+
+// Run op over the n items of its dataset until ms milliseconds have passed, print the ns and the allocations per call
+void bench( const char* pName, void (*op)( int ), int n, int ms ){
+
+	long long start, elapsed, allocs, ops = 0;
+	int i;
+
+	if( n == 0 ){
+		printf( "%-28s %12s\n", pName, "no data" );
+		return;
+	}
+
+	for( i = 0; i < n; i++ )										// warm up
+		op( i );
+
+	allocs = Allocs;
+	start  = now_nsec();
+
+	do {
+		for( i = 0; i < n; i++ )
+			op( i );
+		ops += n;
+	} while( ( elapsed = now_nsec() - start ) < ms * 1000000LL );
+
+	allocs = Allocs - allocs;
+
+#ifdef __GLIBC__
+	printf( "%-28s %12lld %10.1f %10.2f\n", pName, ops, (double)elapsed / ops, (double)allocs / ops );
+#else
+	printf( "%-28s %12lld %10.1f %10s\n", pName, ops, (double)elapsed / ops, "n/a" );
+#endif
+}
+
+
+// Monotonic clock in nanoseconds
+long long now_nsec(){
+
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/*
+ * Operations, i is the item of the dataset
+ */
+
+void op_copy( int i ){
+
+	char szBuffer[256];
+
+	snprintf( szBuffer, sizeof(szBuffer), "%s", Names[i] );
+	Sink += szBuffer[0];
+}
+
+
+void op_is_mp3_file( int i ){
+
+	Sink += is_mp3_file( Names[i] );
+}
+
+
+void op_replace_char( int i ){
+
+	char szBuffer[256];
+
+	snprintf( szBuffer, sizeof(szBuffer), "%s", Names[i] );		// replace_char works in place
+	replace_char( szBuffer, BENCH_SPACECHAR );
+	Sink += szBuffer[0];
+}
+
+
+void op_filename_to_field( int i ){
+
+	static char szTitle[MP3SCAN_TITLE_LEN], szArtist[MP3SCAN_TITLE_LEN], szAlbum[MP3SCAN_TITLE_LEN], szYear[MP3SCAN_YEAR_LEN];
+
+	filename_to_field( Mp3Names[i], BENCH_FORMAT, BENCH_SPACECHAR, szTitle, szArtist, szAlbum, szYear );
+	Sink += szTitle[0];
+}
+
+
+void op_parse_id3v1( int i ){
+
+	static TAGINFO Info;
+
+	parse_tags( Tags[i].head, Tags[i].hdr.headlen, Tags[i].tail, Tags[i].hdr.taillen, Tags[i].hdr.size, MP3SCAN_ID3V1, &Info );
+	Sink += Info.Title[0][0];
+}
+
+
+void op_parse_id3v2( int i ){
+
+	static TAGINFO Info;
+
+	parse_tags( Tags[i].head, Tags[i].hdr.headlen, Tags[i].tail, Tags[i].hdr.taillen, Tags[i].hdr.size, MP3SCAN_ID3V2, &Info );
+	Sink += Info.Title[1][0];
+}
+
+
+void op_parse_tags( int i ){
+
+	static TAGINFO Info;
+
+	parse_tags( Tags[i].head, Tags[i].hdr.headlen, Tags[i].tail, Tags[i].hdr.taillen, Tags[i].hdr.size, MP3SCAN_ID3V1 | MP3SCAN_ID3V2, &Info );
+	Sink += Info.Title[0][0] + Info.Title[1][0];
+}
+
+
+void op_merge_tags( int i ){
+
+	static char szTitle[MP3SCAN_TITLE_LEN], szArtist[MP3SCAN_TITLE_LEN], szAlbum[MP3SCAN_TITLE_LEN], szYear[MP3SCAN_YEAR_LEN];
+
+	merge_tags( &Tags[i].Info, Tags[i].name, NULL, NULL, szTitle, szArtist, szAlbum, szYear );
+	Sink += szTitle[0];
+}
+
+
+void op_sql_row( int i ){
+
+	static char szQuery[8 * PATH_MAX];
+
+	sql_row( szQuery, sizeof(szQuery), BENCH_TABLE, FALSE, Tags[i].szTitle, Tags[i].szArtist, Tags[i].szAlbum, Tags[i].szYear, Tags[i].name,
+			 "/mnt/music/Artist/Album/", Tags[i].hdr.size, 1262304000, "", "" );
+	Sink += szQuery[0];
+}
+
+
+/*
+ * Read orders
+ */
+
+// Scan pPath in directory order, with --hdd and with --hdd-scan, print the best of runs cold scans of each
+int bench_order( const char* pPath, int runs ){
+
+	static const struct {
+		const char   *pName;
+		MP3SCAN_ORDER order;
+	} Orders[] = {
+		{ "readdir",    MP3SCAN_ORDER_READDIR },
+		{ "--hdd",      MP3SCAN_ORDER_DIR },
+		{ "--hdd-scan", MP3SCAN_ORDER_SCAN }
+	};
+	MP3SCAN_OPTIONS opt;
+	MP3SCAN_STATS stats;
+	long long start, elapsed, best, files;
+	int i, r;
+
+	if( runs < 1 )
+		runs = 1;
+
+	mp3scan_default_options( &opt );
+	opt.recursive = TRUE;
+
+	printf( "%-28s %12s %10s %10s %10s\n", "", "files", "ms", "files/s", "sorted" );
+
+	for( i = 0; i < (int)( sizeof(Orders) / sizeof(Orders[0]) ); i++ ){
+
+		opt.read_order = Orders[i].order;
+		best = -1;
+
+		for( r = 0; r < runs; r++ ){
+
+			drop_dir( pPath );
+			memset( &stats, 0, sizeof(stats) );
+			files = 0;
+
+			start = now_nsec();
+			if( mp3scan_scan( pPath, &opt, count_record, &files, &stats ) != MP3SCAN_OK ){
+				fprintf( stderr, "Unable to scan %s\n", pPath );
+				return 1;
+			}
+			elapsed = now_nsec() - start;
+
+			if( best < 0 || elapsed < best )
+				best = elapsed;
+		}
+
+		printf( "%-28s %12lld %10.1f %10.0f %10lld\n", Orders[i].pName, files, best / 1e6,
+				best > 0 ? files * 1e9 / best : 0.0, stats.order_offset + stats.order_inode );
+	}
+
+	return 0;
+}
+
+
+// Drop from the page cache the data of the files of a directory and its subdirectories
+void drop_dir( const char* pDir ){
+
+	char szPath[PATH_MAX];
+	struct dirent *entry;
+	struct stat info;
+	DIR *dir;
+	int fd;
+
+	if( ( dir = opendir( pDir ) ) == NULL )
+		return;
+
+	while( ( entry = readdir( dir ) ) != NULL ){
+
+		if( !strcmp( entry->d_name, "." ) || !strcmp( entry->d_name, ".." ) )
+			continue;
+
+		if( snprintf( szPath, PATH_MAX, "%s/%s", pDir, entry->d_name ) >= PATH_MAX || lstat( szPath, &info ) != 0 )
+			continue;
+
+		if( S_ISDIR( info.st_mode ) )
+			drop_dir( szPath );
+		else if( S_ISREG( info.st_mode ) && ( fd = open( szPath, O_RDONLY ) ) >= 0 ){
+			posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+			close( fd );
+		}
+	}
+
+	closedir( dir );
+}
+
+
+int count_record( const MP3SCAN_RECORD* rec, void* user ){
+
+	if( rec->event == MP3SCAN_FILE )
+		(*(long long*)user)++;
+	return 0;
+}
+
+
+/*
+ * Filter rules
+ */
+
+// Match a path against a single --exclude rule, print the cases where the filter is wrong
+// Return the number of them
+int bench_filter(){
+
+	static const struct {
+		const char *pRule;
+		const char *pPath;
+		bool        bDir;
+		bool        bExcluded;
+	} Cases[] = {
+		{ "foo",          "foo",                 FALSE, TRUE  },	// a name at any depth
+		{ "foo",          "a/b/foo",             FALSE, TRUE  },
+		{ "foo",          "xfoo",                FALSE, FALSE },	//   only a whole name
+		{ "foo",          "a/xfoo",              FALSE, FALSE },
+		{ "foo",          "foox",                FALSE, FALSE },
+		{ "*.part.mp3",   "a/b.part.mp3",        FALSE, TRUE  },
+		{ "*.part.mp3",   "a/b.mp3",             FALSE, FALSE },
+		{ ".Trash/",      ".Trash",              TRUE,  TRUE  },	// directories only
+		{ ".Trash/",      "a/.Trash",            TRUE,  TRUE  },
+		{ ".Trash/",      "My.Trash",            TRUE,  FALSE },
+		{ ".Trash/",      ".Trash",              FALSE, FALSE },
+		{ "@eaDir/",      "music@eaDir",         TRUE,  FALSE },
+		{ "@eaDir/",      "music/@eaDir",        TRUE,  TRUE  },
+		{ "**/b",         "b",                   FALSE, TRUE  },
+		{ "**/b",         "a/x/b",               FALSE, TRUE  },
+		{ "**/b",         "xb",                  FALSE, FALSE },
+		{ "**/b",         "a/xb",                FALSE, FALSE },
+		{ "a/**/b",       "a/b",                 FALSE, TRUE  },
+		{ "a/**/b",       "a/x/y/b",             FALSE, TRUE  },
+		{ "a/**/b",       "a/xb",                FALSE, FALSE },
+		{ "a/**/b",       "a/x/yb",              FALSE, FALSE },
+		{ "a/**",         "a/x/y",               FALSE, TRUE  },
+		{ "a/*",          "a/x/y",               FALSE, FALSE },	// anchored to the root
+		{ "a/*",          "b/a/x",               FALSE, FALSE },
+		{ "Podcasts/?*",  "Podcasts/Favorites",  TRUE,  TRUE  },
+		{ "[!a-c]?.mp3",  "d1.mp3",              FALSE, TRUE  },
+		{ "[!a-c]?.mp3",  "a1.mp3",              FALSE, FALSE },
+		{ "\\*.mp3",      "*.mp3",               FALSE, TRUE  },
+		{ "\\*.mp3",      "a.mp3",               FALSE, FALSE }
+	};
+	MP3SCAN_FILTER *f;
+	int i, failed = 0;
+	bool bExcluded;
+
+	for( i = 0; i < (int)( sizeof(Cases) / sizeof(Cases[0]) ); i++ ){
+
+		f = mp3scan_filter_new();
+		mp3scan_filter_add( f, Cases[i].pRule, FALSE );
+		bExcluded = !mp3scan_filter_match( f, Cases[i].pPath, Cases[i].bDir );
+		mp3scan_filter_free( f );
+
+		if( bExcluded != Cases[i].bExcluded ){
+			printf( "--exclude %-14s %-22s %s: %s, expected %s\n", Cases[i].pRule, Cases[i].pPath, Cases[i].bDir ? "dir " : "file",
+					bExcluded ? "excluded" : "scanned", Cases[i].bExcluded ? "excluded" : "scanned" );
+			failed++;
+		}
+	}
+
+	printf( "%d of %d cases right\n", i - failed, i );
+	return failed;
+}
+
+
+// Run the governor of --jobs auto on devices whose throughput grows with the reads in flight
+// up to a knee, then stays flat or falls, every measure off by up to +-5%. Report, worst of
+// seeds noise draws: the time its base level takes to reach the knee (within a step of it),
+// the share of the windows after that with the base still there (noise can make a probe
+// below look as fast), and the share spent probing away from the base
+int bench_governor( int seeds ){
+
+	static const int Knees[] = { 2, 4, 8, 16, 32, 64, 128 };
+	static const double Falls[] = { 0.0, 0.01 };
+	static MP3SCAN_GOVWINDOW Windows[BENCH_WINDOWS];
+	DEVICE dev;
+	double worst, kept, probing;
+	int k, f, s, n, i, step, first, at, away, failed = 0;
+
+	printf( "%6s %6s %12s %12s %12s\n", "knee", "fall", "reached s", "kept", "probing" );
+
+	for( k = 0; k < (int)( sizeof(Knees) / sizeof(Knees[0]) ); k++ ){
+		for( f = 0; f < (int)( sizeof(Falls) / sizeof(Falls[0]) ); f++ ){
+
+			worst = probing = 0;
+			kept = 1;
+			step = Knees[k] / 8 > 1 ? Knees[k] / 8 : 1;
+
+			for( s = 0; s < seeds && worst >= 0; s++ ){
+
+				dev.knee  = Knees[k];
+				dev.fall  = Falls[f];
+				dev.noise = 0.05;
+				dev.seed  = s + 1;
+				n = mp3scan_governor_sim( device_rate, &dev, BENCH_SIM_TIME, Windows, BENCH_WINDOWS );
+
+				for( first = 0; first < n && abs( Windows[first].base - Knees[k] ) > step; first++ )
+					;
+				if( first == n ){
+					worst = -1;
+					break;
+				}
+
+				for( at = away = 0, i = first + 1; i < n; i++ ){
+					if( abs( Windows[i].base - Knees[k] ) <= step )
+						at++;
+					if( Windows[i].limit != Windows[i].base )
+						away++;
+				}
+
+				if( Windows[first].time > worst )
+					worst = Windows[first].time;
+				if( first + 1 < n && (double)at / ( n - first - 1 ) < kept )
+					kept = (double)at / ( n - first - 1 );
+				if( first + 1 < n && (double)away / ( n - first - 1 ) > probing )
+					probing = (double)away / ( n - first - 1 );
+			}
+
+			if( worst < 0 ){
+				printf( "%6d %5.0f%% %12s\n", Knees[k], Falls[f] * 100, "never" );
+				failed++;
+			} else
+				printf( "%6d %5.0f%% %12.1f %11.0f%% %11.0f%%\n", Knees[k], Falls[f] * 100, worst, kept * 100, probing * 100 );
+		}
+	}
+
+	return failed;
+}
+
+
+// Files/s of the simulated device of user with jobs reads in flight, with the noise of a measure
+double device_rate( int jobs, void* user ){
+
+	DEVICE *dev = (DEVICE*)user;
+	double rate;
+
+	if( jobs <= dev->knee )
+		rate = BENCH_SIM_RATE * jobs / dev->knee;
+	else if( ( rate = BENCH_SIM_RATE * ( 1 - dev->fall * ( jobs - dev->knee ) ) ) < BENCH_SIM_RATE / 10 )
+		rate = BENCH_SIM_RATE / 10;											// thrashing, but still reading
+
+	return rate * ( 1 + dev->noise * ( 2.0 * rand_r( &dev->seed ) / RAND_MAX - 1 ) );
+}